@@ -0,0 +1,107 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+#include "arena.h"
+
+// Blocks are rounded up to MIN_BLOCK_SIZE << class. Larger requests are
+// passed to the heap directly.
+#define MIN_BLOCK_SIZE 128
+#define NUM_CLASSES 8
+// Bytes of freed blocks kept per class, at least one block is kept.
+// Bounds the idle footprint after a burst to NUM_CLASSES times this.
+#define MAX_CACHED_BYTES 32768
+
+// Precedes every block, padded so that the block is suitably aligned for
+// any type.
+union block_header {
+	struct {
+		// Next cached block of the class.
+		union block_header *next;
+		// Size class, NUM_CLASSES for blocks that bypass the cache.
+		size_t class;
+		// Usable size of the block.
+		size_t size;
+	} info;
+	max_align_t align;
+};
+
+static union block_header *cached_blocks[NUM_CLASSES];
+static unsigned int num_cached[NUM_CLASSES];
+static struct arena_stats arena_stats;
+
+static size_t class_size(size_t class)
+{
+	return (size_t)MIN_BLOCK_SIZE << class;
+}
+
+void *arena_alloc(size_t size)
+{
+	size_t class = 0;
+	while (class < NUM_CLASSES && class_size(class) < size) {
+		class += 1;
+	}
+	union block_header *block = NULL;
+	if (class < NUM_CLASSES && cached_blocks[class] != NULL) {
+		block = cached_blocks[class];
+		cached_blocks[class] = block->info.next;
+		num_cached[class] -= 1;
+		arena_stats.cached -= block->info.size;
+	} else {
+		size_t block_size = class < NUM_CLASSES ? class_size(class) :
+							  size;
+		block = malloc(sizeof(*block) + block_size);
+		if (block == NULL) {
+			return NULL;
+		}
+		block->info.class = class;
+		block->info.size = block_size;
+		arena_stats.heap_allocs += 1;
+	}
+	arena_stats.in_use += block->info.size;
+	if (arena_stats.in_use + arena_stats.cached > arena_stats.peak) {
+		arena_stats.peak = arena_stats.in_use + arena_stats.cached;
+	}
+	memset(block + 1, 0, block->info.size);
+	return block + 1;
+}
+
+void arena_free(void *ptr)
+{
+	if (ptr == NULL) {
+		return;
+	}
+	union block_header *block = (union block_header *)ptr - 1;
+	size_t class = block->info.class;
+	arena_stats.in_use -= block->info.size;
+	bool cache_full = class < NUM_CLASSES && num_cached[class] > 0 &&
+			  (num_cached[class] + 1) * block->info.size >
+				  MAX_CACHED_BYTES;
+	if (class == NUM_CLASSES || cache_full) {
+		free(block);
+		return;
+	}
+	block->info.next = cached_blocks[class];
+	cached_blocks[class] = block;
+	num_cached[class] += 1;
+	arena_stats.cached += block->info.size;
+}
+
+void arena_get_stats(struct arena_stats *stats)
+{
+	*stats = arena_stats;
+}
+
+void arena_release(void)
+{
+	for (size_t i = 0; i < NUM_CLASSES; ++i) {
+		while (cached_blocks[i] != NULL) {
+			union block_header *block = cached_blocks[i];
+			cached_blocks[i] = block->info.next;
+			free(block);
+		}
+		num_cached[i] = 0;
+	}
+	arena_stats.cached = 0;
+}
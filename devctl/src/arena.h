@@ -0,0 +1,35 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Allocator for objects that live for the duration of a single request.
+// Freed blocks are kept and handed out again for later requests of
+// similar size, so once the busiest load seen so far has been handled,
+// requests no longer allocate from the heap and do not fragment it.
+
+struct arena_stats {
+	// Bytes of blocks handed out and not freed yet.
+	size_t in_use;
+	// Bytes of freed blocks kept for reuse.
+	size_t cached;
+	// Highest in_use + cached seen.
+	size_t peak;
+	// Blocks allocated from the heap, stops growing under steady load.
+	uint64_t heap_allocs;
+};
+
+// Returns a zeroed block of at least size bytes, NULL on memory
+// allocation failure.
+void *arena_alloc(size_t size);
+
+// Returns the block to the arena. ptr can be NULL.
+void arena_free(void *ptr);
+
+void arena_get_stats(struct arena_stats *stats);
+
+// Frees all cached blocks. Blocks in use stay valid.
+void arena_release(void);
+
+#endif
@@ -2,45 +2,43 @@
 #include <string.h>
 #include <syslog.h>
 #include <stdlib.h>
+#include <errno.h>
+#include <limits.h>
 
 #include <uci.h>
+#include <libubox/avl-cmp.h>
 
 #include "args.h"
+#include "serial.h"
 
-static bool uci_check_success(int ret, const struct uci_ptr *ptr,
-			      struct uci_context *ctx, const char *option_name)
-{
-	if (ret == UCI_ERR_NOTFOUND) {
-		char *error;
-		uci_get_errorstr(ctx, &error, "");
-		syslog(LOG_ERR, "Option '%s' not found%s", option_name, error);
-		free(error);
-		return false;
-	} else if ((ptr->flags & UCI_LOOKUP_COMPLETE) == 0) {
-		syslog(LOG_ERR, "Option '%s' not found", option_name);
-		return false;
+// Values of the optional settings that are not set.
+#define DEFAULT_CONFIG                                                     \
+	{                                                                  \
+		.log_level = 7, .skip_redundant = false,                   \
+		.breaker_threshold = 0, .breaker_probe_ms = 5000,          \
+		.parse_retries = 0, .retry_backoff_ms = 50,                \
+		.record_file = NULL, .record_max_kb = 4096,                \
+		.state_file = NULL, .ctl_socket = NULL,                    \
+		.health_interval_ms = 0, .health_degraded_ms = 500,        \
+		.health_dead_after = 3                                     \
 	}
-	return true;
-}
 
-// option must not be const as it will be modified by uci_lookup_ptr
-// Returs NULL on failure.
-char *uci_get_option(struct uci_context *ctx, struct uci_ptr *ptr, char *option,
-		     const char *const_option)
-{
-	int ret = uci_lookup_ptr(ctx, ptr, option, false);
-	if (!uci_check_success(ret, ptr, ctx, const_option)) {
-		return NULL;
-	}
-	if (ptr->o->type != UCI_TYPE_STRING) {
-		syslog(LOG_ERR,
-		       "Option '%s' value is of unexpected type: expected UCI_TYPE_STRING, got %u",
-		       const_option, ptr->o->type);
-		return NULL;
-	}
+// Snapshot file used if state_file is not set.
+#define DEFAULT_STATE_FILE "/var/run/devctl/state"
 
-	return ptr->o->v.string;
-}
+struct devctl_config config = DEFAULT_CONFIG;
+
+LIST_HEAD(device_configs);
+
+// Configured devices with an alias, keyed by the alias.
+static AVL_TREE(device_aliases, avl_strcmp, false, NULL);
+
+// Devices read by read_config(), used once commit_config() is called.
+static LIST_HEAD(new_device_configs);
+static AVL_TREE(new_device_aliases, avl_strcmp, false, NULL);
+
+LIST_HEAD(device_groups);
+static LIST_HEAD(new_device_groups);
 
 bool str_to_bool(const char *str, bool *result)
 {
@@ -68,3 +66,460 @@ bool str_to_digit(const char *str, int *result)
 	*result = str[0] - 48;
 	return true;
 }
+
+bool str_to_uint(const char *str, unsigned int *result)
+{
+	if (str[0] < '0' || str[0] > '9') {
+		return false;
+	}
+	char *end;
+	errno = 0;
+	unsigned long val = strtoul(str, &end, 10);
+	if (errno != 0 || *end != '\0' || val > UINT_MAX) {
+		return false;
+	}
+	*result = (unsigned int)val;
+	return true;
+}
+
+// Copies the value of the option to *result, leaves it NULL if the option
+// is not set.
+// Returns true on success, false on memory allocation failure.
+static bool dup_option(struct uci_context *ctx, struct uci_section *s,
+		       const char *option, char **result)
+{
+	const char *val = uci_lookup_option_string(ctx, s, option);
+	if (val == NULL) {
+		return true;
+	}
+	*result = strdup(val);
+	if (*result == NULL) {
+		syslog(LOG_ERR, "Failed to allocate memory for device config");
+		return false;
+	}
+	return true;
+}
+
+// Parses a single 'device' section.
+// Returns true on success, false on failure.
+static bool parse_device_section(struct uci_context *ctx,
+				 struct uci_section *s,
+				 struct device_config *dev)
+{
+	if (!dup_option(ctx, s, "path", &dev->path) ||
+	    !dup_option(ctx, s, "serial", &dev->serial)) {
+		return false;
+	}
+	if (dev->path == NULL && dev->serial == NULL) {
+		syslog(LOG_ERR,
+		       "Option 'path' or 'serial' not found in device section %s",
+		       s->e.name);
+		return false;
+	}
+	// Used to refer to the device in error messages.
+	const char *path = dev->path != NULL ? dev->path : dev->serial;
+	// The alias is indexed right away, free_config_list() removes it
+	// from the index whenever it is set.
+	if (!dup_option(ctx, s, "alias", &dev->alias)) {
+		return false;
+	}
+	if (dev->alias != NULL) {
+		dev->alias_avl.key = dev->alias;
+		if (avl_insert(&new_device_aliases, &dev->alias_avl) != 0) {
+			syslog(LOG_ERR, "Alias %s of %s is already used",
+			       dev->alias, path);
+			free(dev->alias);
+			dev->alias = NULL;
+			return false;
+		}
+	}
+
+	const char *val = uci_lookup_option_string(ctx, s, "baudrate");
+	if (val != NULL && !str_to_uint(val, &dev->baudrate)) {
+		syslog(LOG_ERR,
+		       "Unrecognized value for option 'baudrate' of %s: %s",
+		       path, val);
+		return false;
+	}
+	if (dev->baudrate != 0 && !serial_baudrate_supported(dev->baudrate)) {
+		syslog(LOG_ERR, "Unsupported baud rate for %s: %u", path,
+		       dev->baudrate);
+		return false;
+	}
+	val = uci_lookup_option_string(ctx, s, "probe_baudrate");
+	if (val != NULL && !str_to_bool(val, &dev->probe_baudrate)) {
+		syslog(LOG_ERR,
+		       "Unrecognized value for option 'probe_baudrate' of %s: %s",
+		       path, val);
+		return false;
+	}
+	val = uci_lookup_option_string(ctx, s, "static");
+	if (val != NULL && !str_to_bool(val, &dev->is_static)) {
+		syslog(LOG_ERR,
+		       "Unrecognized value for option 'static' of %s: %s",
+		       path, val);
+		return false;
+	}
+	val = uci_lookup_option_string(ctx, s, "timeout_ms");
+	if (val != NULL && (!str_to_uint(val, &dev->timeout_ms) ||
+			    dev->timeout_ms > INT_MAX)) {
+		syslog(LOG_ERR,
+		       "Unrecognized value for option 'timeout_ms' of %s: %s",
+		       path, val);
+		return false;
+	}
+	if (dev->is_static && dev->path == NULL) {
+		syslog(LOG_ERR, "Static device %s needs option 'path'", path);
+		return false;
+	}
+	return true;
+}
+
+// Reads 'device' sections of the package into new_device_configs.
+// Returns true on success, false on failure.
+static bool read_device_configs(struct uci_context *ctx,
+				struct uci_package *pkg)
+{
+	struct uci_element *e;
+	uci_foreach_element(&pkg->sections, e) {
+		struct uci_section *s = uci_to_section(e);
+		if (strcmp(s->type, "device") != 0) {
+			continue;
+		}
+		struct device_config *dev = calloc(1, sizeof(*dev));
+		if (dev == NULL) {
+			syslog(LOG_ERR,
+			       "Failed to allocate memory for device config");
+			return false;
+		}
+		// Added before parsing so that free_config_list() cleans it
+		// up on failure.
+		list_add_tail(&dev->list, &new_device_configs);
+		if (!parse_device_section(ctx, s, dev)) {
+			return false;
+		}
+		syslog(LOG_DEBUG,
+		       "Device options: path: %s, serial: %s, alias: %s, baudrate: %u, probe_baudrate: %d, static: %d",
+		       dev->path != NULL ? dev->path : "-",
+		       dev->serial != NULL ? dev->serial : "-",
+		       dev->alias != NULL ? dev->alias : "-", dev->baudrate,
+		       dev->probe_baudrate, dev->is_static);
+	}
+	return true;
+}
+
+static const struct device_group *find_group_in(const struct list_head *list,
+					       const char *name)
+{
+	const struct device_group *group;
+	list_for_each_entry(group, list, list) {
+		if (strcmp(group->name, name) == 0) {
+			return group;
+		}
+	}
+	return NULL;
+}
+
+// Parses a single 'group' section. Members may be given as a list or as
+// a single option.
+// Returns true on success, false on failure.
+static bool parse_group_section(struct uci_context *ctx,
+				struct uci_section *s,
+				struct device_group *group)
+{
+	const char *name = uci_lookup_option_string(ctx, s, "name");
+	if (name == NULL) {
+		syslog(LOG_ERR, "Option 'name' not found in group section %s",
+		       s->e.name);
+		return false;
+	}
+	if (find_group_in(&new_device_groups, name) != NULL) {
+		syslog(LOG_ERR, "Group %s is defined more than once", name);
+		return false;
+	}
+	group->name = strdup(name);
+	if (group->name == NULL) {
+		syslog(LOG_ERR, "Failed to allocate memory for group config");
+		return false;
+	}
+	struct uci_option *o = uci_lookup_option(ctx, s, "device");
+	unsigned int count = 1;
+	struct uci_element *e;
+	if (o != NULL && o->type == UCI_TYPE_LIST) {
+		count = 0;
+		uci_foreach_element(&o->v.list, e) {
+			count += 1;
+		}
+	}
+	if (o == NULL || count == 0) {
+		syslog(LOG_ERR, "Group %s has no devices", name);
+		return false;
+	}
+	group->devices = calloc(count, sizeof(*group->devices));
+	if (group->devices == NULL) {
+		syslog(LOG_ERR, "Failed to allocate memory for group config");
+		return false;
+	}
+	if (o->type == UCI_TYPE_STRING) {
+		group->devices[0] = strdup(o->v.string);
+		group->num_devices = group->devices[0] != NULL ? 1 : 0;
+	} else {
+		uci_foreach_element(&o->v.list, e) {
+			group->devices[group->num_devices] = strdup(e->name);
+			if (group->devices[group->num_devices] == NULL) {
+				break;
+			}
+			group->num_devices += 1;
+		}
+	}
+	if (group->num_devices != count) {
+		syslog(LOG_ERR, "Failed to allocate memory for group config");
+		return false;
+	}
+	return true;
+}
+
+// Reads 'group' sections of the package into new_device_groups.
+// Returns true on success, false on failure.
+static bool read_device_groups(struct uci_context *ctx,
+			       struct uci_package *pkg)
+{
+	struct uci_element *e;
+	uci_foreach_element(&pkg->sections, e) {
+		struct uci_section *s = uci_to_section(e);
+		if (strcmp(s->type, "group") != 0) {
+			continue;
+		}
+		struct device_group *group = calloc(1, sizeof(*group));
+		if (group == NULL) {
+			syslog(LOG_ERR,
+			       "Failed to allocate memory for group config");
+			return false;
+		}
+		// Added before parsing so that free_group_list() cleans it up
+		// on failure.
+		list_add_tail(&group->list, &new_device_groups);
+		if (!parse_group_section(ctx, s, group)) {
+			return false;
+		}
+		syslog(LOG_DEBUG, "Group %s: %u devices", group->name,
+		       group->num_devices);
+	}
+	return true;
+}
+
+// Reads an optional non-negative integer option of the section. result
+// is left unchanged if the option is not set.
+// Returns false if the value is not valid.
+static bool get_uint_option(struct uci_context *ctx, struct uci_section *s,
+			    const char *option, unsigned int *result)
+{
+	const char *val = uci_lookup_option_string(ctx, s, option);
+	if (val != NULL && (!str_to_uint(val, result) || *result > INT_MAX)) {
+		syslog(LOG_ERR, "Unrecognized value for option '%s': %s",
+		       option, val);
+		return false;
+	}
+	return true;
+}
+
+// Copies a file name option to *result, leaves it NULL if the value is
+// NULL or empty.
+// Returns true on success, false on memory allocation failure.
+static bool dup_file_option(const char *val, char **result)
+{
+	if (val == NULL || val[0] == '\0') {
+		return true;
+	}
+	*result = strdup(val);
+	if (*result == NULL) {
+		syslog(LOG_ERR, "Failed to allocate memory for config");
+		return false;
+	}
+	return true;
+}
+
+// Reads the 'devctl' section of the package into cfg.
+// Returns true on success, false on failure.
+static bool read_settings(struct uci_context *ctx, struct uci_package *pkg,
+			  struct devctl_config *cfg)
+{
+	struct uci_section *s = uci_lookup_section(ctx, pkg, "devctl");
+	if (s == NULL) {
+		syslog(LOG_ERR, "Section 'devctl' not found");
+		return false;
+	}
+	// log_level must be specified, the rest is optional.
+	const char *val = uci_lookup_option_string(ctx, s, "log_level");
+	if (val == NULL) {
+		syslog(LOG_ERR, "Option 'log_level' not found");
+		return false;
+	}
+	if (!str_to_digit(val, &cfg->log_level) || cfg->log_level > 7) {
+		syslog(LOG_ERR, "Unrecognized value for option 'log_level': %s",
+		       val);
+		return false;
+	}
+	val = uci_lookup_option_string(ctx, s, "skip_redundant");
+	if (val != NULL && !str_to_bool(val, &cfg->skip_redundant)) {
+		syslog(LOG_ERR,
+		       "Unrecognized value for option 'skip_redundant': %s",
+		       val);
+		return false;
+	}
+	if (!get_uint_option(ctx, s, "breaker_threshold",
+			     &cfg->breaker_threshold) ||
+	    !get_uint_option(ctx, s, "breaker_probe_ms",
+			     &cfg->breaker_probe_ms) ||
+	    !get_uint_option(ctx, s, "parse_retries", &cfg->parse_retries) ||
+	    !get_uint_option(ctx, s, "retry_backoff_ms",
+			     &cfg->retry_backoff_ms) ||
+	    !get_uint_option(ctx, s, "record_max_kb", &cfg->record_max_kb) ||
+	    !get_uint_option(ctx, s, "health_interval_ms",
+			     &cfg->health_interval_ms) ||
+	    !get_uint_option(ctx, s, "health_degraded_ms",
+			     &cfg->health_degraded_ms) ||
+	    !get_uint_option(ctx, s, "health_dead_after",
+			     &cfg->health_dead_after)) {
+		return false;
+	}
+	val = uci_lookup_option_string(ctx, s, "record_file");
+	if (!dup_file_option(val, &cfg->record_file)) {
+		return false;
+	}
+	val = uci_lookup_option_string(ctx, s, "state_file");
+	if (!dup_file_option(val != NULL ? val : DEFAULT_STATE_FILE,
+			     &cfg->state_file)) {
+		return false;
+	}
+	val = uci_lookup_option_string(ctx, s, "ctl_socket");
+	if (!dup_file_option(val, &cfg->ctl_socket)) {
+		return false;
+	}
+	syslog(LOG_DEBUG,
+	       "Options: log_level: %d, skip_redundant: %d, breaker_threshold: %u, breaker_probe_ms: %u, parse_retries: %u, retry_backoff_ms: %u, record_file: %s, record_max_kb: %u, state_file: %s, ctl_socket: %s, health_interval_ms: %u, health_degraded_ms: %u, health_dead_after: %u",
+	       cfg->log_level, cfg->skip_redundant, cfg->breaker_threshold,
+	       cfg->breaker_probe_ms, cfg->parse_retries, cfg->retry_backoff_ms,
+	       cfg->record_file != NULL ? cfg->record_file : "-",
+	       cfg->record_max_kb,
+	       cfg->state_file != NULL ? cfg->state_file : "-",
+	       cfg->ctl_socket != NULL ? cfg->ctl_socket : "-",
+	       cfg->health_interval_ms, cfg->health_degraded_ms,
+	       cfg->health_dead_after);
+	return true;
+}
+
+static void free_config_list(struct list_head *list, struct avl_tree *aliases)
+{
+	struct device_config *dev, *tmp;
+	list_for_each_entry_safe(dev, tmp, list, list) {
+		list_del(&dev->list);
+		if (dev->alias != NULL) {
+			avl_delete(aliases, &dev->alias_avl);
+		}
+		free(dev->path);
+		free(dev->serial);
+		free(dev->alias);
+		free(dev);
+	}
+}
+
+static void free_group_list(struct list_head *list)
+{
+	struct device_group *group, *tmp;
+	list_for_each_entry_safe(group, tmp, list, list) {
+		list_del(&group->list);
+		for (unsigned int i = 0; i < group->num_devices; ++i) {
+			free(group->devices[i]);
+		}
+		free(group->devices);
+		free(group->name);
+		free(group);
+	}
+}
+
+bool read_config(struct uci_context *ctx, struct uci_package *pkg,
+		 struct devctl_config *cfg)
+{
+	*cfg = (struct devctl_config)DEFAULT_CONFIG;
+	if (!read_settings(ctx, pkg, cfg) || !read_device_configs(ctx, pkg) ||
+	    !read_device_groups(ctx, pkg)) {
+		discard_config(cfg);
+		return false;
+	}
+	return true;
+}
+
+void commit_config(const struct devctl_config *cfg)
+{
+	free_config();
+	config = *cfg;
+	struct device_config *dev, *tmp;
+	list_for_each_entry_safe(dev, tmp, &new_device_configs, list) {
+		list_move_tail(&dev->list, &device_configs);
+		if (dev->alias != NULL) {
+			// Aliases were checked to be unique while reading.
+			avl_delete(&new_device_aliases, &dev->alias_avl);
+			avl_insert(&device_aliases, &dev->alias_avl);
+		}
+	}
+	list_splice_tail_init(&new_device_groups, &device_groups);
+}
+
+void discard_config(struct devctl_config *cfg)
+{
+	free(cfg->record_file);
+	cfg->record_file = NULL;
+	free(cfg->state_file);
+	cfg->state_file = NULL;
+	free(cfg->ctl_socket);
+	cfg->ctl_socket = NULL;
+	free_config_list(&new_device_configs, &new_device_aliases);
+	free_group_list(&new_device_groups);
+}
+
+const struct device_config *find_device_config(const char *path)
+{
+	const struct device_config *dev;
+	list_for_each_entry(dev, &device_configs, list) {
+		if (dev->path != NULL && strcmp(dev->path, path) == 0) {
+			return dev;
+		}
+	}
+	return NULL;
+}
+
+const struct device_config *find_device_config_by_serial(const char *serial)
+{
+	const struct device_config *dev;
+	list_for_each_entry(dev, &device_configs, list) {
+		if (dev->serial != NULL && strcmp(dev->serial, serial) == 0) {
+			return dev;
+		}
+	}
+	return NULL;
+}
+
+const struct device_config *find_device_config_by_alias(const char *alias)
+{
+	const struct device_config *dev =
+		avl_find_element(&device_aliases, alias, dev, alias_avl);
+	return dev;
+}
+
+const struct device_group *find_device_group(const char *name)
+{
+	return find_group_in(&device_groups, name);
+}
+
+void free_config(void)
+{
+	free(config.record_file);
+	config.record_file = NULL;
+	free(config.state_file);
+	config.state_file = NULL;
+	free(config.ctl_socket);
+	config.ctl_socket = NULL;
+	free_config_list(&device_configs, &device_aliases);
+	free_group_list(&device_groups);
+}
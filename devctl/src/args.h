@@ -3,10 +3,119 @@
 
 #include <stdbool.h>
 #include <uci.h>
+#include <libubox/list.h>
+#include <libubox/avl.h>
 
-// Get option from UCI. Only string option type is supported.
-char *uci_get_option(struct uci_context *ctx, struct uci_ptr *ptr, char *option,
-		     const char *const_option);
+// Program settings read from UCI.
+struct devctl_config {
+	int log_level;
+	// Reply to commands that would not change the cached pin state
+	// without sending them to the device.
+	bool skip_redundant;
+	// Number of requests in a row without response after which requests
+	// to the device are rejected until it responds to a probe. 0
+	// disables rejecting requests.
+	unsigned int breaker_threshold;
+	// Interval of the probes sent to a device whose requests are
+	// rejected.
+	unsigned int breaker_probe_ms;
+	// How many times to resend a command if the response cannot be
+	// parsed.
+	unsigned int parse_retries;
+	// Delay before the first resend, doubled for every next one.
+	unsigned int retry_backoff_ms;
+	// File the serial traffic is recorded to, NULL if not set.
+	char *record_file;
+	// Size limit of the recording in KiB.
+	unsigned int record_max_kb;
+	// File the state snapshot is kept in, NULL if disabled.
+	char *state_file;
+	// Path of the control socket, NULL if disabled.
+	char *ctl_socket;
+	// Interval of the keepalive probes sent to idle devices, 0 disables
+	// probing.
+	unsigned int health_interval_ms;
+	// Round trip time estimate above which a device is degraded, 0 never.
+	unsigned int health_degraded_ms;
+	// Exchanges in a row without response after which a device is dead,
+	// 0 never.
+	unsigned int health_dead_after;
+};
+
+extern struct devctl_config config;
+
+// Settings of a single device, read from UCI 'device' sections. A device
+// is identified by its file name or by its USB serial number.
+struct device_config {
+	struct list_head list;
+	// Node in the index of aliases, linked if alias is set.
+	struct avl_node alias_avl;
+	// Device file name, NULL if the device is identified by serial.
+	char *path;
+	// USB serial number, NULL if not set.
+	char *serial;
+	// Name clients can use instead of the file name, NULL if not set.
+	char *alias;
+	// Baud rate, 0 if not set.
+	unsigned int baudrate;
+	// Look for the highest baud rate the device responds at.
+	bool probe_baudrate;
+	// List the device even if it is not detected as a supported board,
+	// e.g. a pseudo-terminal.
+	bool is_static;
+	// Default response timeout, 0 if not set.
+	unsigned int timeout_ms;
+};
+
+// Settings of all configured devices.
+extern struct list_head device_configs;
+
+// Named set of devices, read from UCI 'group' sections, that pin
+// commands can be sent to at once.
+struct device_group {
+	struct list_head list;
+	char *name;
+	// Members as given in the configuration: file names, IDs or aliases.
+	// Resolved when a command is sent, so members follow replugged
+	// boards.
+	char **devices;
+	unsigned int num_devices;
+};
+
+// All configured groups.
+extern struct list_head device_groups;
+
+// Reads the 'devctl' section of the package into cfg and the 'device'
+// and 'group' sections aside. Nothing in use changes until commit_config() is
+// called, so a configuration that fails to read can simply be dropped.
+// Returns true on success, false on failure. Everything read is freed
+// on failure.
+bool read_config(struct uci_context *ctx, struct uci_package *pkg,
+		 struct devctl_config *cfg);
+
+// Replaces config with cfg, and device_configs and device_groups with the
+// devices and groups read by read_config(). The previous settings are
+// freed, pointers to them must not be kept.
+void commit_config(const struct devctl_config *cfg);
+
+// Frees what read_config() read, for when it is not committed.
+void discard_config(struct devctl_config *cfg);
+
+// Returns settings of the device, NULL if the device is not configured.
+const struct device_config *find_device_config(const char *path);
+
+// Returns settings of the device with the USB serial number, NULL if it
+// is not configured.
+const struct device_config *find_device_config_by_serial(const char *serial);
+
+// Returns settings of the device with the alias, NULL if there is none.
+const struct device_config *find_device_config_by_alias(const char *alias);
+
+// Returns the group with the name, NULL if there is none.
+const struct device_group *find_device_group(const char *name);
+
+// Frees config, device_configs and device_groups.
+void free_config(void);
 
 // Converts str to boolean value. String "1" is converted to true,
 // "0" is converted to false.
@@ -17,4 +126,8 @@ bool str_to_bool(const char *str, bool *result);
 // Converts string containg exactly one ASCII digit to that digit.
 bool str_to_digit(const char *str, int *result);
 
+// Converts string containing a decimal number to unsigned int.
+// Returns true on successful conversion, false otherwise.
+bool str_to_uint(const char *str, unsigned int *result);
+
 #endif
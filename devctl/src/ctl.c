@@ -0,0 +1,502 @@
+// For accept4().
+#define _GNU_SOURCE
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <syslog.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#include <libubox/list.h>
+#include <libubox/uloop.h>
+#include <libubox/utils.h>
+
+#include "ctl.h"
+#include "ctl_proto.h"
+#include "args.h"
+#include "arena.h"
+#include "devices.h"
+#include "result.h"
+#include "serial.h"
+
+// Connections accepted at the same time, further ones are refused.
+#define CTL_MAX_CONNS 16
+// Fits several requests with the longest name, so that a single read
+// takes in a burst of pipelined requests.
+#define CTL_RX_BUFSIZE 4096
+#define CTL_REPLY_FRAME_SIZE (2 + CTL_REPLY_SIZE)
+#define CTL_MAX_FRAME_SIZE (2 + CTL_REQ_SIZE + CTL_NAME_MAXLEN)
+// Room for the replies of the requests in flight and as many replies
+// that were not sent yet because the client is not reading.
+#define CTL_TX_BUFSIZE (2 * CTL_MAX_IN_FLIGHT * CTL_REPLY_FRAME_SIZE)
+
+_Static_assert(CTL_RX_BUFSIZE >= CTL_MAX_FRAME_SIZE,
+	       "the receive buffer must fit the longest request");
+
+// Connection of a client.
+struct ctl_conn {
+	struct list_head list;
+	struct uloop_fd fd;
+	// Sends the replies queued during the current loop iteration with a
+	// single write.
+	struct uloop_timeout flush;
+	// Pin commands waiting for the device, see struct ctl_request.
+	struct list_head reqs;
+	unsigned int in_flight;
+	// The socket was full, the rest of tx is sent once it is writable.
+	bool blocked;
+	size_t rx_len;
+	size_t tx_len;
+	unsigned char rx[CTL_RX_BUFSIZE];
+	unsigned char tx[CTL_TX_BUFSIZE];
+};
+
+// Pin command of a connection waiting for the device to respond.
+struct ctl_request {
+	// Node in the requests of the connection.
+	struct list_head list;
+	// NULL if the connection was closed, the result is then dropped.
+	struct ctl_conn *conn;
+	struct serial_req sreq;
+	// Resends the command after a response that could not be parsed.
+	struct uloop_timeout retry;
+	unsigned int attempts;
+	uint32_t tag;
+	uint32_t pin;
+	bool turn_on;
+	char device[];
+};
+
+static struct uloop_fd listen_fd = { .fd = -1 };
+// Path the socket is bound to, NULL if not listening.
+static char *listen_path;
+static LIST_HEAD(conns);
+static unsigned int num_conns;
+
+static uint32_t get_le(const unsigned char *p, size_t len)
+{
+	uint32_t val = 0;
+	for (size_t i = 0; i < len; ++i) {
+		val |= (uint32_t)p[i] << (8 * i);
+	}
+	return val;
+}
+
+static void put_le(unsigned char *p, uint32_t val, size_t len)
+{
+	for (size_t i = 0; i < len; ++i) {
+		p[i] = (unsigned char)(val >> (8 * i));
+	}
+}
+
+static void close_conn(struct ctl_conn *conn)
+{
+	struct ctl_request *req, *tmp;
+	list_for_each_entry_safe(req, tmp, &conn->reqs, list) {
+		list_del_init(&req->list);
+		req->conn = NULL;
+	}
+	uloop_timeout_cancel(&conn->flush);
+	uloop_fd_delete(&conn->fd);
+	close(conn->fd.fd);
+	list_del(&conn->list);
+	num_conns -= 1;
+	free(conn);
+	syslog(LOG_DEBUG, "Control connection closed");
+}
+
+// Every request reserves room for its reply in tx when it is accepted,
+// so queue_reply() never runs out of space. Requests that do not fit
+// are left in rx until replies are sent.
+static bool can_accept(const struct ctl_conn *conn)
+{
+	return conn->in_flight < CTL_MAX_IN_FLIGHT &&
+	       conn->tx_len + (conn->in_flight + 1) * CTL_REPLY_FRAME_SIZE <=
+		       CTL_TX_BUFSIZE;
+}
+
+static void queue_reply(struct ctl_conn *conn, uint8_t op,
+			enum devctl_status_code status, uint8_t value,
+			uint32_t tag)
+{
+	unsigned char *p = conn->tx + conn->tx_len;
+	put_le(p, CTL_REPLY_SIZE, 2);
+	p[2] = op;
+	p[3] = (unsigned char)status;
+	p[4] = value;
+	p[5] = 0;
+	put_le(p + 6, tag, 4);
+	conn->tx_len += CTL_REPLY_FRAME_SIZE;
+	if (!conn->flush.pending) {
+		uloop_timeout_set(&conn->flush, 0);
+	}
+}
+
+static void ctl_request_retry_cb(struct uloop_timeout *t)
+{
+	struct ctl_request *req = container_of(t, struct ctl_request, retry);
+	serial_send(req->device, &req->sreq);
+}
+
+// Queues the reply once the device has responded. Called from
+// serial_send() if the request completes right away, so it must not
+// read further requests of the connection.
+static void ctl_request_cb(struct serial_req *sreq, int status)
+{
+	struct ctl_request *req =
+		container_of(sreq, struct ctl_request, sreq);
+
+	struct pin_result res;
+	get_req_result(&res, sreq, status, req->turn_on);
+	// Resending a superseded command would undo the later one.
+	if (res.status == DEVCTL_PARSE_FAILURE && !sreq->superseded &&
+	    schedule_retry(sreq, &req->retry, &req->attempts)) {
+		return;
+	}
+	record_status(sreq, res.status);
+	if (!sreq->superseded) {
+		update_pin_state(req->device, req->pin, req->turn_on, &res);
+	}
+	if (req->conn != NULL) {
+		list_del(&req->list);
+		req->conn->in_flight -= 1;
+		queue_reply(req->conn, CTL_OP_SET_PIN, res.status, 0, req->tag);
+	}
+	arena_free(req);
+}
+
+static void set_pin(struct ctl_conn *conn, const char *name, uint32_t pin,
+		    bool turn_on, enum serial_priority priority,
+		    int timeout_ms, uint32_t tag)
+{
+	const char *dev_id = resolve_device(name);
+	if (dev_id == NULL) {
+		queue_reply(conn, CTL_OP_SET_PIN, DEVCTL_CONNECT_FAIL, 0, tag);
+		return;
+	}
+	if (config.skip_redundant && !serial_is_busy(dev_id) &&
+	    serial_get_pin_state(dev_id, pin) ==
+		    (turn_on ? PIN_STATE_ON : PIN_STATE_OFF)) {
+		queue_reply(conn, CTL_OP_SET_PIN, DEVCTL_OK, 0, tag);
+		return;
+	}
+
+	struct ctl_request *req =
+		arena_alloc(sizeof(*req) + strlen(dev_id) + 1);
+	if (req == NULL) {
+		syslog(LOG_ERR, "Failed to allocate memory for request");
+		queue_reply(conn, CTL_OP_SET_PIN, DEVCTL_INTERNAL_ERROR, 0,
+			    tag);
+		return;
+	}
+	req->conn = conn;
+	req->tag = tag;
+	req->pin = pin;
+	req->turn_on = turn_on;
+	req->sreq.cb = ctl_request_cb;
+	req->sreq.timeout_ms = timeout_ms;
+	req->sreq.priority = priority;
+	req->retry.cb = ctl_request_retry_cb;
+	strcpy(req->device, dev_id);
+	serial_format_pin_command(&req->sreq, pin, turn_on);
+
+	list_add_tail(&req->list, &conn->reqs);
+	conn->in_flight += 1;
+	serial_send(dev_id, &req->sreq);
+}
+
+// Handles the request in the body of a frame.
+// Returns false if the request is malformed.
+static bool handle_request(struct ctl_conn *conn, const unsigned char *body,
+			   size_t len)
+{
+	uint8_t op = body[0];
+	uint8_t flags = body[1];
+	uint32_t pin = get_le(body + 2, 2);
+	uint32_t tag = get_le(body + 4, 4);
+	uint8_t priority = body[8];
+	size_t name_len = body[9];
+	int timeout_ms = (int)get_le(body + 10, 2);
+	if (len != CTL_REQ_SIZE + name_len) {
+		return false;
+	}
+	char name[CTL_NAME_MAXLEN + 1];
+	memcpy(name, body + CTL_REQ_SIZE, name_len);
+	name[name_len] = '\0';
+
+	switch (op) {
+	case CTL_OP_PING:
+		queue_reply(conn, op, DEVCTL_OK, 0, tag);
+		break;
+	case CTL_OP_SET_PIN:
+		if (priority >= __SERIAL_PRIORITY_MAX) {
+			queue_reply(conn, op, DEVCTL_OPERATION_FAILED, 0, tag);
+			break;
+		}
+		set_pin(conn, name, pin, (flags & CTL_FLAG_ON) != 0,
+			(enum serial_priority)priority, timeout_ms, tag);
+		break;
+	case CTL_OP_GET_PIN: {
+		const char *dev_id = resolve_device(name);
+		enum pin_state state = serial_get_pin_state(
+			dev_id != NULL ? dev_id : name, pin);
+		uint8_t value = state == PIN_STATE_UNKNOWN ? CTL_STATE_UNKNOWN :
+							     (uint8_t)state;
+		queue_reply(conn, op, DEVCTL_OK, value, tag);
+		break;
+	}
+	default:
+		// Not disconnecting keeps clients of a newer protocol usable.
+		queue_reply(conn, op, DEVCTL_OPERATION_FAILED, 0, tag);
+		break;
+	}
+	return true;
+}
+
+// Handles the complete requests in rx, as many as there is room for.
+// Returns false if a request is malformed.
+static bool process_rx(struct ctl_conn *conn)
+{
+	size_t pos = 0;
+	while (conn->rx_len - pos >= 2 && can_accept(conn)) {
+		size_t len = get_le(conn->rx + pos, 2);
+		if (len < CTL_REQ_SIZE ||
+		    len > CTL_REQ_SIZE + CTL_NAME_MAXLEN) {
+			syslog(LOG_WARNING,
+			       "Invalid control request length %zu", len);
+			return false;
+		}
+		if (conn->rx_len - pos - 2 < len) {
+			break;
+		}
+		if (!handle_request(conn, conn->rx + pos + 2, len)) {
+			syslog(LOG_WARNING, "Malformed control request");
+			return false;
+		}
+		pos += 2 + len;
+	}
+	conn->rx_len -= pos;
+	memmove(conn->rx, conn->rx + pos, conn->rx_len);
+	return true;
+}
+
+// Reads only while there is room for further requests, so a client that
+// sends faster than the devices respond is slowed down by the socket.
+static void update_events(struct ctl_conn *conn)
+{
+	unsigned int events = 0;
+	if (can_accept(conn) && conn->rx_len < CTL_RX_BUFSIZE) {
+		events |= ULOOP_READ;
+	}
+	if (conn->blocked) {
+		events |= ULOOP_WRITE;
+	}
+	uloop_fd_add(&conn->fd, events);
+}
+
+// Writes as much of tx as the socket takes.
+// Returns false if the connection failed.
+static bool flush_tx(struct ctl_conn *conn)
+{
+	size_t sent = 0;
+	while (sent < conn->tx_len) {
+		ssize_t len = send(conn->fd.fd, conn->tx + sent,
+				   conn->tx_len - sent,
+				   MSG_NOSIGNAL | MSG_DONTWAIT);
+		if (len == -1) {
+			if (errno == EINTR) {
+				continue;
+			}
+			if (errno == EAGAIN) {
+				break;
+			}
+			syslog(LOG_DEBUG, "Failed to write control reply: %m");
+			return false;
+		}
+		sent += (size_t)len;
+	}
+	conn->tx_len -= sent;
+	memmove(conn->tx, conn->tx + sent, conn->tx_len);
+	conn->blocked = conn->tx_len > 0;
+	return true;
+}
+
+// Sends the replies and continues with the requests that had to wait for
+// room.
+static void flush_cb(struct uloop_timeout *t)
+{
+	struct ctl_conn *conn = container_of(t, struct ctl_conn, flush);
+	if (!flush_tx(conn) || !process_rx(conn)) {
+		close_conn(conn);
+		return;
+	}
+	update_events(conn);
+}
+
+static void conn_fd_cb(struct uloop_fd *u, unsigned int events)
+{
+	struct ctl_conn *conn = container_of(u, struct ctl_conn, fd);
+	if (u->error) {
+		close_conn(conn);
+		return;
+	}
+	if ((events & ULOOP_WRITE) && !flush_tx(conn)) {
+		close_conn(conn);
+		return;
+	}
+	if (events & ULOOP_READ) {
+		ssize_t len = read(u->fd, conn->rx + conn->rx_len,
+				   CTL_RX_BUFSIZE - conn->rx_len);
+		if (len == 0 ||
+		    (len == -1 && errno != EAGAIN && errno != EINTR)) {
+			close_conn(conn);
+			return;
+		}
+		if (len > 0) {
+			conn->rx_len += (size_t)len;
+		}
+	}
+	// Also after writing, which may have made room for requests that
+	// were waiting in rx.
+	if (!process_rx(conn)) {
+		close_conn(conn);
+		return;
+	}
+	update_events(conn);
+}
+
+static void listen_fd_cb(struct uloop_fd *u, unsigned int events)
+{
+	(void)events;
+	for (;;) {
+		int fd = accept4(u->fd, NULL, NULL,
+				 SOCK_NONBLOCK | SOCK_CLOEXEC);
+		if (fd == -1) {
+			if (errno != EAGAIN && errno != EINTR) {
+				syslog(LOG_ERR,
+				       "Failed to accept control connection: %m");
+			}
+			return;
+		}
+		if (num_conns == CTL_MAX_CONNS) {
+			syslog(LOG_WARNING,
+			       "Too many control connections, refusing");
+			close(fd);
+			continue;
+		}
+		struct ctl_conn *conn = calloc(1, sizeof(*conn));
+		if (conn == NULL) {
+			syslog(LOG_ERR,
+			       "Failed to allocate memory for connection");
+			close(fd);
+			continue;
+		}
+		conn->fd.fd = fd;
+		conn->fd.cb = conn_fd_cb;
+		conn->flush.cb = flush_cb;
+		INIT_LIST_HEAD(&conn->reqs);
+		if (uloop_fd_add(&conn->fd, ULOOP_READ) != 0) {
+			syslog(LOG_ERR,
+			       "Failed to add control connection to uloop");
+			close(fd);
+			free(conn);
+			continue;
+		}
+		list_add_tail(&conn->list, &conns);
+		num_conns += 1;
+		syslog(LOG_DEBUG, "Control connection accepted");
+	}
+}
+
+static void close_listen_socket(void)
+{
+	if (listen_fd.fd == -1) {
+		return;
+	}
+	uloop_fd_delete(&listen_fd);
+	close(listen_fd.fd);
+	listen_fd.fd = -1;
+	unlink(listen_path);
+	free(listen_path);
+	listen_path = NULL;
+}
+
+// Returns true on success, false on failure.
+static bool open_listen_socket(const char *path)
+{
+	struct sockaddr_un addr = { .sun_family = AF_UNIX };
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		syslog(LOG_ERR, "Control socket path is too long: %s", path);
+		return false;
+	}
+	strcpy(addr.sun_path, path);
+	listen_path = strdup(path);
+	if (listen_path == NULL) {
+		syslog(LOG_ERR, "Failed to allocate memory for socket path");
+		return false;
+	}
+	int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC,
+			0);
+	if (fd == -1) {
+		syslog(LOG_ERR, "Failed to create control socket: %m");
+		goto cleanup_path;
+	}
+	// Left behind by a devctl that did not exit cleanly.
+	unlink(path);
+	if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+		syslog(LOG_ERR, "Failed to bind control socket %s: %m", path);
+		goto cleanup_fd;
+	}
+	// Only root may control the devices, as with the default ubus ACLs.
+	if (chmod(path, 0600) == -1 || listen(fd, SOMAXCONN) == -1) {
+		syslog(LOG_ERR, "Failed to set up control socket %s: %m",
+		       path);
+		goto cleanup_bound;
+	}
+	listen_fd.fd = fd;
+	listen_fd.cb = listen_fd_cb;
+	if (uloop_fd_add(&listen_fd, ULOOP_READ) != 0) {
+		syslog(LOG_ERR, "Failed to add control socket to uloop");
+		listen_fd.fd = -1;
+		goto cleanup_bound;
+	}
+	syslog(LOG_INFO, "Listening on control socket %s", path);
+	return true;
+
+cleanup_bound:
+	unlink(path);
+cleanup_fd:
+	close(fd);
+cleanup_path:
+	free(listen_path);
+	listen_path = NULL;
+	return false;
+}
+
+void ctl_apply_config(void)
+{
+	if (listen_path != NULL && config.ctl_socket != NULL &&
+	    strcmp(listen_path, config.ctl_socket) == 0) {
+		return;
+	}
+	close_listen_socket();
+	if (config.ctl_socket != NULL) {
+		// ubus keeps working without the control socket.
+		open_listen_socket(config.ctl_socket);
+	}
+}
+
+void ctl_free(void)
+{
+	struct ctl_conn *conn, *tmp;
+	list_for_each_entry_safe(conn, tmp, &conns, list) {
+		flush_tx(conn);
+		close_conn(conn);
+	}
+	close_listen_socket();
+}
@@ -0,0 +1,20 @@
+#ifndef CTL_H
+#define CTL_H
+
+// Control socket, a Unix domain socket that local clients can use
+// instead of ubus to control pins at high rates. Requests are binary,
+// see ctl_proto.h, and skip the ubus daemon and blobmsg encoding. Pin
+// commands share the request queues of the devices with the ubus
+// methods, so priorities and coalescing work across both.
+
+// Starts, moves or stops listening on config.ctl_socket according to the
+// current configuration. Connections that are already open are kept when
+// the socket moves. uloop must be initialized.
+void ctl_apply_config(void);
+
+// Sends the replies that are ready, closes all connections and removes
+// the socket. Must be called after close_serial_devs(), which completes
+// the requests in flight.
+void ctl_free(void);
+
+#endif
@@ -0,0 +1,61 @@
+#ifndef CTL_PROTO_H
+#define CTL_PROTO_H
+
+// Binary protocol of the control socket (option ctl_socket), a local
+// alternative to ubus for clients that send many pin commands per
+// second. The socket is a SOCK_STREAM Unix domain socket.
+//
+// Every message is a 2-byte length followed by that many bytes of body.
+// All integers are little-endian.
+//
+// Request body, CTL_REQ_SIZE bytes followed by the device name:
+//   offset 0: op, enum ctl_op (1 byte)
+//   offset 1: flags, CTL_FLAG_* (1 byte)
+//   offset 2: pin (2 bytes)
+//   offset 4: tag, any value, returned in the reply (4 bytes)
+//   offset 8: priority, enum serial_priority (1 byte)
+//   offset 9: length of the device name (1 byte)
+//   offset 10: response timeout in milliseconds, 0 for the default of
+//              the device (2 bytes)
+//   offset 12: device file name, ID or alias, not null-terminated
+//
+// Reply body, CTL_REPLY_SIZE bytes:
+//   offset 0: op of the request (1 byte)
+//   offset 1: devctl status code, same as in ubus replies (1 byte)
+//   offset 2: value, see enum ctl_op (1 byte)
+//   offset 3: 0 (1 byte)
+//   offset 4: tag of the request (4 bytes)
+//
+// Requests are pipelined: a client can send requests without waiting for
+// the replies. Requests to different devices run concurrently, so
+// replies come in the order the requests complete, not the order they
+// were sent; use the tag to match them. Replies that complete together
+// are written with a single write(), so a client should read as much as
+// is available. A client that sends a malformed message is disconnected.
+
+#define CTL_REQ_SIZE 12
+#define CTL_REPLY_SIZE 8
+// Longest device name in a request.
+#define CTL_NAME_MAXLEN 255
+// Requests of a connection that can be in progress at the same time.
+// Further requests are not read until replies are sent.
+#define CTL_MAX_IN_FLIGHT 256
+
+enum ctl_op {
+	// Does nothing, for measuring the round trip.
+	CTL_OP_PING,
+	// Turns the pin on if CTL_FLAG_ON is set, off otherwise. Pin
+	// commands are queued together with the ubus commands, with the same
+	// priorities and coalescing.
+	CTL_OP_SET_PIN,
+	// Returns the cached state of the pin without contacting the device
+	// as value: 0 (off), 1 (on) or CTL_STATE_UNKNOWN. Same as
+	// get_pin_state.
+	CTL_OP_GET_PIN,
+	__CTL_OP_MAX
+};
+
+#define CTL_FLAG_ON (1 << 0)
+#define CTL_STATE_UNKNOWN 0xff
+
+#endif
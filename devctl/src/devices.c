@@ -0,0 +1,366 @@
+#include <stdio.h>
+#include <string.h>
+#include <syslog.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <errno.h>
+
+#include <unistd.h>
+#include <sys/socket.h>
+#include <linux/netlink.h>
+
+#include <libserialport.h>
+#include <libubox/avl-cmp.h>
+#include <libubox/uloop.h>
+
+#include "devices.h"
+#include "args.h"
+#include "events.h"
+
+// Size of the buffer for a single uevent message.
+#define UEVENT_BUFSIZE 8192
+
+// USB VID and PID of NodeMCU 8266V3
+const int VENDOR_ID = 0x10C4;
+const int PRODUCT_ID = 0xEA60;
+
+AVL_TREE(devices, avl_strcmp, false, NULL);
+
+// Connected devices with a unique ID, keyed by the ID.
+static AVL_TREE(devices_by_id, avl_strcmp, false, NULL);
+
+// Kernel uevent socket, fd is -1 if hotplug events are not available.
+static struct uloop_fd uevent_fd = { .fd = -1 };
+
+// Returns true if the port is a NodeMCU 8266V3.
+static bool is_supported_port(const struct sp_port *port)
+{
+	if (sp_get_port_transport(port) != SP_TRANSPORT_USB) {
+		return false;
+	}
+	int usb_vid, usb_pid;
+	enum sp_return result =
+		sp_get_port_usb_vid_pid(port, &usb_vid, &usb_pid);
+	if (result != SP_OK) {
+		syslog(LOG_ERR,
+		       "sp_get_port_usb_vid_pid() failed with with code %d",
+		       result);
+		return false;
+	}
+	syslog(LOG_DEBUG, "VID: %04X, PID: %04X", (unsigned)usb_vid,
+	       (unsigned)usb_pid);
+	return usb_vid == VENDOR_ID && usb_pid == PRODUCT_ID;
+}
+
+static void free_device(struct device *dev)
+{
+	if (dev->id_indexed) {
+		avl_delete(&devices_by_id, &dev->id_avl);
+	}
+	avl_delete(&devices, &dev->avl);
+	free(dev->name);
+	free(dev->id);
+	free(dev->description);
+	free(dev);
+}
+
+static void remove_device(struct device *dev)
+{
+	syslog(LOG_INFO, "Device removed: %s", dev->name);
+	event_device_detached(dev->name);
+	free_device(dev);
+}
+
+// Copies the USB details of the port to the device.
+// Returns true on success, false on memory allocation failure.
+static bool set_device_details(struct device *dev, struct sp_port *port)
+{
+	dev->usb_bus = -1;
+	dev->usb_address = -1;
+	if (port == NULL) {
+		return true;
+	}
+	sp_get_port_usb_bus_address(port, &dev->usb_bus, &dev->usb_address);
+	const char *id = sp_get_port_usb_serial(port);
+	const char *description = sp_get_port_description(port);
+	if (id != NULL) {
+		dev->id = strdup(id);
+		if (dev->id == NULL) {
+			return false;
+		}
+	}
+	if (description != NULL) {
+		dev->description = strdup(description);
+		if (dev->description == NULL) {
+			return false;
+		}
+	}
+	return true;
+}
+
+// Adds the device to the index by ID, unless another device has the
+// same ID.
+static void index_device_id(struct device *dev)
+{
+	if (dev->id == NULL) {
+		return;
+	}
+	const struct device *other =
+		avl_find_element(&devices_by_id, dev->id, other, id_avl);
+	if (other != NULL) {
+		syslog(LOG_WARNING,
+		       "Devices %s and %s have the same serial number %s, use file names to address them",
+		       other->name, dev->name, dev->id);
+		return;
+	}
+	dev->id_avl.key = dev->id;
+	avl_insert(&devices_by_id, &dev->id_avl);
+	dev->id_indexed = true;
+}
+
+// Adds the device to the registry if it is not there yet. Marks the
+// device as seen. port provides the USB details of the device, NULL for
+// static devices.
+static void add_device(const char *name, struct sp_port *port)
+{
+	struct device *dev = avl_find_element(&devices, name, dev, avl);
+	if (dev != NULL) {
+		const char *id = port != NULL ? sp_get_port_usb_serial(port) :
+						NULL;
+		if (id == NULL ||
+		    (dev->id != NULL && strcmp(dev->id, id) == 0)) {
+			dev->seen = true;
+			return;
+		}
+		// Another device got the same file name since the last scan.
+		remove_device(dev);
+	}
+	dev = calloc(1, sizeof(*dev));
+	if (dev == NULL) {
+		syslog(LOG_ERR, "Failed to allocate memory for device %s",
+		       name);
+		return;
+	}
+	dev->name = strdup(name);
+	if (dev->name == NULL || !set_device_details(dev, port)) {
+		syslog(LOG_ERR, "Failed to allocate memory for device %s",
+		       name);
+		free(dev->name);
+		free(dev->id);
+		free(dev->description);
+		free(dev);
+		return;
+	}
+	dev->seen = true;
+	dev->avl.key = dev->name;
+	avl_insert(&devices, &dev->avl);
+	index_device_id(dev);
+	syslog(LOG_INFO, "Found device: %s, serial number: %s", name,
+	       dev->id != NULL ? dev->id : "-");
+	event_device_attached(name);
+}
+
+// Synchronizes the registry with the currently connected devices.
+// Returns true on success, false on failure.
+static bool scan_devices(void)
+{
+	struct sp_port **port_list;
+	enum sp_return result = sp_list_ports(&port_list);
+	if (result != SP_OK) {
+		syslog(LOG_ERR, "sp_list_ports() failed with code %d", result);
+		return false;
+	}
+
+	struct device *dev, *tmp;
+	avl_for_each_element(&devices, dev, avl) {
+		dev->seen = false;
+	}
+	for (unsigned int i = 0; port_list[i] != NULL; ++i) {
+		struct sp_port *port = port_list[i];
+		if (is_supported_port(port)) {
+			// Port name on Linux is device file name.
+			add_device(sp_get_port_name(port), port);
+		}
+	}
+	const struct device_config *cfg;
+	list_for_each_entry(cfg, &device_configs, list) {
+		if (cfg->is_static) {
+			add_device(cfg->path, NULL);
+		}
+	}
+	avl_for_each_element_safe(&devices, dev, avl, tmp) {
+		if (!dev->seen) {
+			remove_device(dev);
+		}
+	}
+
+	sp_free_port_list(port_list);
+	return true;
+}
+
+// Handles a single uevent. Only tty devices are of interest.
+// msg contains null-terminated KEY=value strings.
+static void handle_uevent(const char *msg, size_t len)
+{
+	const char *action = NULL;
+	const char *subsystem = NULL;
+	const char *devname = NULL;
+	for (size_t i = 0; i < len; i += strlen(msg + i) + 1) {
+		const char *field = msg + i;
+		if (strncmp(field, "ACTION=", 7) == 0) {
+			action = field + 7;
+		} else if (strncmp(field, "SUBSYSTEM=", 10) == 0) {
+			subsystem = field + 10;
+		} else if (strncmp(field, "DEVNAME=", 8) == 0) {
+			devname = field + 8;
+		}
+	}
+	if (action == NULL || subsystem == NULL || devname == NULL ||
+	    strcmp(subsystem, "tty") != 0) {
+		return;
+	}
+
+	char name[64];
+	if ((size_t)snprintf(name, sizeof(name), "/dev/%s", devname) >=
+	    sizeof(name)) {
+		return;
+	}
+	syslog(LOG_DEBUG, "uevent: %s %s", action, name);
+	if (strcmp(action, "add") == 0) {
+		struct sp_port *port;
+		if (sp_get_port_by_name(name, &port) != SP_OK) {
+			return;
+		}
+		if (is_supported_port(port)) {
+			add_device(name, port);
+		}
+		sp_free_port(port);
+	} else if (strcmp(action, "remove") == 0) {
+		struct device *dev =
+			avl_find_element(&devices, name, dev, avl);
+		const struct device_config *cfg = find_device_config(name);
+		if (dev != NULL && (cfg == NULL || !cfg->is_static)) {
+			remove_device(dev);
+		}
+	}
+}
+
+static void uevent_fd_cb(struct uloop_fd *u, unsigned int events)
+{
+	(void)events;
+	// +1 for the terminator of the last string.
+	static char buf[UEVENT_BUFSIZE + 1];
+	for (;;) {
+		ssize_t len = recv(u->fd, buf, UEVENT_BUFSIZE, 0);
+		if (len == -1) {
+			if (errno == ENOBUFS) {
+				// Events were lost, start over.
+				syslog(LOG_WARNING,
+				       "uevent buffer overrun, rescanning devices");
+				scan_devices();
+				continue;
+			}
+			if (errno != EAGAIN && errno != EINTR) {
+				syslog(LOG_ERR,
+				       "Failed to receive uevent: %m");
+			}
+			return;
+		}
+		buf[len] = '\0';
+		handle_uevent(buf, (size_t)len);
+	}
+}
+
+// Subscribes to kernel uevents.
+// Returns true on success, false on failure.
+static bool open_uevent_socket(void)
+{
+	int fd = socket(AF_NETLINK, SOCK_DGRAM | SOCK_CLOEXEC | SOCK_NONBLOCK,
+			NETLINK_KOBJECT_UEVENT);
+	if (fd == -1) {
+		syslog(LOG_ERR, "Failed to create uevent socket: %m");
+		return false;
+	}
+	struct sockaddr_nl addr = { .nl_family = AF_NETLINK, .nl_groups = 1 };
+	if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+		syslog(LOG_ERR, "Failed to bind uevent socket: %m");
+		close(fd);
+		return false;
+	}
+	uevent_fd.fd = fd;
+	uevent_fd.cb = uevent_fd_cb;
+	if (uloop_fd_add(&uevent_fd, ULOOP_READ) != 0) {
+		syslog(LOG_ERR, "Failed to add uevent socket to uloop");
+		close(fd);
+		uevent_fd.fd = -1;
+		return false;
+	}
+	return true;
+}
+
+bool init_devices(void)
+{
+	// Subscribe first so that devices connected during the scan are not
+	// missed.
+	if (!open_uevent_socket()) {
+		syslog(LOG_WARNING,
+		       "Hotplug events unavailable, devices will be rescanned on every request");
+	}
+	return scan_devices();
+}
+
+void refresh_devices(void)
+{
+	if (uevent_fd.fd == -1) {
+		scan_devices();
+	}
+}
+
+void reload_devices(void)
+{
+	scan_devices();
+}
+
+void free_devices(void)
+{
+	if (uevent_fd.fd != -1) {
+		uloop_fd_delete(&uevent_fd);
+		close(uevent_fd.fd);
+		uevent_fd.fd = -1;
+	}
+	struct device *dev, *tmp;
+	avl_for_each_element_safe(&devices, dev, avl, tmp) {
+		free_device(dev);
+	}
+}
+
+const char *resolve_device(const char *name)
+{
+	const struct device *dev;
+	const struct device_config *cfg = find_device_config_by_alias(name);
+	if (cfg != NULL) {
+		name = cfg->serial != NULL ? cfg->serial : cfg->path;
+	}
+	if (name[0] == '/') {
+		// File names are never IDs. Only devices in the registry are
+		// opened, not any file a client names.
+		dev = avl_find_element(&devices, name, dev, avl);
+		return dev != NULL ? dev->name : NULL;
+	}
+	dev = avl_find_element(&devices_by_id, name, dev, id_avl);
+	// NULL if the device is not connected.
+	return dev != NULL ? dev->name : NULL;
+}
+
+const struct device_config *find_config_for_device(const char *path)
+{
+	const struct device *dev = avl_find_element(&devices, path, dev, avl);
+	if (dev != NULL && dev->id != NULL) {
+		const struct device_config *cfg =
+			find_device_config_by_serial(dev->id);
+		if (cfg != NULL) {
+			return cfg;
+		}
+	}
+	return find_device_config(path);
+}
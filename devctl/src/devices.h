@@ -0,0 +1,68 @@
+#ifndef DEVICES_H
+#define DEVICES_H
+
+#include <stdbool.h>
+
+#include <libubox/avl.h>
+
+#include "args.h"
+
+// Supported device connected to the router.
+struct device {
+	struct avl_node avl;
+	// Node in the index by ID, linked if id_indexed is set.
+	struct avl_node id_avl;
+	// Device file name, also the key in the registry.
+	char *name;
+	// Stable ID of the device, its USB serial number. NULL if the device
+	// does not report one.
+	char *id;
+	// Description reported by the device, NULL if unknown.
+	char *description;
+	// USB bus number and device address, -1 if unknown.
+	int usb_bus;
+	int usb_address;
+	// The device can be found by its ID. Not set if another connected
+	// device has the same ID.
+	bool id_indexed;
+	// Used internally while rescanning.
+	bool seen;
+};
+
+// Registry of connected NodeMCU 8266V3 devices and devices configured as
+// static, sorted by name.
+// Populated by init_devices() and kept up to date from kernel hotplug
+// events, so reading it is cheap.
+extern struct avl_tree devices;
+
+// Scans connected devices and starts listening for hotplug events.
+// uloop must be initialized.
+// Returns true on success, false on failure.
+bool init_devices(void);
+
+// Rescans connected devices if hotplug events are not available.
+// Call before reading the registry.
+void refresh_devices(void);
+
+// Rescans connected devices after the configuration changed, so that
+// devices that were configured as static or stopped being static are
+// added to or removed from the registry.
+void reload_devices(void);
+
+// Resolves a device name given by a client to the device file name. The
+// name can be a configured alias, the ID of a connected device or the
+// file name (starting with '/') of a device in the registry.
+// Returns NULL if the name is an alias, ID or file name of a device that
+// is not in the registry, or not a known alias or ID. The result is valid
+// until the registry or the configuration changes.
+const char *resolve_device(const char *name);
+
+// Returns the settings of the device with the file name, looked up by
+// the serial number of the device first and by the file name second.
+// Returns NULL if the device is not configured.
+const struct device_config *find_config_for_device(const char *path);
+
+// Stops listening for hotplug events and empties the registry.
+void free_devices(void);
+
+#endif
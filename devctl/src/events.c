@@ -0,0 +1,141 @@
+#include <syslog.h>
+#include <time.h>
+
+#include <libubox/blobmsg.h>
+
+#include "events.h"
+#include "stats.h"
+
+#define EVENT_DEVICE_ATTACHED "device.attached"
+#define EVENT_DEVICE_DETACHED "device.detached"
+#define EVENT_PIN_CHANGED "pin.changed"
+#define EVENT_DEVICE_FAILING "device.failing"
+#define EVENT_DEVICE_RECOVERED "device.recovered"
+#define EVENT_STREAM_ERROR "stream.error"
+#define EVENT_DEVICE_HEALTH "device.health"
+
+static struct ubus_context *events_ctx;
+static struct ubus_object *events_obj;
+// Reused for every event, so that sending events does not allocate once
+// it fits the largest one.
+static struct blob_buf event_buf;
+
+void events_init(struct ubus_context *ctx, struct ubus_object *obj)
+{
+	events_ctx = ctx;
+	events_obj = obj;
+}
+
+void events_free(void)
+{
+	events_ctx = NULL;
+	events_obj = NULL;
+	blob_buf_free(&event_buf);
+}
+
+// Returns true if anyone would receive the event. Saves building the
+// message when nobody is subscribed.
+static bool events_wanted(void)
+{
+	return events_ctx != NULL && events_obj->has_subscribers;
+}
+
+// Sends the notification without waiting for the subscribers to
+// receive it.
+static void send_event(const char *type, struct blob_buf *b)
+{
+	int ret = ubus_notify(events_ctx, events_obj, type, b->head, -1);
+	if (ret != UBUS_STATUS_OK) {
+		syslog(LOG_WARNING, "Failed to send '%s' event: %s", type,
+		       ubus_strerror(ret));
+	}
+}
+
+static void send_device_event(const char *type, const char *device)
+{
+	if (!events_wanted()) {
+		return;
+	}
+	struct blob_buf *b = &event_buf;
+	blob_buf_init(b, 0);
+	blobmsg_add_string(b, "device", device);
+	send_event(type, b);
+}
+
+void event_device_attached(const char *device)
+{
+	send_device_event(EVENT_DEVICE_ATTACHED, device);
+}
+
+void event_device_detached(const char *device)
+{
+	send_device_event(EVENT_DEVICE_DETACHED, device);
+}
+
+void event_pin_changed(const char *device, uint32_t pin, bool on)
+{
+	if (!events_wanted()) {
+		return;
+	}
+	struct timespec ts;
+	clock_gettime(CLOCK_REALTIME, &ts);
+	struct blob_buf *b = &event_buf;
+	blob_buf_init(b, 0);
+	blobmsg_add_string(b, "device", device);
+	blobmsg_add_u32(b, "pin", pin);
+	blobmsg_add_u8(b, "state", on);
+	// Milliseconds since the epoch.
+	blobmsg_add_u64(b, "timestamp",
+			(uint64_t)ts.tv_sec * 1000 +
+				(uint64_t)ts.tv_nsec / 1000000);
+	send_event(EVENT_PIN_CHANGED, b);
+}
+
+void event_device_failing(const char *device, int status)
+{
+	if (!events_wanted()) {
+		return;
+	}
+	struct blob_buf *b = &event_buf;
+	blob_buf_init(b, 0);
+	blobmsg_add_string(b, "device", device);
+	blobmsg_add_string(b, "error", stats_send_error_name(status));
+	send_event(EVENT_DEVICE_FAILING, b);
+}
+
+void event_device_recovered(const char *device)
+{
+	send_device_event(EVENT_DEVICE_RECOVERED, device);
+}
+
+void event_device_health(const char *device, const char *health,
+			 uint32_t rtt_us)
+{
+	if (!events_wanted()) {
+		return;
+	}
+	struct blob_buf *b = &event_buf;
+	blob_buf_init(b, 0);
+	blobmsg_add_string(b, "device", device);
+	blobmsg_add_string(b, "health", health);
+	if (rtt_us != 0) {
+		blobmsg_add_u32(b, "rtt_us", rtt_us);
+	}
+	send_event(EVENT_DEVICE_HEALTH, b);
+}
+
+void event_stream_error(const char *device, uint32_t seq, uint32_t pin,
+			bool state, const char *error)
+{
+	if (!events_wanted()) {
+		return;
+	}
+	struct blob_buf *b = &event_buf;
+	blob_buf_init(b, 0);
+	blobmsg_add_string(b, "device", device);
+	blobmsg_add_u32(b, "seq", seq);
+	blobmsg_add_u32(b, "pin", pin);
+	blobmsg_add_u8(b, "state", state);
+	blobmsg_add_string(b, "error", error);
+	send_event(EVENT_STREAM_ERROR, b);
+}
@@ -0,0 +1,41 @@
+#ifndef EVENTS_H
+#define EVENTS_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include <libubus.h>
+
+// Starts publishing events as notifications of obj. Until this is called
+// events are dropped.
+void events_init(struct ubus_context *ctx, struct ubus_object *obj);
+
+// Stops publishing events.
+void events_free(void);
+
+// Device appeared in the registry.
+void event_device_attached(const char *device);
+
+// Device disappeared from the registry.
+void event_device_detached(const char *device);
+
+// The device confirmed a pin state different from the cached one.
+void event_pin_changed(const char *device, uint32_t pin, bool on);
+
+// A request to the device failed after the previous one succeeded.
+// status is the serial_send() status code.
+void event_device_failing(const char *device, int status);
+
+// A request to a failing device succeeded again.
+void event_device_recovered(const char *device);
+
+// The health of the device changed, see serial_get_health(). rtt_us is
+// the round trip time estimate, 0 if unknown.
+void event_device_health(const char *device, const char *health,
+			 uint32_t rtt_us);
+
+// A stream command was not acknowledged as expected.
+void event_stream_error(const char *device, uint32_t seq, uint32_t pin,
+			bool state, const char *error);
+
+#endif
@@ -0,0 +1,119 @@
+#include <string.h>
+#include <errno.h>
+
+#include <sys/uio.h>
+
+#include "framer.h"
+
+void framer_reset(struct framer *f)
+{
+	f->head = 0;
+	f->len = 0;
+	f->scanned = 0;
+	f->discarding = false;
+}
+
+ssize_t framer_read(struct framer *f, int fd)
+{
+	size_t free_space = FRAMER_BUFSIZE - f->len;
+	if (free_space == 0) {
+		errno = ENOBUFS;
+		return -1;
+	}
+	// Free space may consist of two parts: from the end of the data to
+	// the end of the buffer and from the start of the buffer.
+	size_t tail = (f->head + f->len) % FRAMER_BUFSIZE;
+	size_t first_len = FRAMER_BUFSIZE - tail;
+	if (first_len > free_space) {
+		first_len = free_space;
+	}
+	struct iovec iov[2] = {
+		{ .iov_base = f->buf + tail, .iov_len = first_len },
+		{ .iov_base = f->buf, .iov_len = free_space - first_len },
+	};
+	ssize_t read_bytes = readv(fd, iov, iov[1].iov_len > 0 ? 2 : 1);
+	if (read_bytes > 0) {
+		f->len += (size_t)read_bytes;
+	}
+	return read_bytes;
+}
+
+// Returns the position of the next terminator relative to head, or
+// f->len if there is none yet.
+static size_t find_end(struct framer *f)
+{
+	size_t end = f->scanned;
+	while (end < f->len &&
+	       f->buf[(f->head + end) % FRAMER_BUFSIZE] != '\n') {
+		end += 1;
+	}
+	f->scanned = end;
+	return end;
+}
+
+// Consumes the frame ending at end and its terminator.
+static void consume(struct framer *f, size_t end)
+{
+	f->head = (f->head + end + 1) % FRAMER_BUFSIZE;
+	f->len -= end + 1;
+	f->scanned = 0;
+	if (f->len == 0) {
+		// Keep the next frame contiguous.
+		f->head = 0;
+	}
+}
+
+char *framer_next(struct framer *f, size_t *len)
+{
+	size_t end = find_end(f);
+	if (f->discarding) {
+		if (end == f->len) {
+			// Still the tail of the long frame, drop it all.
+			f->head = 0;
+			f->len = 0;
+			f->scanned = 0;
+			return NULL;
+		}
+		consume(f, end);
+		f->discarding = false;
+		end = find_end(f);
+	}
+	if (end == f->len) {
+		return NULL;
+	}
+
+	char *frame;
+	size_t frame_len = end;
+	if (f->head + end < FRAMER_BUFSIZE) {
+		// Terminate the frame in place of \n.
+		frame = f->buf + f->head;
+		frame[frame_len] = '\0';
+	} else {
+		size_t first_len = FRAMER_BUFSIZE - f->head;
+		memcpy(f->line, f->buf + f->head, first_len);
+		memcpy(f->line + first_len, f->buf, frame_len - first_len);
+		frame = f->line;
+		frame[frame_len] = '\0';
+	}
+	if (frame_len > 0 && frame[frame_len - 1] == '\r') {
+		frame_len -= 1;
+		frame[frame_len] = '\0';
+	}
+
+	consume(f, end);
+	*len = frame_len;
+	return frame;
+}
+
+bool framer_full(const struct framer *f)
+{
+	return f->len == FRAMER_BUFSIZE && f->scanned == f->len;
+}
+
+void framer_discard_frame(struct framer *f)
+{
+	f->head = 0;
+	f->len = 0;
+	f->scanned = 0;
+	f->discarding = true;
+}
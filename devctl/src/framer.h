@@ -0,0 +1,51 @@
+#ifndef FRAMER_H
+#define FRAMER_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+// Size of the receive buffer. Frames longer than this are discarded.
+#define FRAMER_BUFSIZE 512
+
+// Splits the byte stream received from a device into \n terminated
+// frames. Received bytes are stored in a ring buffer and frames are
+// returned in place, only frames that wrap around the end of the buffer
+// are copied.
+struct framer {
+	char buf[FRAMER_BUFSIZE];
+	// Position of the first unconsumed byte.
+	size_t head;
+	// Number of unconsumed bytes.
+	size_t len;
+	// Number of unconsumed bytes already searched for the terminator.
+	size_t scanned;
+	// Frame that wrapped around the end of buf.
+	char line[FRAMER_BUFSIZE + 1];
+	// The rest of a frame that was too long is dropped up to its
+	// terminator, see framer_discard_frame().
+	bool discarding;
+};
+
+// Discards all received data.
+void framer_reset(struct framer *f);
+
+// Reads available data from fd into the buffer.
+// Returns the result of the read, -1 with errno set to ENOBUFS if the
+// buffer is full.
+ssize_t framer_read(struct framer *f, int fd);
+
+// Returns the next complete frame without the trailing \r\n, or NULL if
+// there is none. The frame is null-terminated and its length is written
+// to len. It stays valid until the next call to any framer function.
+char *framer_next(struct framer *f, size_t *len);
+
+// Returns true if the buffer is full and does not contain a complete
+// frame, i.e. the frame being received is too long.
+bool framer_full(const struct framer *f);
+
+// Discards the frame being received, including the part of it that is
+// received later, so that its tail is not returned as the next frame.
+void framer_discard_frame(struct framer *f);
+
+#endif
@@ -0,0 +1,154 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <errno.h>
+
+#include <libubox/uloop.h>
+
+#include "record.h"
+#include "stats.h"
+
+// Buffered records are written to the file at least this often, so that
+// a crash loses little of the recording.
+#define FLUSH_INTERVAL_MS 1000
+#define BUFFER_SIZE 16384
+
+static FILE *record_file;
+static char record_buf[BUFFER_SIZE];
+static uint64_t record_size;
+static uint64_t record_max_size;
+// Device file names by index.
+static char *device_names[RECORD_MAX_DEVICES];
+static unsigned int num_devices;
+static struct uloop_timeout flush_timer;
+
+static void flush_timer_cb(struct uloop_timeout *t)
+{
+	(void)t;
+	if (record_file != NULL && fflush(record_file) != 0) {
+		syslog(LOG_ERR, "Failed to write recording: %m");
+		record_close();
+	}
+}
+
+// Writes the record to the buffer, stopping the recording on failure.
+static void write_record(enum record_type type, unsigned int index,
+			 const void *data, size_t len)
+{
+	if (record_size + RECORD_HEADER_SIZE + len > record_max_size) {
+		syslog(LOG_WARNING, "Recording reached its size limit");
+		record_close();
+		return;
+	}
+	uint64_t now = stats_now_us();
+	unsigned char header[RECORD_HEADER_SIZE];
+	header[0] = (unsigned char)type;
+	header[1] = (unsigned char)index;
+	header[2] = (unsigned char)len;
+	header[3] = (unsigned char)(len >> 8);
+	for (size_t i = 0; i < 8; ++i) {
+		header[4 + i] = (unsigned char)(now >> (8 * i));
+	}
+	if (fwrite(header, sizeof(header), 1, record_file) != 1 ||
+	    (len > 0 && fwrite(data, len, 1, record_file) != 1)) {
+		syslog(LOG_ERR, "Failed to write recording: %m");
+		record_close();
+		return;
+	}
+	record_size += RECORD_HEADER_SIZE + len;
+	if (!flush_timer.pending) {
+		uloop_timeout_set(&flush_timer, FLUSH_INTERVAL_MS);
+	}
+}
+
+// Returns the index of the device, assigning one if it has none yet.
+// Returns -1 if there are too many devices.
+static int device_index(const char *device)
+{
+	for (unsigned int i = 0; i < num_devices; ++i) {
+		if (strcmp(device_names[i], device) == 0) {
+			return (int)i;
+		}
+	}
+	if (num_devices == RECORD_MAX_DEVICES) {
+		return -1;
+	}
+	char *name = strdup(device);
+	if (name == NULL) {
+		return -1;
+	}
+	write_record(RECORD_DEVICE, num_devices, name, strlen(name));
+	if (record_file == NULL) {
+		free(name);
+		return -1;
+	}
+	device_names[num_devices] = name;
+	num_devices += 1;
+	return (int)num_devices - 1;
+}
+
+bool record_open(const char *path, uint64_t max_size)
+{
+	size_t len = strlen(path);
+	char *old_path = malloc(len + sizeof(".old"));
+	if (old_path == NULL) {
+		syslog(LOG_ERR, "Failed to allocate memory for file name");
+		return false;
+	}
+	memcpy(old_path, path, len);
+	memcpy(old_path + len, ".old", sizeof(".old"));
+	if (rename(path, old_path) != 0 && errno != ENOENT) {
+		syslog(LOG_WARNING, "Failed to rename %s: %m", path);
+	}
+	free(old_path);
+
+	record_file = fopen(path, "wb");
+	if (record_file == NULL) {
+		syslog(LOG_ERR, "Failed to create recording %s: %m", path);
+		return false;
+	}
+	setvbuf(record_file, record_buf, _IOFBF, sizeof(record_buf));
+	if (fwrite(RECORD_MAGIC, RECORD_MAGIC_LEN, 1, record_file) != 1) {
+		syslog(LOG_ERR, "Failed to write recording %s: %m", path);
+		record_close();
+		return false;
+	}
+	record_size = RECORD_MAGIC_LEN;
+	record_max_size = max_size;
+	flush_timer.cb = flush_timer_cb;
+	syslog(LOG_INFO, "Recording serial traffic to %s", path);
+	return true;
+}
+
+void record_frame(enum record_type type, const char *device,
+		  const void *data, size_t len)
+{
+	if (record_file == NULL) {
+		return;
+	}
+	int index = device_index(device);
+	if (index == -1) {
+		return;
+	}
+	if (len > UINT16_MAX) {
+		len = UINT16_MAX;
+	}
+	write_record(type, (unsigned int)index, data, len);
+}
+
+void record_close(void)
+{
+	uloop_timeout_cancel(&flush_timer);
+	if (record_file != NULL) {
+		if (fclose(record_file) != 0) {
+			syslog(LOG_ERR, "Failed to write recording: %m");
+		}
+		record_file = NULL;
+	}
+	for (unsigned int i = 0; i < num_devices; ++i) {
+		free(device_names[i]);
+		device_names[i] = NULL;
+	}
+	num_devices = 0;
+}
@@ -0,0 +1,59 @@
+#ifndef RECORD_H
+#define RECORD_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Recording of the serial traffic of all devices, for replaying field
+// sessions with devctl/tools (esp-sim -r, rec-stat).
+//
+// File format, all integers are little-endian: RECORD_MAGIC followed by
+// records made of a RECORD_HEADER_SIZE byte header and len bytes of data.
+//   offset 0: type, enum record_type (1 byte)
+//   offset 1: device index (1 byte)
+//   offset 2: len (2 bytes)
+//   offset 4: CLOCK_MONOTONIC timestamp in microseconds (8 bytes)
+// A RECORD_DEVICE record whose data is the device file name assigns the
+// index before any other record of the device.
+
+#define RECORD_MAGIC "DEVCTLR1"
+#define RECORD_MAGIC_LEN 8
+#define RECORD_HEADER_SIZE 12
+#define RECORD_MAX_DEVICES 256
+
+enum record_type {
+	RECORD_DEVICE,
+	// The connection was opened. No data.
+	RECORD_OPEN,
+	// The connection was closed, requests in flight get no response.
+	// No data.
+	RECORD_CLOSE,
+	// A message was written completely. Data is the message.
+	RECORD_TX,
+	// A line was received. Data is the line without the terminator.
+	RECORD_RX,
+	// The device did not respond in time, requests in flight get no
+	// response. No data.
+	RECORD_TIMEOUT,
+	// The response to the first request in flight was too long and was
+	// discarded. No data.
+	RECORD_TOO_LONG,
+	__RECORD_MAX
+};
+
+// Starts recording to the file. An existing file is renamed to
+// <path>.old first, so that a restart does not overwrite the recording
+// of the session before. Recording stops once the file would grow beyond
+// max_size bytes.
+// Returns false if the file cannot be created.
+bool record_open(const char *path, uint64_t max_size);
+
+// Appends a record for the device, if recording.
+void record_frame(enum record_type type, const char *device,
+		  const void *data, size_t len);
+
+// Writes buffered records to the file and stops recording.
+void record_close(void);
+
+#endif
@@ -0,0 +1,77 @@
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+
+#include <uci.h>
+
+#include "reload.h"
+#include "args.h"
+#include "serial.h"
+#include "devices.h"
+#include "record.h"
+#include "ctl.h"
+
+static const int log_priorities[8] = { LOG_EMERG,   LOG_ALERT,
+				       LOG_CRIT,    LOG_ERR,
+				       LOG_WARNING, LOG_NOTICE,
+				       LOG_INFO,    LOG_DEBUG };
+
+static bool str_equal(const char *a, const char *b)
+{
+	return a == b || (a != NULL && b != NULL && strcmp(a, b) == 0);
+}
+
+bool load_config(bool reload)
+{
+	// A fresh context, so that the file is read again on reload.
+	struct uci_context *ctx = uci_alloc_context();
+	if (ctx == NULL) {
+		syslog(LOG_ERR, "Failed to allocate UCI context");
+		return false;
+	}
+	bool ok = false;
+	struct uci_package *pkg = NULL;
+	if (uci_load(ctx, "devctl", &pkg) != UCI_OK) {
+		char *error;
+		uci_get_errorstr(ctx, &error, "");
+		syslog(LOG_ERR, "Failed to load configuration%s", error);
+		free(error);
+		goto cleanup;
+	}
+	struct devctl_config cfg;
+	if (!read_config(ctx, pkg, &cfg)) {
+		if (reload) {
+			syslog(LOG_ERR,
+			       "Invalid configuration, keeping the current one");
+		}
+		goto cleanup;
+	}
+
+	bool record_changed =
+		!reload || !str_equal(cfg.record_file, config.record_file) ||
+		cfg.record_max_kb != config.record_max_kb;
+	commit_config(&cfg);
+	setlogmask(LOG_UPTO(log_priorities[config.log_level]));
+	serial_apply_health_config();
+
+	if (record_changed) {
+		record_close();
+		// Recording is a diagnostic aid, devctl works without it.
+		if (config.record_file != NULL &&
+		    !record_open(config.record_file,
+				 (uint64_t)config.record_max_kb * 1024)) {
+			syslog(LOG_WARNING, "Serial traffic is not recorded");
+		}
+	}
+	if (reload) {
+		serial_reload_configs();
+		reload_devices();
+		ctl_apply_config();
+		syslog(LOG_INFO, "Configuration reloaded");
+	}
+	ok = true;
+cleanup:
+	uci_free_context(ctx);
+	return ok;
+}
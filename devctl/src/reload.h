@@ -0,0 +1,15 @@
+#ifndef RELOAD_H
+#define RELOAD_H
+
+#include <stdbool.h>
+
+// Reads /etc/config/devctl and applies it. At startup (reload is false)
+// everything is applied. On reload the running daemon is updated in
+// place: open connections and queued requests are kept, only devices
+// whose line settings changed are reconnected, and recording is only
+// restarted if its settings changed. If the configuration is not valid,
+// the current one stays in use.
+// Returns true on success, false if the configuration is not valid.
+bool load_config(bool reload);
+
+#endif
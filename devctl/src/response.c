@@ -0,0 +1,243 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#include <json-c/json.h>
+
+#include "response.h"
+
+#define TURN_ON_PIN_SUCCESS_MSG "Pin was turned on"
+#define TURN_OFF_PIN_SUCCESS_MSG "Pin was turned off"
+// Longer status values are left to json-c.
+#define MAX_STATUS_DIGITS 9
+
+// Fields of a response found by scan_response().
+struct response_fields {
+	long status;
+	// Message, not null-terminated.
+	const char *message;
+	size_t message_len;
+};
+
+static const char *skip_ws(const char *p, const char *end)
+{
+	while (p < end && (*p == ' ' || *p == '\t' || *p == '\r' ||
+			   *p == '\n')) {
+		p += 1;
+	}
+	return p;
+}
+
+// Scans a JSON string starting at the opening quote. Strings with escape
+// sequences are not supported.
+// Returns pointer past the closing quote, NULL if the string is not
+// supported.
+static const char *scan_string(const char *p, const char *end,
+			       const char **str, size_t *len)
+{
+	if (p == end || *p != '"') {
+		return NULL;
+	}
+	const char *start = p + 1;
+	for (p = start; p < end; ++p) {
+		if (*p == '"') {
+			*str = start;
+			*len = (size_t)(p - start);
+			return p + 1;
+		}
+		if (*p == '\\' || (unsigned char)*p < 0x20) {
+			return NULL;
+		}
+	}
+	return NULL;
+}
+
+// Scans a JSON integer.
+// Returns pointer past the number, NULL if it is not a supported integer.
+static const char *scan_int(const char *p, const char *end, long *value)
+{
+	bool negative = false;
+	if (p < end && *p == '-') {
+		negative = true;
+		p += 1;
+	}
+	const char *digits = p;
+	long val = 0;
+	while (p < end && *p >= '0' && *p <= '9') {
+		if (p - digits == MAX_STATUS_DIGITS) {
+			return NULL;
+		}
+		val = val * 10 + (*p - '0');
+		p += 1;
+	}
+	// JSON does not allow leading zeros, and fractions or exponents
+	// make it a double.
+	if (p == digits || (*digits == '0' && p - digits > 1) ||
+	    (p < end && (*p == '.' || *p == 'e' || *p == 'E'))) {
+		return NULL;
+	}
+	*value = negative ? -val : val;
+	return p;
+}
+
+// Scans a response of the exact shape the firmware sends:
+//  {"response": <integer>, "msg": "<string>"}
+// in any key order, with any whitespace. Nothing is allocated and msg is
+// not modified.
+// Returns true if the response has this shape.
+static bool scan_response(const char *msg, size_t len,
+			  struct response_fields *fields)
+{
+	const char *end = msg + len;
+	bool have_status = false;
+	bool have_message = false;
+
+	const char *p = skip_ws(msg, end);
+	if (p == end || *p != '{') {
+		return false;
+	}
+	p = skip_ws(p + 1, end);
+	for (;;) {
+		const char *key;
+		size_t key_len;
+		p = scan_string(p, end, &key, &key_len);
+		if (p == NULL) {
+			return false;
+		}
+		p = skip_ws(p, end);
+		if (p == end || *p != ':') {
+			return false;
+		}
+		p = skip_ws(p + 1, end);
+		if (key_len == 8 && memcmp(key, "response", 8) == 0 &&
+		    !have_status) {
+			p = scan_int(p, end, &fields->status);
+			have_status = true;
+		} else if (key_len == 3 && memcmp(key, "msg", 3) == 0 &&
+			   !have_message) {
+			p = scan_string(p, end, &fields->message,
+					&fields->message_len);
+			have_message = true;
+		} else {
+			return false;
+		}
+		if (p == NULL) {
+			return false;
+		}
+		p = skip_ws(p, end);
+		if (p == end) {
+			return false;
+		}
+		if (*p == '}') {
+			break;
+		}
+		if (*p != ',') {
+			return false;
+		}
+		p = skip_ws(p + 1, end);
+	}
+	return have_status && have_message && skip_ws(p + 1, end) == end;
+}
+
+// Copies the message to error_buf as a null-terminated string.
+// Returns 1, or -3 if error_buf is too small.
+static int copy_error(const struct response_fields *fields, char *error_buf,
+		      size_t error_len)
+{
+	if (fields->message_len >= error_len) {
+		return -3;
+	}
+	memcpy(error_buf, fields->message, fields->message_len);
+	error_buf[fields->message_len] = '\0';
+	return 1;
+}
+
+int parse_device_response(const char *msg, size_t len, bool turn_on,
+			  char *error_buf, size_t error_len)
+{
+	struct response_fields fields = { 0 };
+	if (!scan_response(msg, len, &fields)) {
+		// Unexpected shape, let json-c deal with it.
+		return parse_device_response_json(msg, turn_on, error_buf,
+						  error_len);
+	}
+	if (fields.status != 0) {
+		return copy_error(&fields, error_buf, error_len);
+	}
+	// Success, just need to check if the expected action was performed.
+	const char *expected = turn_on ? TURN_ON_PIN_SUCCESS_MSG :
+					 TURN_OFF_PIN_SUCCESS_MSG;
+	if (fields.message_len != strlen(expected) ||
+	    memcmp(fields.message, expected, fields.message_len) != 0) {
+		return copy_error(&fields, error_buf, error_len);
+	}
+	return 0;
+}
+
+int parse_device_response_json(const char *msg, bool turn_on,
+			       char *error_buf, size_t error_len)
+{
+	int ret_val = 0;
+	enum json_tokener_error err;
+	struct json_object *json = json_tokener_parse_verbose(msg, &err);
+	if (json == NULL) {
+		if ((size_t)snprintf(error_buf, error_len,
+				     "json-c error code %u",
+				     err) >= error_len) {
+			return -3;
+		}
+		return -1;
+	}
+	struct json_object *status = json_object_object_get(json, "response");
+	if (status == NULL || json_object_get_type(status) != json_type_int) {
+		ret_val = -2;
+		if ((size_t)snprintf(
+			    error_buf, error_len,
+			    "'status' field of type number not found in msg") >=
+		    error_len) {
+			ret_val = -3;
+		}
+		goto cleanup_json;
+	}
+	struct json_object *message_obj = json_object_object_get(json, "msg");
+	if (message_obj == NULL) {
+		ret_val = -2;
+		goto cleanup_json;
+	}
+	const char *message = json_object_get_string(message_obj);
+	if (message == NULL) {
+		ret_val = -2;
+		goto cleanup_json;
+	}
+	if (json_object_get_int64(status) != 0) {
+		// Error.
+		ret_val = 1;
+
+		if ((size_t)snprintf(error_buf, error_len, "%s", message) >=
+		    error_len) {
+			ret_val = -3;
+		}
+		goto cleanup_json;
+	}
+	// Success, just need to check if the expected action was performed.
+	if (turn_on && strcmp(message, TURN_ON_PIN_SUCCESS_MSG) != 0) {
+		ret_val = 1;
+		if ((size_t)snprintf(error_buf, error_len, "%s", message) >=
+		    error_len) {
+			ret_val = -3;
+		}
+		goto cleanup_json;
+	} else if (!turn_on && strcmp(message, TURN_OFF_PIN_SUCCESS_MSG) != 0) {
+		ret_val = 1;
+		if ((size_t)snprintf(error_buf, error_len, "%s", message) >=
+		    error_len) {
+			ret_val = -3;
+		}
+		goto cleanup_json;
+	}
+cleanup_json:
+	json_object_put(json);
+	return ret_val;
+}
+
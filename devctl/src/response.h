@@ -0,0 +1,30 @@
+#ifndef RESPONSE_H
+#define RESPONSE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+// Parses response from device and determines if the command was
+// executed successfully.
+// Example responses:
+//  {"response": 0, "msg": "Pin was turned on"}\r\n
+//  {"response": 0, "msg": "Pin was turned off"}\r\n
+// Responses of this shape are scanned in place without allocating
+// memory, anything else is handed to json-c.
+// Parameters:
+//  msg - null-terminated response, len - its length
+//  turn_on - cammand was to turn on a pin, otherwise turn off a pin
+// Return codes:
+//  0 - command executed successfully
+//  1 - command failed, error_buf is populated with error message
+// -1 - failed to parse msg, it is invalid JSON, error_buf contains error
+// -2 - msg does not contain required fields, error_buf contains error
+// -3 - error_buf is too small, its contents are undefined
+int parse_device_response(const char *msg, size_t len, bool turn_on,
+			  char *error_buf, size_t error_len);
+
+// Same as parse_device_response(), but always uses json-c.
+int parse_device_response_json(const char *msg, bool turn_on,
+			       char *error_buf, size_t error_len);
+
+#endif
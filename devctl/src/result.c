@@ -0,0 +1,155 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <limits.h>
+#include <syslog.h>
+
+#include "result.h"
+#include "args.h"
+#include "response.h"
+
+void set_pin_result(struct pin_result *res,
+		    enum devctl_status_code status, const char *message)
+{
+	res->status = status;
+	res->message = message;
+}
+
+// Determines the result of a pin control command. The response is only
+// needed during the call, the result does not refer to it.
+// send_ret - serial_send() status code
+// response - response from the device and its length, only valid if
+// send_ret is 0
+static void get_pin_result(struct pin_result *res, int send_ret,
+			   const char *response, size_t response_len,
+			   bool turn_on)
+{
+	int ret;
+	switch (send_ret) {
+	case 0:
+		syslog(LOG_DEBUG, "Received response '%s'", response);
+		ret = parse_device_response(response, response_len, turn_on,
+					    res->error_buf,
+					    sizeof(res->error_buf));
+		switch (ret) {
+		case 0:
+			set_pin_result(res, DEVCTL_OK,
+				       "Operation performed successfully");
+			break;
+		case 1:
+			set_pin_result(res, DEVCTL_OPERATION_FAILED,
+				       res->error_buf);
+			break;
+		case -1:
+		case -2:
+			syslog(LOG_ERR,
+			       "Failed to parse response from device. Response: '%s', error: %s",
+			       response, res->error_buf);
+			set_pin_result(res, DEVCTL_PARSE_FAILURE,
+				       "Failed to parse response from device");
+			break;
+		case -3:
+			syslog(LOG_ERR,
+			       "Insufficient error buffer size. Device response: %s",
+			       response);
+			set_pin_result(res, DEVCTL_UNKNOWN_ERROR,
+				       "Insufficient buffer size");
+			break;
+		default:
+			syslog(LOG_ERR,
+			       "Unrecognized parse_device_response() return code: %d",
+			       ret);
+			set_pin_result(res, DEVCTL_INTERNAL_ERROR,
+				       "Internal error");
+		}
+		break;
+	case -1:
+		set_pin_result(res, DEVCTL_CONNECT_FAIL,
+			       "Failed to open device file");
+		break;
+	case -2:
+		set_pin_result(res, DEVCTL_CONNECT_FAIL,
+			       "Failed to lock the device for exclusive access");
+		break;
+	case -3:
+		set_pin_result(res, DEVCTL_CONNECT_FAIL,
+			       "Failed to configure serial connection");
+		break;
+	case -4:
+		set_pin_result(res, DEVCTL_SEND_FAIL,
+			       "Failed to send message to device");
+		break;
+	case -5:
+		set_pin_result(res, DEVCTL_RECV_FAIL,
+			       "Failed to get response from device");
+		break;
+	case -6:
+		set_pin_result(res, DEVCTL_INTERNAL_ERROR,
+			       "Device response is too big for the buffer");
+		break;
+	case -7:
+		set_pin_result(res, DEVCTL_DISCONNECTED,
+			       "Device was disconnected");
+		break;
+	case -8:
+		set_pin_result(res, DEVCTL_DISCONNECTED,
+			       "Device is not responding");
+		break;
+	default:
+		syslog(LOG_ERR, "Unrecognized serial_send() return code: %d",
+		       send_ret);
+		set_pin_result(res, DEVCTL_INTERNAL_ERROR, "Internal error");
+	}
+}
+
+void get_req_result(struct pin_result *res, const struct serial_req *sreq,
+		    int status, bool turn_on)
+{
+	// The response belongs to the command that replaced this one.
+	get_pin_result(res, status, sreq->response, sreq->response_len,
+		       sreq->superseded ? sreq->final_on : turn_on);
+	if (sreq->superseded && res->status == DEVCTL_OK) {
+		set_pin_result(res, DEVCTL_OK,
+			       "Superseded by a later command");
+	}
+}
+
+void update_pin_state(const char *dev_id, uint32_t pin, bool turn_on,
+		      const struct pin_result *res)
+{
+	if (res->status != DEVCTL_OK) {
+		serial_set_pin_state(dev_id, pin, PIN_STATE_UNKNOWN);
+	} else if (turn_on) {
+		serial_set_pin_state(dev_id, pin, PIN_STATE_ON);
+	} else {
+		serial_set_pin_state(dev_id, pin, PIN_STATE_OFF);
+	}
+}
+
+void record_status(const struct serial_req *sreq,
+		   enum devctl_status_code status)
+{
+	struct device_stats *stats = serial_req_stats(sreq);
+	if (stats != NULL) {
+		stats->statuses[status] += 1;
+	}
+}
+
+bool schedule_retry(const struct serial_req *sreq,
+		    struct uloop_timeout *timer, unsigned int *attempts)
+{
+	if (*attempts >= config.parse_retries) {
+		return false;
+	}
+	struct device_stats *stats = serial_req_stats(sreq);
+	if (stats != NULL) {
+		stats->retries += 1;
+	}
+	unsigned int shift = *attempts < 16 ? *attempts : 16;
+	uint64_t delay = (uint64_t)config.retry_backoff_ms << shift;
+	int delay_ms = delay < INT_MAX ? (int)delay : INT_MAX;
+	*attempts += 1;
+	syslog(LOG_INFO, "Retrying command in %d ms (attempt %u)", delay_ms,
+	       *attempts);
+	uloop_timeout_set(timer, delay_ms);
+	return true;
+}
@@ -0,0 +1,74 @@
+#ifndef RESULT_H
+#define RESULT_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include <libubox/uloop.h>
+
+#include "serial.h"
+
+// Results of pin commands, shared by the ubus methods and the control
+// socket.
+
+// Returned status codes:
+enum devctl_status_code {
+	//  0 - operation performed successfully
+	DEVCTL_OK = 0,
+	//  1 - operation failed
+	DEVCTL_OPERATION_FAILED,
+	//  2 - failed to connect to device
+	DEVCTL_CONNECT_FAIL,
+	//  3 - failed to send message to device
+	DEVCTL_SEND_FAIL,
+	//  4 - failed to get response from device
+	DEVCTL_RECV_FAIL,
+	//  5 - device was disconnected
+	DEVCTL_DISCONNECTED,
+	//  6 - failed to parse response
+	DEVCTL_PARSE_FAILURE,
+	//  7 - response is in unexpected format
+	DEVCTL_UNEXPECTED_RESPONSE,
+	//  8 - unknown error related to device
+	DEVCTL_UNKNOWN_ERROR,
+	//  9 - internal error, unrelated to device
+	DEVCTL_INTERNAL_ERROR,
+	__DEVCTL_STATUS_MAX
+};
+
+_Static_assert(__DEVCTL_STATUS_MAX == STATS_NUM_STATUSES,
+	       "STATS_NUM_STATUSES must match the number of status codes");
+
+// Result of a pin control command.
+struct pin_result {
+	enum devctl_status_code status;
+	// Points to a string constant or to error_buf.
+	const char *message;
+	// Error message reported by the device.
+	char error_buf[MSG_MAXLEN];
+};
+
+void set_pin_result(struct pin_result *res,
+		    enum devctl_status_code status, const char *message);
+
+// Determines the result of a pin control command that may have been
+// replaced by a later command to the same pin.
+void get_req_result(struct pin_result *res, const struct serial_req *sreq,
+		    int status, bool turn_on);
+
+// Updates the cached pin state according to the command result.
+void update_pin_state(const char *dev_id, uint32_t pin, bool turn_on,
+		      const struct pin_result *res);
+
+// Counts the reply status in the statistics of the device.
+void record_status(const struct serial_req *sreq,
+		   enum devctl_status_code status);
+
+// Schedules the command to be sent again after a response that could not
+// be parsed, which usually means that it was garbled on the line. The
+// delay doubles with every attempt.
+// Returns false if all the configured retries were used up.
+bool schedule_retry(const struct serial_req *sreq,
+		    struct uloop_timeout *timer, unsigned int *attempts);
+
+#endif
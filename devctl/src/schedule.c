@@ -0,0 +1,272 @@
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+
+#include <libubox/list.h>
+#include <libubox/uloop.h>
+#include <libubox/utils.h>
+
+#include "schedule.h"
+#include "serial.h"
+#include "devices.h"
+#include "response.h"
+
+// Number of times a failed command is resent.
+#define MAX_ACTION_RETRIES 3
+// Delay before the first resend, doubled for every further one.
+#define ACTION_RETRY_MS 100
+
+struct scheduled_action {
+	struct list_head list;
+	uint32_t id;
+	// Device name as given by the client.
+	char *device;
+	// Device file name the last command was sent to, NULL if none was.
+	char *dev_id;
+	uint32_t pin;
+	bool state;
+	uint32_t pulse_ms;
+	// The action sets the pin back at the end of a pulse.
+	bool restore;
+	unsigned int attempts;
+	struct uloop_timeout timer;
+	struct serial_req sreq;
+	// The command was queued and has not completed yet.
+	bool sending;
+	// Cancelled while the command was being sent.
+	bool cancelled;
+};
+
+static LIST_HEAD(actions);
+static unsigned int num_actions;
+static uint32_t next_id = 1;
+// Set by schedule_free(), actions are dropped as soon as possible.
+static bool stopping;
+
+static void free_action(struct scheduled_action *action)
+{
+	uloop_timeout_cancel(&action->timer);
+	list_del(&action->list);
+	num_actions -= 1;
+	free(action->device);
+	free(action->dev_id);
+	free(action);
+}
+
+static struct scheduled_action *find_action(uint32_t id)
+{
+	struct scheduled_action *action;
+	list_for_each_entry(action, &actions, list) {
+		if (action->id == id) {
+			return action;
+		}
+	}
+	return NULL;
+}
+
+// Resends the command later if it failed for a reason that is likely to
+// go away, otherwise drops the action.
+static void action_failed(struct scheduled_action *action, bool transient,
+			  const char *reason)
+{
+	if (transient && !action->cancelled &&
+	    action->attempts < MAX_ACTION_RETRIES) {
+		int delay = ACTION_RETRY_MS << action->attempts;
+		action->attempts += 1;
+		syslog(LOG_INFO,
+		       "Setting pin %u of %s failed (%s), retrying in %d ms",
+		       action->pin, action->device, reason, delay);
+		uloop_timeout_set(&action->timer, delay);
+		return;
+	}
+	syslog(LOG_ERR, "Scheduled change of pin %u of %s failed: %s",
+	       action->pin, action->device, reason);
+	free_action(action);
+}
+
+// Moves on to the second half of a pulse or drops the completed action.
+static void action_done(struct scheduled_action *action)
+{
+	action->attempts = 0;
+	if (action->pulse_ms == 0) {
+		free_action(action);
+		return;
+	}
+	action->state = !action->state;
+	action->restore = true;
+	// The pulse is timed from the confirmation of the first change.
+	uloop_timeout_set(&action->timer,
+			  action->cancelled ? 0 : (int)action->pulse_ms);
+	action->pulse_ms = 0;
+	action->cancelled = false;
+}
+
+static void action_sent_cb(struct serial_req *sreq, int status)
+{
+	struct scheduled_action *action =
+		container_of(sreq, struct scheduled_action, sreq);
+	action->sending = false;
+	if (stopping) {
+		free_action(action);
+		return;
+	}
+	if (sreq->superseded) {
+		// A later command set the pin, which must not be undone by a
+		// retry.
+		if (status != 0) {
+			action_failed(action, false,
+				      stats_send_error_name(status));
+		} else {
+			action_done(action);
+		}
+		return;
+	}
+	if (status != 0) {
+		serial_set_pin_state(action->dev_id, action->pin,
+				     PIN_STATE_UNKNOWN);
+		action_failed(action, true, stats_send_error_name(status));
+		return;
+	}
+	char error_buf[MSG_MAXLEN];
+	int ret = parse_device_response(sreq->response, sreq->response_len,
+					action->state, error_buf,
+					sizeof(error_buf));
+	if (ret != 0) {
+		serial_set_pin_state(action->dev_id, action->pin,
+				     PIN_STATE_UNKNOWN);
+		// Unparsable responses are usually garbled on the line, while
+		// the device refusing the command will not change.
+		action_failed(action, ret == -1 || ret == -2,
+			      ret == 1 ? error_buf : "invalid response");
+		return;
+	}
+	serial_set_pin_state(action->dev_id, action->pin,
+			     action->state ? PIN_STATE_ON : PIN_STATE_OFF);
+	action_done(action);
+}
+
+static void action_timer_cb(struct uloop_timeout *t)
+{
+	struct scheduled_action *action =
+		container_of(t, struct scheduled_action, timer);
+	const char *dev_id = resolve_device(action->device);
+	if (dev_id == NULL) {
+		action_failed(action, true, "device is not connected");
+		return;
+	}
+	if (action->dev_id == NULL || strcmp(action->dev_id, dev_id) != 0) {
+		char *copy = strdup(dev_id);
+		if (copy == NULL) {
+			action_failed(action, true, "out of memory");
+			return;
+		}
+		free(action->dev_id);
+		action->dev_id = copy;
+	}
+	serial_format_pin_command(&action->sreq, action->pin, action->state);
+	action->sending = true;
+	serial_send(action->dev_id, &action->sreq);
+}
+
+bool schedule_add(const char *device, uint32_t pin, bool state,
+		  int delay_ms, uint32_t pulse_ms, uint32_t *id)
+{
+	if (num_actions >= MAX_SCHEDULED_ACTIONS) {
+		syslog(LOG_WARNING, "Too many scheduled actions");
+		return false;
+	}
+	struct scheduled_action *action = calloc(1, sizeof(*action));
+	if (action == NULL) {
+		syslog(LOG_ERR, "Failed to allocate memory for action");
+		return false;
+	}
+	action->device = strdup(device);
+	if (action->device == NULL) {
+		syslog(LOG_ERR, "Failed to allocate memory for action");
+		free(action);
+		return false;
+	}
+	action->id = next_id++;
+	if (next_id == 0) {
+		next_id = 1;
+	}
+	action->pin = pin;
+	action->state = state;
+	action->pulse_ms = pulse_ms;
+	action->timer.cb = action_timer_cb;
+	action->sreq.cb = action_sent_cb;
+	// Timed actions should not wait behind other traffic.
+	action->sreq.priority = SERIAL_PRIORITY_HIGH;
+	list_add_tail(&action->list, &actions);
+	num_actions += 1;
+	uloop_timeout_set(&action->timer, delay_ms);
+	*id = action->id;
+	return true;
+}
+
+bool schedule_cancel(uint32_t id)
+{
+	struct scheduled_action *action = find_action(id);
+	if (action == NULL || action->cancelled) {
+		return false;
+	}
+	if (action->restore) {
+		// End the pulse now, unless that is already happening.
+		if (!action->sending) {
+			uloop_timeout_set(&action->timer, 0);
+		}
+	} else if (action->sending) {
+		action->cancelled = true;
+	} else {
+		free_action(action);
+	}
+	return true;
+}
+
+void schedule_foreach(schedule_foreach_cb cb, void *priv)
+{
+	struct scheduled_action *action;
+	list_for_each_entry(action, &actions, list) {
+		if (action->cancelled) {
+			continue;
+		}
+		struct scheduled_action_info info = {
+			.id = action->id,
+			.device = action->device,
+			.pin = action->pin,
+			.state = action->state,
+			.pulse_ms = action->pulse_ms,
+			.attempts = action->attempts,
+		};
+		if (!action->sending) {
+			info.due_in_ms =
+				uloop_timeout_remaining64(&action->timer);
+			if (info.due_in_ms < 0) {
+				info.due_in_ms = 0;
+			}
+		}
+		cb(&info, priv);
+	}
+}
+
+void schedule_free(void)
+{
+	stopping = true;
+	struct scheduled_action *action, *tmp;
+	list_for_each_entry_safe(action, tmp, &actions, list) {
+		if (action->restore && !action->sending) {
+			syslog(LOG_WARNING,
+			       "Pin %u of %s is left %s, the pulse was not finished",
+			       action->pin, action->device,
+			       action->state ? "off" : "on");
+		}
+		// Commands that are being sent free their action once they
+		// complete.
+		if (action->sending) {
+			uloop_timeout_cancel(&action->timer);
+			action->cancelled = true;
+		} else {
+			free_action(action);
+		}
+	}
+}
@@ -0,0 +1,55 @@
+#ifndef SCHEDULE_H
+#define SCHEDULE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// Maximum number of actions waiting to be executed.
+#define MAX_SCHEDULED_ACTIONS 64
+
+// Pin change executed by the daemon at a later time.
+struct scheduled_action_info {
+	uint32_t id;
+	// Device name as given when the action was scheduled.
+	const char *device;
+	uint32_t pin;
+	// State the pin is set to next.
+	bool state;
+	// Milliseconds until the pin is set, 0 if the command is being sent.
+	int64_t due_in_ms;
+	// For pulses that have not started yet, how long the pin is held in
+	// state before it is set back. 0 otherwise.
+	uint32_t pulse_ms;
+	// Failed attempts to set the pin.
+	unsigned int attempts;
+};
+
+// Schedules the pin to be set to state after delay_ms milliseconds. If
+// pulse_ms is not 0, the pin is set back to the opposite state pulse_ms
+// milliseconds after the device confirms the first change. The device
+// is resolved by resolve_device() every time a command is sent, so the
+// action follows a device that is replugged in the meantime. Commands
+// that fail because of connection errors or garbled responses are
+// retried a few times.
+// Returns false if too many actions are scheduled or memory allocation
+// fails.
+bool schedule_add(const char *device, uint32_t pin, bool state,
+		  int delay_ms, uint32_t pulse_ms, uint32_t *id);
+
+// Cancels the action. A pulse that has already started is ended early:
+// the pin is set back right away. A command that is being sent can no
+// longer be stopped, but nothing is done after it completes.
+// Returns false if there is no action with this id.
+bool schedule_cancel(uint32_t id);
+
+typedef void (*schedule_foreach_cb)(const struct scheduled_action_info *info,
+				    void *priv);
+
+// Calls cb for every scheduled action, in the order they were scheduled.
+void schedule_foreach(schedule_foreach_cb cb, void *priv);
+
+// Drops all scheduled actions. Commands that are being sent are
+// forgotten once they complete.
+void schedule_free(void);
+
+#endif
@@ -4,6 +4,7 @@
 #include <syslog.h>
 #include <stdlib.h>
 #include <stdbool.h>
+#include <errno.h>
 
 #include <fcntl.h>
 #include <termios.h>
@@ -11,75 +12,223 @@
 #include <sys/file.h>
 #include <sys/types.h>
 
-#include <libserialport.h>
+#include <libubox/list.h>
+#include <libubox/uloop.h>
+#include <libubox/utils.h>
 
+#include "args.h"
+#include "framer.h"
 #include "serial.h"
+#include "events.h"
+#include "devices.h"
+#include "record.h"
 
-#define MSG_MAXLEN 50
+// How long to wait for the device to respond, unless configured for the
+// device.
+#define RESPONSE_TIMEOUT_MS 5000
+// How long to wait for the response to a probe while looking for the
+// baud rate of the device.
+#define PROBE_TIMEOUT_MS 300
+// How long to wait for the response to a health probe, unless
+// health_degraded_ms calls for longer or the device timeout is shorter.
+#define HEALTH_PROBE_TIMEOUT_MS 1000
+// Baud rate used if it is not configured for the device.
+#define DEFAULT_BAUDRATE 9600
+// Maximum number of pipelined requests in flight to a single device.
+// Keeps the total size of unanswered messages well below the 256 byte
+// UART receive buffer of the firmware.
+#define PIPELINE_DEPTH 8
+// Requests that waited this long are sent before requests of more urgent
+// priority classes.
+#define STARVATION_US 500000
 
-// USB VID and PID of NodeMCU 8266V3
-const int VENDOR_ID = 0x10C4;
-const int PRODUCT_ID = 0xEA60;
+_Static_assert(__SERIAL_PRIORITY_MAX == STATS_NUM_PRIORITIES,
+	       "STATS_NUM_PRIORITIES must match the number of classes");
 
-// Gets NodeMCU 8266V3 device file names.
-// devices - array to put device names in
-// max_devices - array size
-// num_devices - actual number of devices found
-// returns true on success, false on failure
-bool get_devices(char *devices[], unsigned int *num_devices,
-		 const unsigned int max_devices)
-{
-	bool ret_val = true;
-	struct sp_port **port_list;
+// Serial connection to a device. Connections are opened, locked and
+// configured once and then reused for every message, because reopening
+// the port is slow and may reset the board (CP210x toggles DTR/RTS).
+// Every device has its own request queue, so requests to different
+// devices are in flight at the same time while requests to the same
+// device are sent in the order they were queued.
+struct serial_dev {
+	struct list_head list;
+	// Device file name.
+	char *name;
+	// Open connection, fd.fd is -1 if it is not open. The descriptor is
+	// non-blocking and registered in uloop while the connection is open.
+	struct uloop_fd fd;
+	// Requests waiting to be sent, by priority class.
+	struct list_head pending_reqs[__SERIAL_PRIORITY_MAX];
+	// Requests that were (or are being) written and are waiting for the
+	// response, oldest first. Only the last one can be partially written.
+	// The device answers in order, so the next response belongs to the
+	// first request.
+	struct list_head sent_reqs;
+	unsigned int num_sent;
+	// Fires if the device does not respond to the first sent request in
+	// time.
+	struct uloop_timeout response_timeout;
+	// Bitmaps of pins with known state and pins that are on.
+	uint32_t pins_known;
+	uint32_t pins_on;
+	// Pin states restored from the snapshot that the device did not
+	// confirm yet, see serial_get_last_pin_state().
+	uint32_t pins_restored;
+	uint32_t pins_restored_on;
+	// Baud rate the connection is configured with.
+	unsigned int baudrate;
+	// Look for the highest baud rate the device responds at when the
+	// connection is opened. Cleared once the baud rate is found.
+	bool probe_baudrate;
+	// Line settings from the configuration, applied whenever the
+	// connection is opened.
+	unsigned int config_baudrate;
+	bool config_probe;
+	// The line settings were changed by a reload, the open connection is
+	// closed and reopened once no request is in flight.
+	bool reopen;
+	// Request used to probe baud rates, queued while probing.
+	struct serial_req probe_req;
+	// Received data that has not been split into responses yet.
+	struct framer rx;
+	struct device_stats stats;
+	// Requests that failed in a row, used to report when the device
+	// starts failing and when it recovers.
+	unsigned int consecutive_failures;
+	// Requests in a row that got no response (-5 or -7).
+	unsigned int consecutive_timeouts;
+	// Response timeout of requests that do not set one.
+	int timeout_ms;
+	// Requests are rejected until the device responds to check_req.
+	bool breaker_open;
+	// Probe sent periodically while the breaker is open.
+	struct serial_req check_req;
+	struct uloop_timeout check_timer;
+	// Health as last reported, see assess_health().
+	enum device_health health;
+	// Exchanges in a row that got no response, probes included.
+	unsigned int health_misses;
+	// Round trip time estimates, see struct serial_health. srtt_us is 0
+	// until the first measurement.
+	uint32_t srtt_us;
+	uint32_t rttvar_us;
+	uint32_t last_rtt_us;
+	// When the device last responded, 0 if it never did.
+	uint64_t last_response_us;
+	uint64_t health_probes;
+	// Keepalive probe sent by the health monitor to idle devices.
+	struct serial_req health_req;
+};
 
-	enum sp_return result = sp_list_ports(&port_list);
-	if (result != SP_OK) {
-		syslog(LOG_ERR, "sp_list_ports() failed with code %d", result);
-		return false;
-	}
+// All devices that messages have been sent to.
+static LIST_HEAD(serial_devs);
 
-	*num_devices = 0;
-	for (unsigned int i = 0; port_list[i] != NULL; ++i) {
-		struct sp_port *port = port_list[i];
+// Sends the keepalive probes, see serial_apply_health_config().
+static struct uloop_timeout health_timer;
 
-		// Port name on Linux is device file name.
-		char *dev_file = sp_get_port_name(port);
+// Set by close_serial_devs(). Requests aborted at shutdown say nothing
+// about the devices, so they are not counted as failures.
+static bool closing;
 
-		if (sp_get_port_transport(port) == SP_TRANSPORT_USB) {
-			int usb_vid, usb_pid;
-			result = sp_get_port_usb_vid_pid(port, &usb_vid,
-							 &usb_pid);
-			if (result != SP_OK) {
-				syslog(LOG_ERR,
-				       "sp_get_port_usb_vid_pid() failed with with code %d",
-				       result);
-				ret_val = false;
-				goto cleanup;
-			}
+static const char *const priority_names[] = {
+	[SERIAL_PRIORITY_HIGH] = "high",
+	[SERIAL_PRIORITY_NORMAL] = "normal",
+	[SERIAL_PRIORITY_LOW] = "low",
+};
 
-			syslog(LOG_DEBUG, "VID: %04X, PID: %04X",
-			       (unsigned)usb_vid, (unsigned)usb_pid);
-			if (usb_vid == VENDOR_ID && usb_pid == PRODUCT_ID) {
-				syslog(LOG_DEBUG, "Found device: %s", dev_file);
-				if (*num_devices == max_devices) {
-					syslog(LOG_WARNING,
-					       "Devices do not fit into the provided array");
-					goto cleanup;
-				}
-				devices[*num_devices] = strdup(dev_file);
-				*num_devices += 1;
-			}
+static const char *const health_names[] = {
+	[DEVICE_HEALTH_UNKNOWN] = "unknown",
+	[DEVICE_HEALTH_HEALTHY] = "healthy",
+	[DEVICE_HEALTH_DEGRADED] = "degraded",
+	[DEVICE_HEALTH_DEAD] = "dead",
+};
+
+// Supported baud rates, lowest first.
+static const struct {
+	unsigned int rate;
+	speed_t speed;
+} baudrates[] = {
+	{ 9600, B9600 },     { 19200, B19200 },	  { 38400, B38400 },
+	{ 57600, B57600 },   { 115200, B115200 }, { 230400, B230400 },
+	{ 460800, B460800 }, { 921600, B921600 },
+};
+
+// Harmless message used to check if the device responds. The firmware
+// does not know this action and only replies with an error.
+static const char probe_msg[] = "{\"action\":\"probe\"}";
+// Any well-formed response starts with this.
+static const char probe_response_prefix[] = "{\"response\"";
+
+// Returns the termios speed for the baud rate, B0 if it is not supported.
+static speed_t baudrate_to_speed(unsigned int rate)
+{
+	for (size_t i = 0; i < ARRAY_SIZE(baudrates); ++i) {
+		if (baudrates[i].rate == rate) {
+			return baudrates[i].speed;
 		}
 	}
+	return B0;
+}
 
-cleanup:
-	sp_free_port_list(port_list);
-	return ret_val;
+bool serial_baudrate_supported(unsigned int rate)
+{
+	return baudrate_to_speed(rate) != B0;
+}
+
+// Returns true if the settings we care about were applied. tcsetattr()
+// reports success if any of the requested settings were applied, so the
+// result has to be checked manually.
+static bool termios_applied(const struct termios *want,
+			    const struct termios *got)
+{
+	const tcflag_t cflags = CSIZE | PARENB | CSTOPB | CRTSCTS | CREAD |
+				CLOCAL | HUPCL;
+	const tcflag_t lflags = ICANON | ECHO | ECHOE | ECHONL | ISIG;
+	const tcflag_t iflags = IXON | IXOFF | IXANY | IGNBRK | BRKINT |
+				PARMRK | ISTRIP | INLCR | IGNCR | ICRNL;
+	const tcflag_t oflags = OPOST | ONLCR;
+	return (want->c_cflag & cflags) == (got->c_cflag & cflags) &&
+	       (want->c_lflag & lflags) == (got->c_lflag & lflags) &&
+	       (want->c_iflag & iflags) == (got->c_iflag & iflags) &&
+	       (want->c_oflag & oflags) == (got->c_oflag & oflags) &&
+	       want->c_cc[VTIME] == got->c_cc[VTIME] &&
+	       want->c_cc[VMIN] == got->c_cc[VMIN] &&
+	       cfgetispeed(want) == cfgetispeed(got) &&
+	       cfgetospeed(want) == cfgetospeed(got);
+}
+
+// Applies the settings and checks that they were applied.
+// Returns true on success.
+static bool apply_termios(int fd, const char *dev_name,
+			  const struct termios *tty)
+{
+	if (tcsetattr(fd, TCSANOW, tty) != 0) {
+		syslog(LOG_ERR,
+		       "Failed to set serial port settings for device %s: %m",
+		       dev_name);
+		return false;
+	}
+	struct termios applied;
+	if (tcgetattr(fd, &applied) != 0) {
+		syslog(LOG_ERR,
+		       "Failed to get current port configuration for %s: %m",
+		       dev_name);
+		return false;
+	}
+	if (!termios_applied(tty, &applied)) {
+		syslog(LOG_ERR,
+		       "Serial port settings for device %s were only partially applied",
+		       dev_name);
+		return false;
+	}
+	return true;
 }
 
 // Opens and configures the device with appropirate settings.
 // Returns true on success.
-static bool config_serial(const int *dev, const char *dev_name)
+static bool config_serial(const int *dev, const char *dev_name,
+			  speed_t speed)
 {
 	// struct termios must be initialized with a call to tcgetattr.
 	struct termios tty;
@@ -103,10 +252,14 @@ static bool config_serial(const int *dev, const char *dev_name)
 	tty.c_cflag &= ~(tcflag_t)CRTSCTS;
 	// Enable reading and ignore control lines.
 	tty.c_cflag |= CREAD | CLOCAL;
+	// Do not drop DTR/RTS on close, otherwise the board gets reset
+	// every time the connection is reopened.
+	tty.c_cflag &= ~(tcflag_t)HUPCL;
 	// Read and write raw data (disable special handling of newlines
-	// and other control characters)
-	//tty.c_lflag &= ~(tcflag_t)ICANON;
-	tty.c_lflag |= (tcflag_t)ICANON;
+	// and other control characters). Responses are split into lines by
+	// the framer, so a single read() may return partial or multiple
+	// responses.
+	tty.c_lflag &= ~(tcflag_t)ICANON;
 	// Disable echo.
 	tty.c_lflag &= ~(tcflag_t)ECHO;
 	// Disable erasure.
@@ -124,118 +277,1257 @@ static bool config_serial(const int *dev, const char *dev_name)
 	tty.c_oflag &= ~(tcflag_t)OPOST;
 	// Prevent \n -> \r\n conversion.
 	tty.c_oflag &= ~(tcflag_t)ONLCR;
-	// Wait for input for 5 seconds max.
-	tty.c_cc[VTIME] = 50;
+	// Never block in read(), response timeouts are handled by the
+	// event loop.
+	tty.c_cc[VTIME] = 0;
 	tty.c_cc[VMIN] = 0;
-	// Set baud rate to 9600.
-	cfsetispeed(&tty, B9600);
-	cfsetospeed(&tty, B9600);
+	cfsetispeed(&tty, speed);
+	cfsetospeed(&tty, speed);
 
 	// Save the settings.
-	if (tcsetattr(*dev, TCSANOW, &tty) != 0) {
+	return apply_termios(*dev, dev_name, &tty);
+}
+
+// Changes the baud rate of the open connection.
+// Returns true on success.
+static bool set_baudrate(struct serial_dev *dev, unsigned int rate)
+{
+	struct termios tty;
+	if (tcgetattr(dev->fd.fd, &tty) != 0) {
 		syslog(LOG_ERR,
-		       "Failed to set serial port settings for device %s: %m",
-		       dev_name);
+		       "Failed to get current port configuration for %s: %m",
+		       dev->name);
 		return false;
 	}
-	// TODO: Since tcsetattr reports success if any of the provided settings
-	// were applied (not neccessarily all), we should check it manually.
-
+	speed_t speed = baudrate_to_speed(rate);
+	cfsetispeed(&tty, speed);
+	cfsetospeed(&tty, speed);
+	if (!apply_termios(dev->fd.fd, dev->name, &tty)) {
+		return false;
+	}
+	// Anything received at the old rate is garbage.
+	tcflush(dev->fd.fd, TCIOFLUSH);
+	framer_reset(&dev->rx);
+	dev->baudrate = rate;
 	return true;
 }
-/*
-static ssize_t read_msg(int fd, char *buf, size_t bufsize)
-{
-	ssize_t read_bytes = read(fd, buf, bufsize - 1);
-	if (read_bytes == -1) {
-		syslog(LOG_ERR, "Error reading from device %s: %m", device);
-		ret_val = -5;
-		goto cleanup;
-	} else if (read_bytes == 0) {
-		syslog(LOG_DEBUG,
-		       "Read 0 bytes from device, maybe disconnected?");
-		return read_bytes;
+
+static struct serial_dev *find_serial_dev(const char *device)
+{
+	struct serial_dev *dev;
+	list_for_each_entry(dev, &serial_devs, list) {
+		if (strcmp(dev->name, device) == 0) {
+			return dev;
+		}
+	}
+	return NULL;
+}
+
+// Closes the connection. It will be reopened the next time a message is
+// sent to the device.
+static void invalidate_serial_dev(struct serial_dev *dev)
+{
+	if (dev->fd.fd == -1) {
+		return;
+	}
+	syslog(LOG_INFO, "Closing connection to device %s", dev->name);
+	// Whatever happens to the device while it is not connected is
+	// unknown.
+	dev->pins_known = 0;
+	uloop_fd_delete(&dev->fd);
+	record_frame(RECORD_CLOSE, dev->name, NULL, 0);
+	// Closing the file also releases the lock.
+	close(dev->fd.fd);
+	dev->fd.fd = -1;
+}
+
+static void send_pending_reqs(struct serial_dev *dev);
+static void finish_req(struct serial_req *req, int status);
+
+// Returns true if the request was queued by devctl itself rather than on
+// behalf of a client.
+static bool is_internal_req(const struct serial_dev *dev,
+			    const struct serial_req *req)
+{
+	return req == &dev->probe_req || req == &dev->check_req ||
+	       req == &dev->health_req;
+}
+
+// Starts rejecting requests to a device that stopped responding, so that
+// clients do not wait for the response timeout again and again. The
+// device is probed periodically until it responds. missed is the number
+// of requests in a row that got no response, for the log.
+static void open_breaker(struct serial_dev *dev, unsigned int missed)
+{
+	syslog(LOG_WARNING,
+	       "Device %s did not respond to %u requests, rejecting requests",
+	       dev->name, missed);
+	dev->breaker_open = true;
+	dev->stats.breaker_trips += 1;
+
+	// Callbacks may queue new requests, which are rejected right away.
+	LIST_HEAD(rejected);
+	struct serial_req *req, *tmp;
+	for (size_t i = 0; i < __SERIAL_PRIORITY_MAX; ++i) {
+		list_for_each_entry_safe(req, tmp, &dev->pending_reqs[i],
+					 list) {
+			if (!is_internal_req(dev, req)) {
+				list_move_tail(&req->list, &rejected);
+			}
+		}
+	}
+	list_for_each_entry_safe(req, tmp, &rejected, list) {
+		finish_req(req, -8);
+	}
+	uloop_timeout_set(&dev->check_timer, (int)config.breaker_probe_ms);
+}
+
+// Returns the health of the device according to the recent exchanges.
+static enum device_health assess_health(const struct serial_dev *dev)
+{
+	if (config.health_dead_after != 0 &&
+	    dev->health_misses >= config.health_dead_after) {
+		return DEVICE_HEALTH_DEAD;
+	}
+	if (dev->health_misses > 0) {
+		return DEVICE_HEALTH_DEGRADED;
+	}
+	if (dev->last_response_us == 0) {
+		return DEVICE_HEALTH_UNKNOWN;
+	}
+	if (config.health_degraded_ms != 0 &&
+	    dev->srtt_us > (uint64_t)config.health_degraded_ms * 1000) {
+		return DEVICE_HEALTH_DEGRADED;
+	}
+	return DEVICE_HEALTH_HEALTHY;
+}
+
+// Reports a change of the health of the device. A device found dead
+// while the health monitor is enabled has its breaker opened, so that
+// requests are rejected instead of waiting for the response timeout.
+static void report_health(struct serial_dev *dev)
+{
+	enum device_health health = assess_health(dev);
+	if (health == dev->health) {
+		return;
+	}
+	dev->health = health;
+	syslog(health == DEVICE_HEALTH_HEALTHY ? LOG_NOTICE : LOG_WARNING,
+	       "Device %s is %s, round trip time %u us", dev->name,
+	       health_names[health], dev->srtt_us);
+	event_device_health(dev->name, health_names[health], dev->srtt_us);
+	if (health == DEVICE_HEALTH_DEAD && config.health_interval_ms != 0 &&
+	    !dev->breaker_open) {
+		open_breaker(dev, dev->health_misses);
+	}
+}
+
+// Adds a round trip time measurement to the estimates.
+static void add_rtt_sample(struct serial_dev *dev, uint64_t rtt_us)
+{
+	uint32_t rtt = rtt_us < UINT32_MAX ? (uint32_t)rtt_us : UINT32_MAX;
+	dev->last_rtt_us = rtt;
+	if (dev->srtt_us == 0) {
+		dev->srtt_us = rtt != 0 ? rtt : 1;
+		dev->rttvar_us = rtt / 2;
+		return;
+	}
+	// RTTVAR = 3/4 RTTVAR + 1/4 |SRTT - R|, SRTT = 7/8 SRTT + 1/8 R
+	int64_t err = (int64_t)rtt - (int64_t)dev->srtt_us;
+	int64_t dev_err = (err < 0 ? -err : err) - (int64_t)dev->rttvar_us;
+	dev->rttvar_us = (uint32_t)((int64_t)dev->rttvar_us + dev_err / 4);
+	dev->srtt_us = (uint32_t)((int64_t)dev->srtt_us + err / 8);
+	if (dev->srtt_us == 0) {
+		dev->srtt_us = 1;
+	}
+}
+
+// Counts the outcome of an exchange with the device for its health.
+static void update_health(struct serial_dev *dev, int status)
+{
+	if (status == -8) {
+		// Rejected, nothing was sent.
+		return;
+	}
+	// A response that is too long is still a response.
+	if (status == 0 || status == -6) {
+		dev->health_misses = 0;
 	} else {
-		syslog(LOG_DEBUG, "Read %zd bytes from device %s", read_bytes,
-		       device);
+		dev->health_misses += 1;
+	}
+	report_health(dev);
+}
+
+// Reports the result of a request to the requests that were merged into
+// it.
+static void finish_followers(struct list_head *followers, int status,
+			     char *response, size_t response_len)
+{
+	struct serial_req *req, *tmp;
+	list_for_each_entry_safe(req, tmp, followers, list) {
+		list_del(&req->list);
+		req->response = response;
+		req->response_len = response_len;
+		req->cb(req, status);
 	}
-	// read() does not append null terminator.
-	buf[read_bytes] = '\0';
 }
-*/
+
+// Removes the request from the queue and reports the result to its owner.
+static void finish_req(struct serial_req *req, int status)
+{
+	struct serial_dev *dev = req->dev;
+	list_del(&req->list);
+	LIST_HEAD(followers);
+	list_splice_init(&req->followers, &followers);
+	char *response = req->response;
+	size_t response_len = req->response_len;
+	if (req->sent) {
+		dev->num_sent -= 1;
+		req->sent = false;
+	}
+	if (!closing && !is_internal_req(dev, req)) {
+		if (status < 0) {
+			stats_record_send_error(&dev->stats, status);
+			if (dev->consecutive_failures++ == 0) {
+				event_device_failing(dev->name, status);
+			}
+		} else if (dev->consecutive_failures > 0) {
+			dev->consecutive_failures = 0;
+			event_device_recovered(dev->name);
+		}
+		if (status == -5 || status == -7) {
+			dev->consecutive_timeouts += 1;
+			if (!dev->breaker_open &&
+			    config.breaker_threshold != 0 &&
+			    dev->consecutive_timeouts >=
+				    config.breaker_threshold) {
+				open_breaker(dev,
+					     dev->consecutive_timeouts);
+			}
+		} else if (status != -8) {
+			dev->consecutive_timeouts = 0;
+		}
+	}
+	// Baud rate probes fail at the wrong rates by design.
+	if (!closing && req != &dev->probe_req) {
+		update_health(dev, status);
+	}
+	// The callback may free req, do not touch it afterwards.
+	req->cb(req, status);
+	finish_followers(&followers, status, response, response_len);
+}
+
+// Completes all requests that were sent to the device with the given
+// status. Used when responses can no longer be matched to requests.
+static void fail_sent_reqs(struct serial_dev *dev, int status)
+{
+	uloop_timeout_cancel(&dev->response_timeout);
+	struct serial_req *req, *tmp;
+	list_for_each_entry_safe(req, tmp, &dev->sent_reqs, list) {
+		finish_req(req, status);
+	}
+}
+
+static void serial_fd_cb(struct uloop_fd *u, unsigned int events);
+static void response_timeout_cb(struct uloop_timeout *t);
+
+// Opens, locks and configures the device. The lock is held until the
+// connection is closed.
 // Returns:
 // 0 on success
 // -1 if failed to open device file
 // -2 if failed to lock the device for exclusive access
 // -3 if failed to configure serial connection
-// -4 if writing to device fails
-// -5 if reading from device fails
-// -6 if the response buffer is too small
-// -7 if device was disconnected
-int send_msg(const char *device, const char *msg, const size_t msg_len,
-	     char *response, size_t resp_len)
-{
-	int ret_val = 0;
-	int dev_fd = open(device, O_RDWR);
-	if (dev_fd == -1) {
-		syslog(LOG_ERR, "Failed to open device file %s: %m", device);
+static int open_serial_dev(struct serial_dev *dev)
+{
+	uint64_t start_us = stats_now_us();
+	dev->fd.fd = open(dev->name, O_RDWR | O_NOCTTY | O_NONBLOCK);
+	if (dev->fd.fd == -1) {
+		syslog(LOG_ERR, "Failed to open device file %s: %m", dev->name);
 		return -1;
 	}
 	// Lock the device to prevent other processes from interacting with it.
-	if (flock(dev_fd, LOCK_EX | LOCK_NB) == -1) {
+	if (flock(dev->fd.fd, LOCK_EX | LOCK_NB) == -1) {
 		syslog(LOG_ERR,
 		       "Failed to lock device %s for exclusive access: %m",
+		       dev->name);
+		close(dev->fd.fd);
+		dev->fd.fd = -1;
+		return -2;
+	}
+	if (!config_serial(&dev->fd.fd, dev->name,
+			   baudrate_to_speed(dev->baudrate))) {
+		close(dev->fd.fd);
+		dev->fd.fd = -1;
+		return -3;
+	}
+	dev->fd.cb = serial_fd_cb;
+	if (uloop_fd_add(&dev->fd, ULOOP_READ) != 0) {
+		syslog(LOG_ERR, "Failed to add device %s to uloop", dev->name);
+		close(dev->fd.fd);
+		dev->fd.fd = -1;
+		return -3;
+	}
+	framer_reset(&dev->rx);
+	record_frame(RECORD_OPEN, dev->name, NULL, 0);
+	stats_record_latency(&dev->stats.latency[PHASE_OPEN], start_us);
+	syslog(LOG_INFO, "Opened connection to device %s at %u baud",
+	       dev->name, dev->baudrate);
+	return 0;
+}
+
+// Queues the baud rate probe in front of all other requests, starting
+// with the highest supported rate.
+static void start_baudrate_probe(struct serial_dev *dev)
+{
+	if (!set_baudrate(dev, baudrates[ARRAY_SIZE(baudrates) - 1].rate)) {
+		dev->probe_baudrate = false;
+		return;
+	}
+	syslog(LOG_INFO, "Probing baud rate of device %s", dev->name);
+	list_add(&dev->probe_req.list,
+		 &dev->pending_reqs[SERIAL_PRIORITY_HIGH]);
+}
+
+// Checks the response to the probe. If there is no valid response, tries
+// the next lower baud rate, down to the configured one.
+static void probe_cb(struct serial_req *req, int status)
+{
+	struct serial_dev *dev =
+		container_of(req, struct serial_dev, probe_req);
+	if (status == 0 && strncmp(req->response, probe_response_prefix,
+				   sizeof(probe_response_prefix) - 1) == 0) {
+		syslog(LOG_INFO, "Device %s responds at %u baud", dev->name,
+		       dev->baudrate);
+		dev->probe_baudrate = false;
+		return;
+	}
+	if (status != 0 && status != -5 && status != -6) {
+		// Connection failed, probe again once it is reopened.
+		return;
+	}
+
+	const struct device_config *cfg = find_config_for_device(dev->name);
+	unsigned int min_rate = DEFAULT_BAUDRATE;
+	if (cfg != NULL && cfg->baudrate != 0) {
+		min_rate = cfg->baudrate;
+	}
+	unsigned int next_rate = 0;
+	for (size_t i = ARRAY_SIZE(baudrates); i-- > 0;) {
+		if (baudrates[i].rate < dev->baudrate &&
+		    baudrates[i].rate >= min_rate) {
+			next_rate = baudrates[i].rate;
+			break;
+		}
+	}
+	if (next_rate == 0) {
+		syslog(LOG_WARNING,
+		       "Device %s did not respond at any baud rate, using %u",
+		       dev->name, min_rate);
+		dev->probe_baudrate = false;
+		set_baudrate(dev, min_rate);
+		return;
+	}
+	if (!set_baudrate(dev, next_rate)) {
+		dev->probe_baudrate = false;
+		return;
+	}
+	list_add(&req->list, &dev->pending_reqs[SERIAL_PRIORITY_HIGH]);
+}
+
+// Queues the breaker probe in front of all other requests.
+static void check_timer_cb(struct uloop_timeout *t)
+{
+	struct serial_dev *dev =
+		container_of(t, struct serial_dev, check_timer);
+	list_add(&dev->check_req.list,
+		 &dev->pending_reqs[SERIAL_PRIORITY_HIGH]);
+	send_pending_reqs(dev);
+}
+
+// Stops rejecting requests once the device responds to the probe.
+static void check_cb(struct serial_req *req, int status)
+{
+	struct serial_dev *dev =
+		container_of(req, struct serial_dev, check_req);
+	if (status == 0 && strncmp(req->response, probe_response_prefix,
+				   sizeof(probe_response_prefix) - 1) == 0) {
+		syslog(LOG_NOTICE, "Device %s responds again, accepting requests",
+		       dev->name);
+		dev->breaker_open = false;
+		dev->consecutive_timeouts = 0;
+		return;
+	}
+	uloop_timeout_set(&dev->check_timer, (int)config.breaker_probe_ms);
+}
+
+static void health_cb(struct serial_req *req, int status)
+{
+	// The outcome is counted by update_health() like that of any other
+	// request.
+	(void)req;
+	(void)status;
+}
+
+// Reads the settings of the device from the configuration. The line
+// settings are only stored, see apply_line_config().
+// Returns true if the line settings differ from the ones read before.
+static bool read_device_config(struct serial_dev *dev)
+{
+	unsigned int baudrate = DEFAULT_BAUDRATE;
+	bool probe = false;
+	dev->timeout_ms = RESPONSE_TIMEOUT_MS;
+	const struct device_config *cfg = find_config_for_device(dev->name);
+	if (cfg != NULL) {
+		if (cfg->baudrate != 0) {
+			baudrate = cfg->baudrate;
+		}
+		if (cfg->timeout_ms != 0) {
+			dev->timeout_ms = (int)cfg->timeout_ms;
+		}
+		probe = cfg->probe_baudrate;
+	}
+	bool changed = baudrate != dev->config_baudrate ||
+		       probe != dev->config_probe;
+	dev->config_baudrate = baudrate;
+	dev->config_probe = probe;
+	return changed;
+}
+
+// Uses the configured line settings for the next connection. The
+// connection must not be open.
+static void apply_line_config(struct serial_dev *dev)
+{
+	dev->baudrate = dev->config_baudrate;
+	dev->probe_baudrate = dev->config_probe;
+	dev->reopen = false;
+}
+
+// Returns the device entry, creating it if needed. The connection is not
+// opened. Returns NULL on memory allocation failure.
+static struct serial_dev *get_serial_dev(const char *device)
+{
+	struct serial_dev *dev = find_serial_dev(device);
+	if (dev != NULL) {
+		return dev;
+	}
+	dev = calloc(1, sizeof(*dev));
+	if (dev == NULL) {
+		syslog(LOG_ERR, "Failed to allocate memory for device %s",
 		       device);
-		ret_val = -2;
-		goto cleanup;
+		return NULL;
 	}
+	dev->name = strdup(device);
+	if (dev->name == NULL) {
+		syslog(LOG_ERR, "Failed to allocate memory for device %s",
+		       device);
+		free(dev);
+		return NULL;
+	}
+	dev->fd.fd = -1;
+	for (size_t i = 0; i < __SERIAL_PRIORITY_MAX; ++i) {
+		INIT_LIST_HEAD(&dev->pending_reqs[i]);
+	}
+	INIT_LIST_HEAD(&dev->sent_reqs);
+	dev->response_timeout.cb = response_timeout_cb;
+
+	dev->check_timer.cb = check_timer_cb;
+
+	read_device_config(dev);
+	apply_line_config(dev);
+	memcpy(dev->probe_req.msg, probe_msg, sizeof(probe_msg));
+	dev->probe_req.msg_len = sizeof(probe_msg) - 1;
+	dev->probe_req.timeout_ms = PROBE_TIMEOUT_MS;
+	dev->probe_req.cb = probe_cb;
+	dev->probe_req.dev = dev;
+	INIT_LIST_HEAD(&dev->probe_req.followers);
+	memcpy(dev->check_req.msg, probe_msg, sizeof(probe_msg));
+	dev->check_req.msg_len = sizeof(probe_msg) - 1;
+	dev->check_req.cb = check_cb;
+	dev->check_req.dev = dev;
+	INIT_LIST_HEAD(&dev->check_req.followers);
+	memcpy(dev->health_req.msg, probe_msg, sizeof(probe_msg));
+	dev->health_req.msg_len = sizeof(probe_msg) - 1;
+	dev->health_req.cb = health_cb;
+	dev->health_req.priority = SERIAL_PRIORITY_LOW;
+	dev->health_req.dev = dev;
+	INIT_LIST_HEAD(&dev->health_req.followers);
+	list_add_tail(&dev->list, &serial_devs);
+	return dev;
+}
 
-	if (!config_serial(&dev_fd, device)) {
-		ret_val = -3;
-		goto cleanup;
+// Returns true if errno after a failed read() or write() indicates that
+// the device is gone.
+static bool is_disconnect_error(int err)
+{
+	return err == EIO || err == ENXIO || err == ENODEV;
+}
+
+// Starts waiting for the response to the first sent request, if it was
+// written completely.
+static void arm_response_timeout(struct serial_dev *dev)
+{
+	if (list_empty(&dev->sent_reqs)) {
+		return;
+	}
+	const struct serial_req *req =
+		list_first_entry(&dev->sent_reqs, struct serial_req, list);
+	if (req->written < req->msg_len) {
+		return;
 	}
+	uloop_timeout_set(&dev->response_timeout, req->timeout_ms > 0 ?
+							  req->timeout_ms :
+							  dev->timeout_ms);
+}
+
+// Writes the rest of the last sent request.
+// Returns true if the whole request was written.
+static bool write_last_req(struct serial_dev *dev)
+{
+	struct serial_req *req =
+		list_last_entry(&dev->sent_reqs, struct serial_req, list);
 
-	ssize_t written = write(dev_fd, msg, msg_len);
+	ssize_t written = write(dev->fd.fd, req->msg + req->written,
+				req->msg_len - req->written);
 	if (written == -1) {
-		syslog(LOG_ERR, "Error writing to device %s: %m", device);
-		ret_val = -4;
-		goto cleanup;
-	}
-	if ((size_t)written < msg_len) {
-		syslog(LOG_ERR, "Written %zd out of %zu bytes to device %s",
-		       written, msg_len, device);
-		ret_val = -4;
-		goto cleanup;
+		if (errno == EAGAIN) {
+			uloop_fd_add(&dev->fd, ULOOP_READ | ULOOP_WRITE);
+			return false;
+		}
+		syslog(LOG_ERR, "Error writing to device %s: %m", dev->name);
+		// The state of the connection is unknown, start over next time.
+		invalidate_serial_dev(dev);
+		finish_req(req, -4);
+		fail_sent_reqs(dev, -5);
+		return false;
+	}
+	req->written += (size_t)written;
+	dev->stats.bytes_written += (uint64_t)written;
+	if (req->written < req->msg_len) {
+		uloop_fd_add(&dev->fd, ULOOP_READ | ULOOP_WRITE);
+		return false;
+	}
+	syslog(LOG_DEBUG, "Wrote %zu bytes to device %s", req->written,
+	       dev->name);
+	record_frame(RECORD_TX, dev->name, req->msg, req->msg_len);
+	req->phase_start_us = stats_record_latency(
+		&dev->stats.latency[PHASE_WRITE], req->phase_start_us);
+	uloop_fd_add(&dev->fd, ULOOP_READ);
+	if (!dev->response_timeout.pending) {
+		arm_response_timeout(dev);
+	}
+	return true;
+}
+
+// Returns true if req can be written to the device now. Requests wait
+// for all earlier requests to be answered, unless both the request and
+// the requests in flight allow pipelining.
+static bool can_send_req(const struct serial_dev *dev,
+			 const struct serial_req *req)
+{
+	if (list_empty(&dev->sent_reqs)) {
+		return true;
+	}
+	const struct serial_req *last =
+		list_last_entry(&dev->sent_reqs, struct serial_req, list);
+	// The health probe is only sent to idle devices. Requests queued
+	// while it is in flight are written right behind it rather than
+	// waiting for its response, and are sent again if it times out,
+	// see response_timeout_cb().
+	bool after_probe = dev->num_sent == 1 && last == &dev->health_req;
+	return last->written == last->msg_len &&
+	       (after_probe || (last->pipeline && req->pipeline)) &&
+	       dev->num_sent < PIPELINE_DEPTH;
+}
+
+// Returns true if requests are queued to the device or in flight.
+static bool is_busy(const struct serial_dev *dev)
+{
+	for (size_t i = 0; i < __SERIAL_PRIORITY_MAX; ++i) {
+		if (!list_empty(&dev->pending_reqs[i])) {
+			return true;
+		}
+	}
+	return !list_empty(&dev->sent_reqs);
+}
+
+// Returns the request to send next: the first request of the most
+// urgent class, unless the first request of a less urgent class has
+// waited too long and is older. Returns NULL if nothing is pending.
+static struct serial_req *next_pending_req(struct serial_dev *dev)
+{
+	struct serial_req *next = NULL;
+	uint64_t now_us = stats_now_us();
+	for (size_t i = 0; i < __SERIAL_PRIORITY_MAX; ++i) {
+		if (list_empty(&dev->pending_reqs[i])) {
+			continue;
+		}
+		struct serial_req *req = list_first_entry(
+			&dev->pending_reqs[i], struct serial_req, list);
+		if (next == NULL ||
+		    (now_us - req->queued_us >= STARVATION_US &&
+		     req->queued_us < next->queued_us)) {
+			next = req;
+		}
+	}
+	return next;
+}
+
+// Writes pending requests to the device as long as it is allowed.
+static void send_pending_reqs(struct serial_dev *dev)
+{
+	struct serial_req *req;
+	while ((req = next_pending_req(dev)) != NULL) {
+		if (!can_send_req(dev, req)) {
+			return;
+		}
+
+		// If the connection was opened earlier, the device might
+		// have been replugged since then. In that case the first
+		// write fails and the connection is reopened once.
+		bool first = list_empty(&dev->sent_reqs);
+		// A baud rate probe in progress is finished first, it is
+		// queued again by start_baudrate_probe() after reopening.
+		if (dev->reopen && first && req != &dev->probe_req) {
+			invalidate_serial_dev(dev);
+		}
+		bool reused = dev->fd.fd != -1;
+		if (!reused) {
+			if (dev->reopen) {
+				apply_line_config(dev);
+			}
+			int ret = open_serial_dev(dev);
+			if (ret != 0) {
+				finish_req(req, ret);
+				continue;
+			}
+			if (dev->probe_baudrate) {
+				start_baudrate_probe(dev);
+				continue;
+			}
+		}
+		if (first) {
+			// Responses that arrived after an earlier request
+			// timed out must not be mistaken for the response to
+			// this request.
+			tcflush(dev->fd.fd, TCIFLUSH);
+			framer_reset(&dev->rx);
+		}
+
+		list_move_tail(&req->list, &dev->sent_reqs);
+		req->sent = true;
+		req->written = 0;
+		req->phase_start_us = stats_now_us();
+		if (!is_internal_req(dev, req)) {
+			stats_record_latency(
+				&dev->stats.queue_wait[req->priority],
+				req->queued_us);
+		}
+		dev->num_sent += 1;
+
+		ssize_t written = write(dev->fd.fd, req->msg, req->msg_len);
+		if (written == -1 && first && reused &&
+		    is_disconnect_error(errno)) {
+			syslog(LOG_INFO,
+			       "Device %s was disconnected, reconnecting",
+			       dev->name);
+			invalidate_serial_dev(dev);
+			int ret = open_serial_dev(dev);
+			if (ret != 0) {
+				finish_req(req, ret);
+				continue;
+			}
+		} else if (written > 0) {
+			req->written = (size_t)written;
+			dev->stats.bytes_written += (uint64_t)written;
+		}
+		if (!write_last_req(dev)) {
+			// Either the write would block, in which case
+			// serial_fd_cb() continues, or the request failed.
+			if (dev->fd.fd == -1) {
+				continue;
+			}
+			return;
+		}
+	}
+}
+
+// Puts the requests in flight behind the first one back in front of
+// their queues, so that they are written again.
+static void requeue_later_reqs(struct serial_dev *dev)
+{
+	while (dev->num_sent > 1) {
+		struct serial_req *req = list_last_entry(
+			&dev->sent_reqs, struct serial_req, list);
+		list_move(&req->list, &dev->pending_reqs[req->priority]);
+		req->sent = false;
+		dev->num_sent -= 1;
+	}
+}
+
+// Handles the lack of response to the first sent request. Since
+// responses are matched to requests by order, all requests in flight
+// are failed, except for the requests written behind a health probe.
+// Those are sent again, so that a missed probe does not fail them.
+static void response_timeout_cb(struct uloop_timeout *t)
+{
+	struct serial_dev *dev =
+		container_of(t, struct serial_dev, response_timeout);
+	syslog(LOG_ERR, "Device %s did not respond in time", dev->name);
+	record_frame(RECORD_TIMEOUT, dev->name, NULL, 0);
+	struct serial_req *first =
+		list_first_entry(&dev->sent_reqs, struct serial_req, list);
+	if (first == &dev->health_req) {
+		// Requeued first, so that they are rejected if the missed
+		// probe opens the breaker.
+		requeue_later_reqs(dev);
+		finish_req(first, -5);
 	} else {
-		syslog(LOG_DEBUG, "Wrote %zd bytes to device %s", written,
-		       device);
+		fail_sent_reqs(dev, -5);
 	}
+	send_pending_reqs(dev);
+}
 
-	char msg_buf[MSG_MAXLEN];
-	ssize_t read_bytes = read(dev_fd, msg_buf, sizeof(msg_buf) - 1);
-	if (read_bytes == -1) {
-		syslog(LOG_ERR, "Error reading from device %s: %m", device);
-		ret_val = -5;
-		goto cleanup;
-	} else if (read_bytes == 0) {
-		syslog(LOG_DEBUG,
-		       "Read 0 bytes from device, maybe disconnected?");
-		ret_val = -7;
-		goto cleanup;
+// Matches a complete line received from the device to the first sent
+// request.
+static void handle_frame(struct serial_dev *dev, char *frame,
+			 size_t frame_len)
+{
+	if (frame_len == 0) {
+		return;
+	}
+	record_frame(RECORD_RX, dev->name, frame, frame_len);
+	struct serial_req *req = NULL;
+	if (!list_empty(&dev->sent_reqs)) {
+		req = list_first_entry(&dev->sent_reqs, struct serial_req,
+				       list);
+	}
+	if (req == NULL || req->written < req->msg_len) {
+		syslog(LOG_WARNING, "Discarding unexpected data from device %s",
+		       dev->name);
+		// The device might have been reset.
+		dev->pins_known = 0;
+		dev->pins_restored = 0;
+		return;
+	}
+	uloop_timeout_cancel(&dev->response_timeout);
+	uint64_t now_us = stats_record_latency(
+		&dev->stats.latency[PHASE_WAIT], req->phase_start_us);
+	dev->last_response_us = now_us;
+	// The wait of a pipelined request includes answering the ones
+	// before it, only requests sent alone measure the round trip.
+	if (dev->num_sent == 1) {
+		add_rtt_sample(dev, now_us - req->phase_start_us);
+	}
+	req->response = frame;
+	req->response_len = frame_len;
+	finish_req(req, 0);
+	arm_response_timeout(dev);
+}
+
+static void serial_fd_cb(struct uloop_fd *u, unsigned int events)
+{
+	struct serial_dev *dev = container_of(u, struct serial_dev, fd);
+
+	if ((events & ULOOP_WRITE) && !list_empty(&dev->sent_reqs)) {
+		struct serial_req *last = list_last_entry(
+			&dev->sent_reqs, struct serial_req, list);
+		if (last->written < last->msg_len && write_last_req(dev)) {
+			send_pending_reqs(dev);
+		}
+		if (dev->fd.fd == -1) {
+			send_pending_reqs(dev);
+			return;
+		}
+	}
+	if (!(events & ULOOP_READ) && !u->eof && !u->error) {
+		return;
+	}
+
+	ssize_t read_bytes = framer_read(&dev->rx, u->fd);
+	if (read_bytes == -1 && errno == EAGAIN) {
+		return;
+	}
+	if (read_bytes <= 0) {
+		bool disconnected =
+			read_bytes == 0 || is_disconnect_error(errno);
+		if (disconnected) {
+			syslog(LOG_ERR, "Device %s was disconnected",
+			       dev->name);
+		} else {
+			syslog(LOG_ERR, "Error reading from device %s: %m",
+			       dev->name);
+		}
+		invalidate_serial_dev(dev);
+		fail_sent_reqs(dev, disconnected ? -7 : -5);
+		send_pending_reqs(dev);
+		return;
+	}
+	syslog(LOG_DEBUG, "Read %zd bytes from device %s", read_bytes,
+	       dev->name);
+	dev->stats.bytes_read += (uint64_t)read_bytes;
+
+	char *frame;
+	size_t frame_len;
+	while (dev->fd.fd != -1 &&
+	       (frame = framer_next(&dev->rx, &frame_len)) != NULL) {
+		handle_frame(dev, frame, frame_len);
+	}
+	if (dev->fd.fd != -1 && framer_full(&dev->rx)) {
+		syslog(LOG_ERR, "Response from device %s is too long",
+		       dev->name);
+		record_frame(RECORD_TOO_LONG, dev->name, NULL, 0);
+		// The rest of the line still belongs to the first request.
+		framer_discard_frame(&dev->rx);
+		if (!list_empty(&dev->sent_reqs)) {
+			finish_req(list_first_entry(&dev->sent_reqs,
+						    struct serial_req, list),
+				   -6);
+		}
+	}
+	send_pending_reqs(dev);
+}
+
+void serial_format_pin_command(struct serial_req *req, uint32_t pin,
+			       bool turn_on)
+{
+	if (turn_on) {
+		sprintf(req->msg, "{\"action\":\"on\",\"pin\":%u}", pin);
 	} else {
-		syslog(LOG_DEBUG, "Read %zd bytes from device %s", read_bytes,
-		       device);
+		sprintf(req->msg, "{\"action\":\"off\",\"pin\":%u}", pin);
 	}
-	// read() does not append null terminator.
-	msg_buf[read_bytes] = '\0';
+	req->msg_len = strlen(req->msg);
+	req->pin_cmd = true;
+	req->pin = pin;
+	req->pin_on = turn_on;
+}
 
-	if (resp_len < (size_t)read_bytes) {
-		ret_val = -6;
-		goto cleanup;
+// Returns the last queued or in-flight pin command to the same pin as
+// req, NULL if there is none.
+static struct serial_req *find_last_pin_cmd(struct serial_dev *dev,
+					    const struct serial_req *req)
+{
+	// Earlier commands are merged, so at most one pending command sets
+	// the pin, unless commands that are not merged are queued as well.
+	// Those are returned, so that nothing is merged across them.
+	struct serial_req *other;
+	struct serial_req *found = NULL;
+	for (size_t i = 0; i < __SERIAL_PRIORITY_MAX; ++i) {
+		list_for_each_entry(other, &dev->pending_reqs[i], list) {
+			if (other->pin_cmd && other->pin == req->pin) {
+				if (other->no_coalesce) {
+					return other;
+				}
+				found = other;
+			}
+		}
+	}
+	if (found != NULL) {
+		return found;
+	}
+	list_for_each_entry_reverse(other, &dev->sent_reqs, list) {
+		if (other->pin_cmd && other->pin == req->pin) {
+			return other;
+		}
 	}
-	strcpy(response, msg_buf);
+	return NULL;
+}
 
-cleanup:
-	close(dev_fd);
-	return ret_val;
+// Merges the pin command into the commands queued to the device if that
+// does not change the final state of the pin.
+// Returns true if the request was merged.
+static bool coalesce_req(struct serial_dev *dev, struct serial_req *req)
+{
+	struct serial_req *last = find_last_pin_cmd(dev, req);
+	if (last == NULL || last->no_coalesce) {
+		return false;
+	}
+	if (last->pin_on == req->pin_on) {
+		// Sending the same command again would not change anything.
+		list_add_tail(&req->list, &last->followers);
+		dev->stats.merged += 1;
+		if (!last->sent && req->priority < last->priority) {
+			// Do not make the new request wait longer than it
+			// would on its own.
+			last->priority = req->priority;
+			list_move_tail(&last->list,
+				       &dev->pending_reqs[last->priority]);
+		}
+		return true;
+	}
+	if (last->sent) {
+		return false;
+	}
+	// Only the final state of the pin matters. The new command takes the
+	// place of the old one in the queue if they are of the same class,
+	// and the old one is completed together with it.
+	if (req->priority == last->priority) {
+		req->queued_us = last->queued_us;
+		list_add(&req->list, &last->list);
+	} else {
+		list_add_tail(&req->list, &dev->pending_reqs[req->priority]);
+	}
+	list_del(&last->list);
+	// Followers may have been superseded by last before. They are only
+	// counted once, but their response is now the one to req.
+	struct serial_req *other;
+	list_for_each_entry(other, &last->followers, list) {
+		if (!other->superseded) {
+			other->superseded = true;
+			dev->stats.superseded += 1;
+		}
+		other->final_on = req->pin_on;
+	}
+	last->superseded = true;
+	last->final_on = req->pin_on;
+	dev->stats.superseded += 1;
+	list_splice_tail_init(&last->followers, &req->followers);
+	list_add_tail(&last->list, &req->followers);
+	return true;
+}
+
+const char *serial_priority_name(enum serial_priority priority)
+{
+	return priority < __SERIAL_PRIORITY_MAX ? priority_names[priority] :
+						  "unknown";
+}
+
+bool serial_priority_from_name(const char *name,
+			       enum serial_priority *priority)
+{
+	for (size_t i = 0; i < ARRAY_SIZE(priority_names); ++i) {
+		if (strcmp(name, priority_names[i]) == 0) {
+			*priority = (enum serial_priority)i;
+			return true;
+		}
+	}
+	return false;
+}
+
+void serial_send(const char *device, struct serial_req *req)
+{
+	req->sent = false;
+	req->superseded = false;
+	req->queued_us = stats_now_us();
+	if (req->priority >= __SERIAL_PRIORITY_MAX) {
+		req->priority = SERIAL_PRIORITY_NORMAL;
+	}
+	INIT_LIST_HEAD(&req->followers);
+	if (closing) {
+		// Sent from the callback of a request aborted at shutdown.
+		req->dev = NULL;
+		req->cb(req, -7);
+		return;
+	}
+	req->dev = get_serial_dev(device);
+	if (req->dev == NULL) {
+		req->cb(req, -1);
+		return;
+	}
+	req->dev->stats.requests += 1;
+	struct list_head *queue = &req->dev->pending_reqs[req->priority];
+	if (req->dev->breaker_open) {
+		list_add_tail(&req->list, queue);
+		finish_req(req, -8);
+		return;
+	}
+	if (req->pin_cmd && !req->no_coalesce &&
+	    coalesce_req(req->dev, req)) {
+		return;
+	}
+	list_add_tail(&req->list, queue);
+	send_pending_reqs(req->dev);
+}
+
+enum pin_state serial_get_pin_state(const char *device, uint32_t pin)
+{
+	const struct serial_dev *dev = find_serial_dev(device);
+	if (dev == NULL || pin >= MAX_CACHED_PINS ||
+	    (dev->pins_known & (1U << pin)) == 0) {
+		return PIN_STATE_UNKNOWN;
+	}
+	return (dev->pins_on & (1U << pin)) != 0 ? PIN_STATE_ON :
+						   PIN_STATE_OFF;
+}
+
+enum pin_state serial_get_last_pin_state(const char *device, uint32_t pin)
+{
+	enum pin_state state = serial_get_pin_state(device, pin);
+	const struct serial_dev *dev = find_serial_dev(device);
+	if (state != PIN_STATE_UNKNOWN || dev == NULL ||
+	    pin >= MAX_CACHED_PINS || (dev->pins_restored & (1U << pin)) == 0) {
+		return state;
+	}
+	return (dev->pins_restored_on & (1U << pin)) != 0 ? PIN_STATE_ON :
+							    PIN_STATE_OFF;
+}
+
+void serial_set_pin_state(const char *device, uint32_t pin,
+			  enum pin_state state)
+{
+	struct serial_dev *dev = find_serial_dev(device);
+	if (dev == NULL || dev->fd.fd == -1 || pin >= MAX_CACHED_PINS) {
+		return;
+	}
+	uint32_t mask = 1U << pin;
+	// A command was sent, the state from before the restart is stale.
+	dev->pins_restored &= ~mask;
+	bool changed = (dev->pins_known & mask) == 0 ||
+		       ((dev->pins_on & mask) != 0) != (state == PIN_STATE_ON);
+	switch (state) {
+	case PIN_STATE_ON:
+		dev->pins_known |= mask;
+		dev->pins_on |= mask;
+		break;
+	case PIN_STATE_OFF:
+		dev->pins_known |= mask;
+		dev->pins_on &= ~mask;
+		break;
+	case PIN_STATE_UNKNOWN:
+	default:
+		dev->pins_known &= ~mask;
+		return;
+	}
+	if (changed) {
+		event_pin_changed(dev->name, pin, state == PIN_STATE_ON);
+	}
+}
+
+bool serial_is_busy(const char *device)
+{
+	const struct serial_dev *dev = find_serial_dev(device);
+	return dev != NULL && is_busy(dev);
+}
+
+// Sends a probe to every device in the registry that has been idle for
+// health_interval_ms, so that a dead device is noticed before a command
+// has to wait for the response timeout. Traffic of clients counts as
+// keepalive, busy devices are not probed.
+static void health_timer_cb(struct uloop_timeout *t)
+{
+	uint64_t now_us = stats_now_us();
+	uint64_t idle_us = (uint64_t)config.health_interval_ms * 1000;
+	const struct device *device;
+	avl_for_each_element(&devices, device, avl) {
+		struct serial_dev *dev = get_serial_dev(device->name);
+		if (dev == NULL || dev->breaker_open || is_busy(dev) ||
+		    now_us - dev->last_response_us < idle_us) {
+			continue;
+		}
+		// Requests written behind the probe wait for its response,
+		// so it times out sooner than other requests.
+		int timeout_ms = HEALTH_PROBE_TIMEOUT_MS;
+		if ((uint64_t)config.health_degraded_ms * 2 >
+		    (uint64_t)timeout_ms) {
+			timeout_ms = (int)(config.health_degraded_ms * 2);
+		}
+		if (timeout_ms > dev->timeout_ms) {
+			timeout_ms = dev->timeout_ms;
+		}
+		dev->health_probes += 1;
+		dev->health_req.timeout_ms = timeout_ms;
+		dev->health_req.queued_us = now_us;
+		list_add_tail(&dev->health_req.list,
+			      &dev->pending_reqs[SERIAL_PRIORITY_LOW]);
+		send_pending_reqs(dev);
+	}
+	uloop_timeout_set(t, (int)config.health_interval_ms);
+}
+
+void serial_apply_health_config(void)
+{
+	health_timer.cb = health_timer_cb;
+	if (config.health_interval_ms == 0) {
+		uloop_timeout_cancel(&health_timer);
+	} else if (!health_timer.pending) {
+		uloop_timeout_set(&health_timer,
+				  (int)config.health_interval_ms);
+	}
+	// The thresholds may have changed.
+	struct serial_dev *dev;
+	list_for_each_entry(dev, &serial_devs, list) {
+		report_health(dev);
+	}
+}
+
+const char *serial_health_name(enum device_health health)
+{
+	return health < __DEVICE_HEALTH_MAX ? health_names[health] :
+					      "unknown";
+}
+
+static void get_health(const struct serial_dev *dev,
+		       struct serial_health *health)
+{
+	*health = (struct serial_health){
+		.state = dev->health,
+		.srtt_us = dev->srtt_us,
+		.rttvar_us = dev->rttvar_us,
+		.last_rtt_us = dev->last_rtt_us,
+		.misses = dev->health_misses,
+		.probes = dev->health_probes,
+		.idle_ms = -1,
+	};
+	if (dev->last_response_us != 0) {
+		health->idle_ms = (int64_t)((stats_now_us() -
+					     dev->last_response_us) /
+					    1000);
+	}
+}
+
+bool serial_get_health(const char *device, struct serial_health *health)
+{
+	const struct serial_dev *dev = find_serial_dev(device);
+	if (dev == NULL) {
+		return false;
+	}
+	get_health(dev, health);
+	return true;
+}
+
+void serial_foreach_health(serial_health_cb cb, void *priv)
+{
+	struct serial_dev *dev;
+	list_for_each_entry(dev, &serial_devs, list) {
+		struct serial_health health;
+		get_health(dev, &health);
+		cb(dev->name, &health, priv);
+	}
+}
+
+void close_serial_devs(void)
+{
+	closing = true;
+	uloop_timeout_cancel(&health_timer);
+	struct serial_dev *dev, *tmp;
+	list_for_each_entry_safe(dev, tmp, &serial_devs, list) {
+		struct serial_req *req, *tmp_req;
+		fail_sent_reqs(dev, -7);
+		for (size_t i = 0; i < __SERIAL_PRIORITY_MAX; ++i) {
+			list_for_each_entry_safe(req, tmp_req,
+						 &dev->pending_reqs[i], list) {
+				finish_req(req, -7);
+			}
+		}
+		// The failed breaker probe schedules the next one.
+		uloop_timeout_cancel(&dev->check_timer);
+		invalidate_serial_dev(dev);
+		list_del(&dev->list);
+		free(dev->name);
+		free(dev);
+	}
+}
+
+void serial_reload_configs(void)
+{
+	struct serial_dev *dev;
+	list_for_each_entry(dev, &serial_devs, list) {
+		if (!read_device_config(dev)) {
+			continue;
+		}
+		if (dev->fd.fd == -1) {
+			apply_line_config(dev);
+			continue;
+		}
+		syslog(LOG_INFO,
+		       "Line settings of device %s changed, reconnecting",
+		       dev->name);
+		dev->reopen = true;
+		send_pending_reqs(dev);
+	}
+}
+
+struct device_stats *serial_req_stats(const struct serial_req *req)
+{
+	return req->dev != NULL ? &req->dev->stats : NULL;
+}
+
+// Counts the requests waiting to be sent, only done when the counters
+// are read.
+static struct device_stats *update_queue_stats(struct serial_dev *dev)
+{
+	for (size_t i = 0; i < __SERIAL_PRIORITY_MAX; ++i) {
+		uint32_t queued = 0;
+		struct list_head *p;
+		list_for_each(p, &dev->pending_reqs[i]) {
+			queued += 1;
+		}
+		dev->stats.queued[i] = queued;
+	}
+	return &dev->stats;
+}
+
+struct device_stats *serial_get_stats(const char *device)
+{
+	struct serial_dev *dev = find_serial_dev(device);
+	return dev != NULL ? update_queue_stats(dev) : NULL;
+}
+
+void serial_foreach_stats(serial_stats_cb cb, void *priv)
+{
+	struct serial_dev *dev;
+	list_for_each_entry(dev, &serial_devs, list) {
+		cb(dev->name, update_queue_stats(dev), priv);
+	}
+}
+
+void serial_foreach_state(serial_state_cb cb, void *priv)
+{
+	struct serial_dev *dev;
+	list_for_each_entry(dev, &serial_devs, list) {
+		// Restored states are kept until the device confirms or
+		// changes them, also across further restarts.
+		uint32_t restored = dev->pins_restored & ~dev->pins_known;
+		struct serial_dev_state state = {
+			.pins_known = dev->pins_known | restored,
+			.pins_on = (dev->pins_on & dev->pins_known) |
+				   (dev->pins_restored_on & restored),
+			.config_baudrate = dev->config_baudrate,
+			.config_probe = dev->config_probe,
+			.breaker_open = dev->breaker_open,
+			.consecutive_timeouts = dev->consecutive_timeouts,
+		};
+		if (dev->config_probe && !dev->probe_baudrate) {
+			state.probed_baudrate = dev->baudrate;
+		}
+		struct serial_req *req;
+		list_for_each_entry(req, &dev->sent_reqs, list) {
+			if (req->pin_cmd && req->pin < MAX_CACHED_PINS) {
+				state.pins_known &= ~(1U << req->pin);
+			}
+		}
+		state.stats = *update_queue_stats(dev);
+		cb(dev->name, &state, priv);
+	}
+}
+
+bool serial_restore_state(const char *device,
+			  const struct serial_dev_state *state)
+{
+	struct serial_dev *dev = get_serial_dev(device);
+	if (dev == NULL) {
+		return false;
+	}
+	// Opening the port may reset the board, so the states are not
+	// trusted until the device confirms them.
+	dev->pins_restored = state->pins_known;
+	dev->pins_restored_on = state->pins_on & state->pins_known;
+	dev->stats = state->stats;
+	memset(dev->stats.queued, 0, sizeof(dev->stats.queued));
+	if (state->probed_baudrate != 0 && dev->config_probe &&
+	    state->config_probe &&
+	    state->config_baudrate == dev->config_baudrate &&
+	    serial_baudrate_supported(state->probed_baudrate)) {
+		dev->baudrate = state->probed_baudrate;
+		dev->probe_baudrate = false;
+	}
+	dev->consecutive_timeouts = state->consecutive_timeouts;
+	if (state->breaker_open && config.breaker_threshold != 0) {
+		// Requests are rejected until the device responds to the
+		// probe, as before the restart.
+		dev->breaker_open = true;
+		uloop_timeout_set(&dev->check_timer,
+				  (int)config.breaker_probe_ms);
+	}
+	return true;
 }
@@ -5,24 +5,265 @@
 #include <stdlib.h>
 #include <stdint.h>
 
-// Gets ABESP 8266V3 device file names.
-// devices - array to put device names in
-// max_devices - array size
-// num_devices - actual number of devices found
-// returns true on success, false on failure
-bool get_devices(char *devices[], unsigned int *num_devices,
-		 const unsigned int max_devices);
-
-// Returns:
+#include <libubox/list.h>
+
+#include "stats.h"
+
+// Maximum length of messages sent to and received from devices.
+#define MSG_MAXLEN 50
+// Pins with numbers below this have their states cached.
+#define MAX_CACHED_PINS 32
+
+// State of a pin as last confirmed by the device.
+enum pin_state { PIN_STATE_UNKNOWN = -1, PIN_STATE_OFF, PIN_STATE_ON };
+
+// Scheduling classes of requests, most urgent first.
+enum serial_priority {
+	// Interactive commands, e.g. from a web UI.
+	SERIAL_PRIORITY_HIGH,
+	SERIAL_PRIORITY_NORMAL,
+	// Bulk traffic that may wait, e.g. automation sweeps.
+	SERIAL_PRIORITY_LOW,
+	__SERIAL_PRIORITY_MAX
+};
+
+// Health of a device, judged from the responses to commands and to the
+// keepalive probes of the health monitor (option health_interval_ms).
+enum device_health {
+	// The device has not responded yet.
+	DEVICE_HEALTH_UNKNOWN,
+	DEVICE_HEALTH_HEALTHY,
+	// The last exchange got no response, or the round trip time
+	// estimate is above health_degraded_ms.
+	DEVICE_HEALTH_DEGRADED,
+	// health_dead_after exchanges in a row got no response.
+	DEVICE_HEALTH_DEAD,
+	__DEVICE_HEALTH_MAX
+};
+
+// Health of a device and what it is based on.
+struct serial_health {
+	enum device_health state;
+	// Smoothed round trip time and its mean deviation, computed like
+	// the SRTT and RTTVAR of TCP (RFC 6298). 0 if not measured yet.
+	uint32_t srtt_us;
+	uint32_t rttvar_us;
+	// Last round trip time measured.
+	uint32_t last_rtt_us;
+	// Exchanges in a row without response.
+	uint32_t misses;
+	// Keepalive probes sent.
+	uint64_t probes;
+	// Time since the last response, -1 if the device never responded.
+	int64_t idle_ms;
+};
+
+struct serial_dev;
+struct serial_req;
+
+// Called when the request is completed. status is one of the status
+// codes documented at serial_send().
+typedef void (*serial_req_cb)(struct serial_req *req, int status);
+
+// Message to send to a device. Must stay valid until cb is called.
+struct serial_req {
+	// Message to send and its length.
+	char msg[MSG_MAXLEN];
+	size_t msg_len;
+	// Null-terminated response from the device without the line
+	// terminator, and its length. Points into the receive buffer, so it
+	// is valid only during the call to cb and only if status is 0.
+	char *response;
+	size_t response_len;
+	serial_req_cb cb;
+	// Allow writing the message before the responses to earlier
+	// pipelined requests to the same device are received.
+	bool pipeline;
+	// How long to wait for the response, 0 for the default of the
+	// device.
+	int timeout_ms;
+	enum serial_priority priority;
+	// Set when cb is called if the pin command was replaced by a later
+	// command to the same pin before it was sent. status and response
+	// are then those of the last command in the chain of replacements,
+	// which set the pin to final_on.
+	bool superseded;
+	bool final_on;
+	// Send the pin command even if commands to the same pin are queued,
+	// and keep later commands to the pin from being merged with earlier
+	// ones. For streams of toggles where every change matters.
+	bool no_coalesce;
+
+	// Used internally by the serial module.
+	struct list_head list;
+	struct serial_dev *dev;
+	size_t written;
+	bool sent;
+	// Start of the current phase of the request, for statistics.
+	uint64_t phase_start_us;
+	// When the request was queued.
+	uint64_t queued_us;
+	// Set by serial_format_pin_command().
+	bool pin_cmd;
+	uint32_t pin;
+	bool pin_on;
+	// Requests completed together with this one.
+	struct list_head followers;
+};
+
+// State of a device that is kept across restarts, see snapshot.h.
+struct serial_dev_state {
+	// Cached pin states, see serial_get_pin_state().
+	uint32_t pins_known;
+	uint32_t pins_on;
+	// Baud rate found by probing, 0 if the device was not probed.
+	uint32_t probed_baudrate;
+	// Line settings of the configuration the baud rate was probed with.
+	uint32_t config_baudrate;
+	uint8_t config_probe;
+	uint8_t breaker_open;
+	uint32_t consecutive_timeouts;
+	struct device_stats stats;
+};
+
+// Queues req->msg to be sent to the device and waits for a single
+// response without blocking the event loop. req->cb is called with the
+// result once the response is received, possibly before this function
+// returns. Requests to the same device are sent one at a time unless
+// consecutive requests set pipeline. Requests to different devices run
+// concurrently.
+// Requests of the same priority class are sent in the order they were
+// queued. Requests of a more urgent class are sent before requests of
+// less urgent classes that were queued earlier, except that requests
+// waiting for longer than half a second are sent first regardless of
+// their class, so that bulk traffic is not starved.
+// Pin commands made by serial_format_pin_command() are coalesced with
+// queued commands to the same pin: a command that is the same as the
+// last queued or in-flight command to the pin shares its transaction and
+// result, and a command that sets the opposite state replaces the last
+// command if it was not sent yet (see superseded), unless no_coalesce is
+// set.
+// The connection to the device is opened on first use and kept open
+// (and locked) until close_serial_devs() is called or the device is
+// disconnected. The connection uses the baud rate configured for the
+// device, or the highest rate the device responds at if probing is
+// enabled.
+// Status codes:
 // 0 on success
 // -1 if failed to open device file
 // -2 if failed to lock the device for exclusive access
 // -3 if failed to configure serial connection
 // -4 if writing to device fails
-// -5 if reading from device fails
-// -6 if the response buffer is too small
+// -5 if reading from device fails or the device did not respond in time
+// -6 if the response does not fit into the receive buffer
 // -7 if device was disconnected
-int send_msg(const char *device, const char *msg, const size_t msg_len,
-	     char *response, size_t resp_len);
+// -8 if the request was rejected because the device stopped responding.
+//    Requests are rejected after breaker_threshold requests in a row got
+//    no response (-5 or -7), until the device responds to a probe.
+void serial_send(const char *device, struct serial_req *req);
+
+// Writes the command to turn the pin on or off to req->msg and marks the
+// request as a pin command that can be coalesced.
+void serial_format_pin_command(struct serial_req *req, uint32_t pin,
+			       bool turn_on);
+
+// Returns the name of the priority class, e.g. "high".
+const char *serial_priority_name(enum serial_priority priority);
+
+// Looks up the priority class by name.
+// Returns false if there is no class with the name.
+bool serial_priority_from_name(const char *name,
+			       enum serial_priority *priority);
+
+// Returns true if the baud rate can be used for device connections.
+bool serial_baudrate_supported(unsigned int rate);
+
+// Returns the cached state of the pin. States are only known for pins
+// that were set since the connection to the device was opened, and are
+// forgotten when the connection is closed or the device sends
+// unexpected data (e.g. boot messages after a reset). States restored
+// from the snapshot are not returned, see serial_get_last_pin_state().
+enum pin_state serial_get_pin_state(const char *device, uint32_t pin);
+
+// Returns the cached state of the pin if it is known, otherwise the
+// state restored from the snapshot if the pin was not set since the
+// restart. The restored state was not confirmed by the device, which
+// may have been reset in the meantime, so it must not be used to skip
+// commands.
+enum pin_state serial_get_last_pin_state(const char *device, uint32_t pin);
+
+// Records the state of the pin confirmed by the device and publishes a
+// pin.changed event if it differs from the cached state or the cached
+// state is unknown. Does nothing if the connection to the device is not
+// open.
+void serial_set_pin_state(const char *device, uint32_t pin,
+			  enum pin_state state);
+
+// Returns true if there are requests queued or in flight to the device.
+bool serial_is_busy(const char *device);
+
+// Applies changed device settings to the devices requests were sent to.
+// Response timeouts apply to requests sent from now on. If the baud rate
+// settings changed, the connection is reopened with the new settings
+// once the requests in flight are completed.
+void serial_reload_configs(void);
+
+// Starts or stops the health monitor according to the configuration.
+// While health_interval_ms is set, every device in the registry that got
+// no traffic for that long is sent a harmless probe, and a device that
+// is found dead is handled like one that tripped the breaker: requests
+// are rejected with -8 until it responds again. Probes are only sent to
+// idle devices and do not hold back commands queued after them.
+void serial_apply_health_config(void);
+
+// Returns the name of the health state, e.g. "degraded".
+const char *serial_health_name(enum device_health health);
+
+// Returns false if no requests were sent to the device.
+bool serial_get_health(const char *device, struct serial_health *health);
+
+typedef void (*serial_health_cb)(const char *device,
+				 const struct serial_health *health,
+				 void *priv);
+
+// Calls cb with the health of every device requests were sent to.
+void serial_foreach_health(serial_health_cb cb, void *priv);
+
+// Closes all open device connections. Requests that are still in
+// progress, and requests sent from their callbacks, are completed with
+// status -7 without counting toward the breaker or the device health.
+void close_serial_devs(void);
+
+// Returns the counters of the device the request was queued to, NULL if
+// the request could not be queued. Valid during the call to req->cb.
+struct device_stats *serial_req_stats(const struct serial_req *req);
+
+// Returns the counters of the device, NULL if no requests were sent to
+// it.
+struct device_stats *serial_get_stats(const char *device);
+
+typedef void (*serial_stats_cb)(const char *device,
+				struct device_stats *stats, void *priv);
+
+// Calls cb with the counters of every device requests were sent to.
+void serial_foreach_stats(serial_stats_cb cb, void *priv);
+
+typedef void (*serial_state_cb)(const char *device,
+				const struct serial_dev_state *state,
+				void *priv);
+
+// Calls cb with the state of every device requests were sent to. Pins
+// with a command in flight are reported as unknown, as the command may
+// or may not take effect. Restored states that were not confirmed yet
+// are reported for pins with unknown state.
+void serial_foreach_state(serial_state_cb cb, void *priv);
+
+// Restores the state of the device saved by an earlier process. The
+// probed baud rate is only used if the line settings of the device did
+// not change since. Must be called before requests are sent to the
+// device.
+// Returns false on memory allocation failure.
+bool serial_restore_state(const char *device,
+			  const struct serial_dev_state *state);
 
 #endif
@@ -0,0 +1,327 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <errno.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <libubox/uloop.h>
+
+#include "snapshot.h"
+#include "args.h"
+#include "devices.h"
+#include "serial.h"
+
+#define SNAPSHOT_MAGIC "DEVCTLS1"
+// Increase when the layout of the entries changes in a way that keeps
+// their size.
+#define SNAPSHOT_VERSION 1
+#define SNAPSHOT_NAME_LEN 64
+#define SNAPSHOT_INTERVAL_MS 1000
+
+struct snapshot_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t entry_size;
+	uint32_t num_entries;
+	// FNV-1a hash of the entries.
+	uint32_t checksum;
+};
+
+struct snapshot_entry {
+	// Device file name.
+	char device[SNAPSHOT_NAME_LEN];
+	// USB serial number, empty if the device does not report one.
+	char id[SNAPSHOT_NAME_LEN];
+	struct serial_dev_state state;
+};
+
+// Entries follow the header and contain 64-bit counters.
+_Static_assert(sizeof(struct snapshot_header) % 8 == 0,
+	       "Entries after the header must be aligned");
+
+// The snapshot being built and the one last written, swapped after every
+// write. Both grow to the size of the largest snapshot and are reused.
+struct snapshot_buf {
+	char *data;
+	size_t len;
+	size_t capacity;
+};
+
+static struct snapshot_buf bufs[2];
+static struct snapshot_buf *building = &bufs[0];
+static struct snapshot_buf *written = &bufs[1];
+// File the last snapshot was written to, so that a reload that changes
+// state_file writes the unchanged state to the new file.
+static char written_path[PATH_MAX];
+static struct uloop_timeout snapshot_timer;
+// Failures are logged once until writing succeeds again.
+static bool write_failed;
+
+static uint32_t fnv1a(const void *data, size_t len)
+{
+	const unsigned char *p = data;
+	uint32_t hash = 2166136261U;
+	for (size_t i = 0; i < len; ++i) {
+		hash ^= p[i];
+		hash *= 16777619U;
+	}
+	return hash;
+}
+
+// Returns the file name of the device the entry belongs to, NULL if the
+// device is not connected or another board has its file name now.
+static const char *find_entry_device(const struct snapshot_entry *e)
+{
+	const struct device *dev =
+		avl_find_element(&devices, e->device, dev, avl);
+	if (e->id[0] == '\0') {
+		return dev != NULL && dev->id == NULL ? dev->name : NULL;
+	}
+	if (dev != NULL && dev->id != NULL && strcmp(dev->id, e->id) == 0) {
+		return dev->name;
+	}
+	// The board may have got another file name when it was replugged.
+	avl_for_each_element(&devices, dev, avl) {
+		if (dev->id != NULL && strcmp(dev->id, e->id) == 0) {
+			return dev->name;
+		}
+	}
+	return NULL;
+}
+
+// Checks the mapped snapshot and restores the entries.
+static void restore_snapshot(const char *path, const char *data,
+			     size_t size)
+{
+	const struct snapshot_header *header = (const void *)data;
+	if (size < sizeof(*header) ||
+	    memcmp(header->magic, SNAPSHOT_MAGIC, sizeof(header->magic)) !=
+		    0 ||
+	    header->version != SNAPSHOT_VERSION ||
+	    header->entry_size != sizeof(struct snapshot_entry)) {
+		syslog(LOG_NOTICE,
+		       "Ignoring snapshot %s written by another version", path);
+		return;
+	}
+	const struct snapshot_entry *entries =
+		(const void *)(data + sizeof(*header));
+	size_t len = (size_t)header->num_entries * sizeof(*entries);
+	if (size - sizeof(*header) != len ||
+	    fnv1a(entries, len) != header->checksum) {
+		syslog(LOG_WARNING, "Ignoring corrupt snapshot %s", path);
+		return;
+	}
+
+	unsigned int restored = 0;
+	for (uint32_t i = 0; i < header->num_entries; ++i) {
+		const struct snapshot_entry *e = &entries[i];
+		if (memchr(e->device, '\0', sizeof(e->device)) == NULL ||
+		    memchr(e->id, '\0', sizeof(e->id)) == NULL) {
+			continue;
+		}
+		const char *device = find_entry_device(e);
+		if (device == NULL) {
+			syslog(LOG_DEBUG,
+			       "Device %s from the snapshot is not connected",
+			       e->device);
+			continue;
+		}
+		if (serial_restore_state(device, &e->state)) {
+			restored += 1;
+		}
+	}
+	syslog(LOG_INFO, "Restored the state of %u devices from %s",
+	       restored, path);
+}
+
+static void load_snapshot(const char *path)
+{
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd == -1) {
+		if (errno != ENOENT) {
+			syslog(LOG_WARNING, "Failed to open snapshot %s: %m",
+			       path);
+		}
+		return;
+	}
+	struct stat st;
+	if (fstat(fd, &st) != 0 || st.st_size <= 0) {
+		close(fd);
+		return;
+	}
+	size_t size = (size_t)st.st_size;
+	void *data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (data == MAP_FAILED) {
+		syslog(LOG_WARNING, "Failed to map snapshot %s: %m", path);
+		return;
+	}
+	restore_snapshot(path, data, size);
+	munmap(data, size);
+}
+
+static bool reserve(struct snapshot_buf *buf, size_t len)
+{
+	if (len <= buf->capacity) {
+		return true;
+	}
+	size_t capacity = buf->capacity != 0 ? buf->capacity : 4096;
+	while (capacity < len) {
+		capacity *= 2;
+	}
+	char *data = realloc(buf->data, capacity);
+	if (data == NULL) {
+		syslog(LOG_ERR, "Failed to allocate memory for snapshot");
+		return false;
+	}
+	buf->data = data;
+	buf->capacity = capacity;
+	return true;
+}
+
+static void add_entry(const char *device,
+		      const struct serial_dev_state *state, void *priv)
+{
+	bool *ok = priv;
+	const struct device *dev =
+		avl_find_element(&devices, device, dev, avl);
+	// Only connected devices are restored.
+	if (!*ok || dev == NULL || strlen(device) >= SNAPSHOT_NAME_LEN ||
+	    (dev->id != NULL && strlen(dev->id) >= SNAPSHOT_NAME_LEN)) {
+		return;
+	}
+	if (!reserve(building, building->len + sizeof(struct snapshot_entry))) {
+		*ok = false;
+		return;
+	}
+	struct snapshot_entry *e =
+		(struct snapshot_entry *)(building->data + building->len);
+	// Zeroes the padding too, so that unchanged state compares equal.
+	memset(e, 0, sizeof(*e));
+	strcpy(e->device, device);
+	if (dev->id != NULL) {
+		strcpy(e->id, dev->id);
+	}
+	e->state = *state;
+	building->len += sizeof(*e);
+}
+
+// Writes the data to a temporary file and renames it over the snapshot,
+// so that a crash never leaves a partial snapshot behind.
+static bool write_file(const char *path, const char *data, size_t len)
+{
+	char tmp_path[PATH_MAX];
+	if (snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path) >=
+	    (int)sizeof(tmp_path)) {
+		errno = ENAMETOOLONG;
+		return false;
+	}
+	int fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+		      0600);
+	if (fd == -1 && errno == ENOENT) {
+		// /var/run is empty after boot.
+		char *slash = strrchr(tmp_path, '/');
+		if (slash != NULL && slash != tmp_path) {
+			*slash = '\0';
+			mkdir(tmp_path, 0700);
+			*slash = '/';
+			fd = open(tmp_path,
+				  O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+				  0600);
+		}
+	}
+	if (fd == -1) {
+		return false;
+	}
+	ssize_t ret = write(fd, data, len);
+	int err = ret == -1 ? errno : ENOSPC;
+	if (ret == (ssize_t)len) {
+		if (close(fd) == 0 && rename(tmp_path, path) == 0) {
+			return true;
+		}
+		err = errno;
+	} else {
+		close(fd);
+	}
+	unlink(tmp_path);
+	errno = err;
+	return false;
+}
+
+// Writes the snapshot if the state changed since the last write.
+static void write_snapshot(void)
+{
+	const char *path = config.state_file;
+	if (path == NULL) {
+		return;
+	}
+	struct snapshot_header header = { .version = SNAPSHOT_VERSION,
+					  .entry_size = sizeof(
+						  struct snapshot_entry) };
+	memcpy(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic));
+	building->len = 0;
+	bool ok = reserve(building, sizeof(header));
+	if (ok) {
+		building->len = sizeof(header);
+		serial_foreach_state(add_entry, &ok);
+	}
+	if (!ok) {
+		return;
+	}
+	size_t entries_len = building->len - sizeof(header);
+	header.num_entries =
+		(uint32_t)(entries_len / sizeof(struct snapshot_entry));
+	header.checksum = fnv1a(building->data + sizeof(header), entries_len);
+	memcpy(building->data, &header, sizeof(header));
+
+	if (strcmp(path, written_path) == 0 &&
+	    building->len == written->len &&
+	    memcmp(building->data, written->data, written->len) == 0) {
+		return;
+	}
+	if (!write_file(path, building->data, building->len)) {
+		if (!write_failed) {
+			syslog(LOG_ERR, "Failed to write snapshot %s: %m",
+			       path);
+			write_failed = true;
+		}
+		return;
+	}
+	write_failed = false;
+	snprintf(written_path, sizeof(written_path), "%s", path);
+	struct snapshot_buf *tmp = written;
+	written = building;
+	building = tmp;
+}
+
+static void snapshot_timer_cb(struct uloop_timeout *t)
+{
+	write_snapshot();
+	uloop_timeout_set(t, SNAPSHOT_INTERVAL_MS);
+}
+
+void snapshot_init(void)
+{
+	if (config.state_file != NULL) {
+		load_snapshot(config.state_file);
+	}
+	// Keeps running if the snapshot is disabled, so that enabling it
+	// with a reload takes effect.
+	snapshot_timer.cb = snapshot_timer_cb;
+	uloop_timeout_set(&snapshot_timer, SNAPSHOT_INTERVAL_MS);
+}
+
+void snapshot_free(void)
+{
+	uloop_timeout_cancel(&snapshot_timer);
+	write_snapshot();
+	for (size_t i = 0; i < 2; ++i) {
+		free(bufs[i].data);
+		bufs[i] = (struct snapshot_buf){ 0 };
+	}
+}
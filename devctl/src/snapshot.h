@@ -0,0 +1,26 @@
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+// Snapshot of the state of the devices (cached pin states, probed baud
+// rates, breaker state and counters, see struct serial_dev_state), kept
+// in a file on tmpfs so that a restarted devctl does not have to learn
+// it again through serial traffic. The file is rewritten at most once a
+// second while the state changes, and once more at exit.
+//
+// The file holds a fixed header followed by fixed size entries in the
+// native byte order, so it is loaded by mapping it. It is only valid for
+// the build that wrote it; a snapshot with a different version or entry
+// size, e.g. after an upgrade changed the layout, is ignored.
+
+// Loads the snapshot from config.state_file, if there is one, and starts
+// writing it periodically. Devices are matched by their USB serial number
+// where they have one, so the state follows a board that was replugged.
+// Entries of devices that are not connected are dropped. Must be called
+// after the initial device scan and before requests are sent.
+void snapshot_init(void);
+
+// Writes the snapshot a last time and stops writing it. Must be called
+// before close_serial_devs(), which forgets the pin states.
+void snapshot_free(void);
+
+#endif
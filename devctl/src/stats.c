@@ -0,0 +1,57 @@
+#include <string.h>
+#include <time.h>
+
+#include "stats.h"
+
+uint64_t stats_now_us(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + (uint64_t)ts.tv_nsec / 1000;
+}
+
+uint64_t stats_record_latency(struct latency_hist *hist, uint64_t start_us)
+{
+	uint64_t now = stats_now_us();
+	uint64_t latency = now > start_us ? now - start_us : 0;
+	// Index of the highest set bit, that is floor(log2(latency)).
+	unsigned int bucket =
+		latency != 0 ? 63 - (unsigned int)__builtin_clzll(latency) : 0;
+	if (bucket >= LATENCY_BUCKETS) {
+		bucket = LATENCY_BUCKETS - 1;
+	}
+	hist->buckets[bucket] += 1;
+	hist->count += 1;
+	hist->total_us += latency;
+	if (latency > hist->max_us) {
+		hist->max_us = latency > UINT32_MAX ? UINT32_MAX :
+						      (uint32_t)latency;
+	}
+	return now;
+}
+
+void stats_record_send_error(struct device_stats *stats, int status)
+{
+	if (status < 0 && status >= -STATS_NUM_SEND_ERRORS) {
+		stats->send_errors[-status - 1] += 1;
+	}
+}
+
+// Names of serial_send() failures, by -status - 1.
+static const char *const send_error_names[STATS_NUM_SEND_ERRORS] = {
+	"open", "lock", "configure", "write", "no_response", "too_long",
+	"disconnected", "rejected"
+};
+
+const char *stats_send_error_name(int status)
+{
+	if (status < 0 && status >= -STATS_NUM_SEND_ERRORS) {
+		return send_error_names[-status - 1];
+	}
+	return "unknown";
+}
+
+void stats_reset(struct device_stats *stats)
+{
+	memset(stats, 0, sizeof(*stats));
+}
@@ -0,0 +1,82 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <stdint.h>
+
+// Number of latency histogram buckets. Bucket i counts latencies of
+// [2^i, 2^(i+1)) microseconds, bucket 0 also counts 0 and the last one
+// counts everything longer.
+#define LATENCY_BUCKETS 24
+// Number of devctl status codes reported over ubus.
+#define STATS_NUM_STATUSES 10
+// Number of serial_send() failure status codes (-1 ... -8).
+#define STATS_NUM_SEND_ERRORS 8
+// Number of request priority classes.
+#define STATS_NUM_PRIORITIES 3
+
+// Phases of a request to a device.
+enum latency_phase {
+	// Opening, locking and configuring the connection.
+	PHASE_OPEN,
+	// Writing the message.
+	PHASE_WRITE,
+	// Waiting for the response after the message was written.
+	PHASE_WAIT,
+	__PHASE_MAX
+};
+
+struct latency_hist {
+	uint32_t buckets[LATENCY_BUCKETS];
+	uint32_t count;
+	uint32_t max_us;
+	uint64_t total_us;
+};
+
+// Counters of a single device. Kept for the lifetime of the process,
+// until reset over ubus.
+struct device_stats {
+	// Requests queued to the device.
+	uint32_t requests;
+	// Replies by devctl status code.
+	uint32_t statuses[STATS_NUM_STATUSES];
+	// Failed requests by serial_send() status code, index is -status - 1.
+	uint32_t send_errors[STATS_NUM_SEND_ERRORS];
+	// Pin commands that shared the transaction of an identical queued
+	// command.
+	uint32_t merged;
+	// Pin commands that were replaced by a later command to the same pin
+	// before they were sent.
+	uint32_t superseded;
+	// Commands resent because the response could not be parsed.
+	uint32_t retries;
+	// Times requests started being rejected because the device stopped
+	// responding.
+	uint32_t breaker_trips;
+	uint64_t bytes_written;
+	uint64_t bytes_read;
+	struct latency_hist latency[__PHASE_MAX];
+	// Requests waiting to be sent by priority class. Updated when the
+	// counters are read.
+	uint32_t queued[STATS_NUM_PRIORITIES];
+	// Time requests waited to be sent by priority class.
+	struct latency_hist queue_wait[STATS_NUM_PRIORITIES];
+};
+
+// Returns CLOCK_MONOTONIC time in microseconds.
+uint64_t stats_now_us(void);
+
+// Adds the time from start_us until now to the histogram.
+// Returns the current time, so that the next phase can start from it.
+uint64_t stats_record_latency(struct latency_hist *hist, uint64_t start_us);
+
+// Counts a failed serial_send() request. status is a negative
+// serial_send() status code.
+void stats_record_send_error(struct device_stats *stats, int status);
+
+void stats_reset(struct device_stats *stats);
+
+// Returns a short name of the serial_send() failure status code, e.g.
+// "no_response" for -5.
+const char *stats_send_error_name(int status);
+
+#endif
@@ -0,0 +1,208 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+
+#include <libubox/list.h>
+#include <libubox/utils.h>
+
+#include "stream.h"
+#include "events.h"
+#include "response.h"
+
+// Command of a stream, waiting to be sent or acknowledged.
+struct stream_slot {
+	struct device_stream *stream;
+	struct serial_req sreq;
+	uint32_t seq;
+	uint32_t pin;
+	bool state;
+	bool busy;
+};
+
+// Stream of a single device. The commands in flight are kept in a ring
+// of STREAM_WINDOW slots indexed by sequence number, so streaming does
+// not allocate once the device has a stream.
+struct device_stream {
+	struct list_head list;
+	// Device file name.
+	char *device;
+	struct stream_slot slots[STREAM_WINDOW];
+	// Sequence number of the next command, starts at 1.
+	uint32_t next_seq;
+	// Oldest command that was not reconciled, next_seq if all were.
+	// Acknowledgements of different priority classes can arrive out of
+	// order, the window only moves past commands that are completed.
+	uint32_t base_seq;
+	uint32_t acked;
+	uint32_t failed;
+	uint32_t dropped;
+	// Ring of the most recent errors.
+	struct stream_error errors[STREAM_ERRORS];
+	uint32_t num_errors;
+};
+
+static LIST_HEAD(streams);
+// Set by stream_free(), completions are ignored.
+static bool stopping;
+
+static struct device_stream *find_stream(const char *dev_id)
+{
+	struct device_stream *stream;
+	list_for_each_entry(stream, &streams, list) {
+		if (strcmp(stream->device, dev_id) == 0) {
+			return stream;
+		}
+	}
+	return NULL;
+}
+
+static void add_error(struct device_stream *stream,
+		      const struct stream_slot *slot, const char *error)
+{
+	struct stream_error *err =
+		&stream->errors[stream->num_errors % STREAM_ERRORS];
+	stream->num_errors += 1;
+	err->seq = slot->seq;
+	err->pin = slot->pin;
+	err->state = slot->state;
+	snprintf(err->error, sizeof(err->error), "%s", error);
+	syslog(LOG_WARNING, "Stream command %u to pin %u of %s failed: %s",
+	       slot->seq, slot->pin, stream->device, error);
+	event_stream_error(stream->device, slot->seq, slot->pin, slot->state,
+			   error);
+}
+
+// Checks the acknowledgement against the command in the slot.
+static void stream_cb(struct serial_req *sreq, int status)
+{
+	struct stream_slot *slot =
+		container_of(sreq, struct stream_slot, sreq);
+	struct device_stream *stream = slot->stream;
+	slot->busy = false;
+	if (stopping) {
+		return;
+	}
+
+	if (status != 0) {
+		stream->dropped += 1;
+		serial_set_pin_state(stream->device, slot->pin,
+				     PIN_STATE_UNKNOWN);
+		add_error(stream, slot, stats_send_error_name(status));
+	} else {
+		char error_buf[MSG_MAXLEN];
+		int ret = parse_device_response(sreq->response,
+						sreq->response_len,
+						slot->state, error_buf,
+						sizeof(error_buf));
+		if (ret == 0) {
+			stream->acked += 1;
+			serial_set_pin_state(stream->device, slot->pin,
+					     slot->state ? PIN_STATE_ON :
+							   PIN_STATE_OFF);
+		} else {
+			stream->failed += 1;
+			serial_set_pin_state(stream->device, slot->pin,
+					     PIN_STATE_UNKNOWN);
+			// Anything but an error reported by the firmware
+			// means that the response does not belong to this
+			// command, e.g. it was garbled or got lost.
+			add_error(stream, slot,
+				  ret == 1 ? error_buf :
+					     "unexpected acknowledgement");
+		}
+	}
+
+	while (stream->base_seq != stream->next_seq &&
+	       !stream->slots[stream->base_seq % STREAM_WINDOW].busy) {
+		stream->base_seq += 1;
+	}
+}
+
+int stream_send(const char *dev_id, uint32_t pin, bool state,
+		enum serial_priority priority, uint32_t *seq)
+{
+	struct device_stream *stream = find_stream(dev_id);
+	if (stream == NULL) {
+		stream = calloc(1, sizeof(*stream));
+		if (stream == NULL) {
+			syslog(LOG_ERR, "Failed to allocate memory for stream");
+			return -2;
+		}
+		stream->device = strdup(dev_id);
+		if (stream->device == NULL) {
+			syslog(LOG_ERR, "Failed to allocate memory for stream");
+			free(stream);
+			return -2;
+		}
+		stream->next_seq = 1;
+		stream->base_seq = 1;
+		list_add_tail(&stream->list, &streams);
+	}
+	if (stream->next_seq - stream->base_seq >= STREAM_WINDOW) {
+		return -1;
+	}
+
+	struct stream_slot *slot =
+		&stream->slots[stream->next_seq % STREAM_WINDOW];
+	memset(slot, 0, sizeof(*slot));
+	slot->stream = stream;
+	slot->seq = stream->next_seq++;
+	slot->pin = pin;
+	slot->state = state;
+	slot->busy = true;
+	slot->sreq.cb = stream_cb;
+	slot->sreq.priority = priority;
+	slot->sreq.pipeline = true;
+	serial_format_pin_command(&slot->sreq, pin, state);
+	slot->sreq.no_coalesce = true;
+	*seq = slot->seq;
+	serial_send(stream->device, &slot->sreq);
+	return 0;
+}
+
+bool stream_get_info(const char *dev_id, struct stream_info *info)
+{
+	const struct device_stream *stream = find_stream(dev_id);
+	if (stream == NULL) {
+		return false;
+	}
+	info->last_seq = stream->next_seq - 1;
+	info->reconciled_seq = stream->base_seq - 1;
+	info->in_flight = 0;
+	for (size_t i = 0; i < STREAM_WINDOW; ++i) {
+		if (stream->slots[i].busy) {
+			info->in_flight += 1;
+		}
+	}
+	info->acked = stream->acked;
+	info->failed = stream->failed;
+	info->dropped = stream->dropped;
+	return true;
+}
+
+void stream_foreach_error(const char *dev_id, stream_error_cb cb,
+			  void *priv)
+{
+	const struct device_stream *stream = find_stream(dev_id);
+	if (stream == NULL) {
+		return;
+	}
+	uint32_t first = stream->num_errors > STREAM_ERRORS ?
+				 stream->num_errors - STREAM_ERRORS :
+				 0;
+	for (uint32_t i = first; i < stream->num_errors; ++i) {
+		cb(&stream->errors[i % STREAM_ERRORS], priv);
+	}
+}
+
+void stream_free(void)
+{
+	stopping = true;
+	struct device_stream *stream, *tmp;
+	list_for_each_entry_safe(stream, tmp, &streams, list) {
+		list_del(&stream->list);
+		free(stream->device);
+		free(stream);
+	}
+}
@@ -0,0 +1,68 @@
+#ifndef STREAM_H
+#define STREAM_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "serial.h"
+
+// Number of stream commands per device that can be queued or waiting
+// for their acknowledgement at the same time.
+#define STREAM_WINDOW 32
+// Number of recent errors kept per device.
+#define STREAM_ERRORS 16
+
+// Stream command that was not acknowledged as expected.
+struct stream_error {
+	uint32_t seq;
+	uint32_t pin;
+	bool state;
+	// Name of the serial_send() error, the error message of the device,
+	// or a description of the unexpected acknowledgement.
+	char error[MSG_MAXLEN];
+};
+
+// Counters of the stream of a device.
+struct stream_info {
+	// Sequence number of the last command accepted, 0 if none was.
+	uint32_t last_seq;
+	// All commands up to this one were acknowledged or reported as
+	// errors.
+	uint32_t reconciled_seq;
+	// Commands waiting to be sent or acknowledged.
+	uint32_t in_flight;
+	// Commands acknowledged as expected.
+	uint32_t acked;
+	// Commands the device refused or acknowledged with an unexpected
+	// response.
+	uint32_t failed;
+	// Commands that were not sent or got no acknowledgement.
+	uint32_t dropped;
+};
+
+// Queues the pin command to the device without waiting for it to be
+// acknowledged. Stream commands are pipelined and are never merged with
+// other commands to the same pin, so every toggle reaches the device.
+// The acknowledgement is checked when it arrives. Errors are reported
+// with a stream.error event and kept for stream_foreach_error().
+// Returns:
+// 0 on success, seq is set to the sequence number of the command
+// -1 if STREAM_WINDOW commands to the device are still in flight
+// -2 if memory allocation failed
+int stream_send(const char *dev_id, uint32_t pin, bool state,
+		enum serial_priority priority, uint32_t *seq);
+
+// Returns false if nothing was streamed to the device.
+bool stream_get_info(const char *dev_id, struct stream_info *info);
+
+typedef void (*stream_error_cb)(const struct stream_error *err, void *priv);
+
+// Calls cb for the recent errors of the device, oldest first.
+void stream_foreach_error(const char *dev_id, stream_error_cb cb,
+			  void *priv);
+
+// Frees all streams. Must be called after close_serial_devs(), which
+// completes the commands in flight.
+void stream_free(void);
+
+#endif
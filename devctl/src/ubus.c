@@ -4,178 +4,443 @@
 #include <stdio.h>
 #include <stdbool.h>
 #include <stdint.h>
+#include <limits.h>
+#include <time.h>
 
 #include <libubox/blobmsg_json.h>
 #include <libubus.h>
-#include <json-c/json.h>
 
 #include "ubus.h"
+#include "args.h"
 #include "serial.h"
+#include "devices.h"
+#include "result.h"
+#include "events.h"
+#include "schedule.h"
+#include "stream.h"
+#include "arena.h"
+#include "reload.h"
 
-#define MAX_DEVS 10
-#define MSG_MAXLEN 50
+// Maximum number of pins in a single set_pins call.
+#define MAX_BATCH_PINS 32
 #define LIST_DEVICES_METHOD_NAME "list_devices"
 #define TURN_ON_PIN_METHOD_NAME "turn_on_pin"
 #define TURN_OFF_PIN_METHOD_NAME "turn_off_pin"
-#define TURN_ON_PIN_SUCCESS_MSG "Pin was turned on"
-#define TURN_OFF_PIN_SUCCESS_MSG "Pin was turned off"
-
-// Returned status codes:
-enum devctl_status_code {
-	//  0 - operation performed successfully
-	DEVCTL_OK = 0,
-	//  1 - operation failed
-	DEVCTL_OPERATION_FAILED,
-	//  2 - failed to connect to device
-	DEVCTL_CONNECT_FAIL,
-	//  3 - failed to send message to device
-	DEVCTL_SEND_FAIL,
-	//  4 - failed to get response from device
-	DEVCTL_RECV_FAIL,
-	//  5 - device was disconnected
-	DEVCTL_DISCONNECTED,
-	//  6 - failed to parse response
-	DEVCTL_PARSE_FAILURE,
-	//  7 - response is in unexpected format
-	DEVCTL_UNEXPECTED_RESPONSE,
-	//  8 - unknown error related to device
-	DEVCTL_UNKNOWN_ERROR,
-	//  9 - internal error, unrelated to device
-	DEVCTL_INTERNAL_ERROR
-};
+#define SET_PINS_METHOD_NAME "set_pins"
+#define GET_PIN_STATE_METHOD_NAME "get_pin_state"
+#define GET_ALL_PINS_METHOD_NAME "get_all_pins"
+#define STATS_METHOD_NAME "stats"
+#define PULSE_PIN_METHOD_NAME "pulse_pin"
+#define SCHEDULE_PIN_METHOD_NAME "schedule_pin"
+#define LIST_SCHEDULED_METHOD_NAME "list_scheduled"
+#define CANCEL_SCHEDULED_METHOD_NAME "cancel_scheduled"
+#define STREAM_PIN_METHOD_NAME "stream_pin"
+#define STREAM_STATUS_METHOD_NAME "stream_status"
+#define RELOAD_METHOD_NAME "reload"
+#define GROUP_SET_PIN_METHOD_NAME "group_set_pin"
+#define BROADCAST_METHOD_NAME "broadcast"
+#define DEVICE_HEALTH_METHOD_NAME "device_health"
 
 // Turn specified pin from specified device on or off.
 static int control_pin(struct ubus_context *ctx, struct ubus_object *obj,
 		       struct ubus_request_data *req, const char *method,
 		       struct blob_attr *msg);
 
+// Set states of multiple pins, possibly on different devices.
+static int set_pins(struct ubus_context *ctx, struct ubus_object *obj,
+		    struct ubus_request_data *req, const char *method,
+		    struct blob_attr *msg);
+
+// Get cached state of a pin.
+static int get_pin_state(struct ubus_context *ctx, struct ubus_object *obj,
+			 struct ubus_request_data *req, const char *method,
+			 struct blob_attr *msg);
+
+// Get cached states of all pins of a device.
+static int get_all_pins(struct ubus_context *ctx, struct ubus_object *obj,
+			struct ubus_request_data *req, const char *method,
+			struct blob_attr *msg);
+
 // List connected devices.
 static int list_devices(struct ubus_context *ctx, struct ubus_object *obj,
 			struct ubus_request_data *req, const char *method,
 			struct blob_attr *msg);
 
-enum { CTL_DEVICE_ID, CTL_PIN, __CTL_MAX };
+// Get (and optionally reset) device statistics.
+static int get_stats(struct ubus_context *ctx, struct ubus_object *obj,
+		     struct ubus_request_data *req, const char *method,
+		     struct blob_attr *msg);
+
+// Turn a pin on (or off) and back after a given time.
+static int pulse_pin(struct ubus_context *ctx, struct ubus_object *obj,
+		     struct ubus_request_data *req, const char *method,
+		     struct blob_attr *msg);
+
+// Set a pin at a given time or after a delay.
+static int schedule_pin(struct ubus_context *ctx, struct ubus_object *obj,
+			struct ubus_request_data *req, const char *method,
+			struct blob_attr *msg);
+
+// List pin changes that have not been executed yet.
+static int list_scheduled(struct ubus_context *ctx, struct ubus_object *obj,
+			  struct ubus_request_data *req, const char *method,
+			  struct blob_attr *msg);
+
+// Cancel a scheduled pin change.
+static int cancel_scheduled(struct ubus_context *ctx,
+			    struct ubus_object *obj,
+			    struct ubus_request_data *req, const char *method,
+			    struct blob_attr *msg);
+
+// Queue a pin command without waiting for the device.
+static int stream_pin(struct ubus_context *ctx, struct ubus_object *obj,
+		      struct ubus_request_data *req, const char *method,
+		      struct blob_attr *msg);
+
+// Report how far the stream of a device is acknowledged.
+static int stream_status(struct ubus_context *ctx, struct ubus_object *obj,
+			 struct ubus_request_data *req, const char *method,
+			 struct blob_attr *msg);
+
+// Set a pin on every device of a group, or of all connected devices.
+static int group_set_pin(struct ubus_context *ctx, struct ubus_object *obj,
+			 struct ubus_request_data *req, const char *method,
+			 struct blob_attr *msg);
+
+// Get the health and round trip time estimate of devices.
+static int device_health(struct ubus_context *ctx, struct ubus_object *obj,
+			 struct ubus_request_data *req, const char *method,
+			 struct blob_attr *msg);
+
+// Re-read the configuration and apply it without restarting.
+static int reload(struct ubus_context *ctx, struct ubus_object *obj,
+		  struct ubus_request_data *req, const char *method,
+		  struct blob_attr *msg);
+
+enum { CTL_DEVICE_ID, CTL_PIN, CTL_TIMEOUT, CTL_PRIORITY, __CTL_MAX };
 
 static const struct blobmsg_policy command_policy[] = {
 	[CTL_DEVICE_ID] = { .name = "device", .type = BLOBMSG_TYPE_STRING },
-	[CTL_PIN] = { .name = "pin", .type = BLOBMSG_TYPE_INT32 }
+	[CTL_PIN] = { .name = "pin", .type = BLOBMSG_TYPE_INT32 },
+	[CTL_TIMEOUT] = { .name = "timeout_ms", .type = BLOBMSG_TYPE_INT32 },
+	[CTL_PRIORITY] = { .name = "priority", .type = BLOBMSG_TYPE_STRING }
+};
+
+enum { DEV_DEVICE_ID, __DEV_MAX };
+
+static const struct blobmsg_policy device_policy[] = {
+	[DEV_DEVICE_ID] = { .name = "device", .type = BLOBMSG_TYPE_STRING }
+};
+
+enum {
+	SET_PINS_DEVICE_ID,
+	SET_PINS_PINS,
+	SET_PINS_TIMEOUT,
+	SET_PINS_PRIORITY,
+	__SET_PINS_MAX
+};
+
+static const struct blobmsg_policy set_pins_policy[] = {
+	[SET_PINS_DEVICE_ID] = { .name = "device",
+				 .type = BLOBMSG_TYPE_STRING },
+	[SET_PINS_PINS] = { .name = "pins", .type = BLOBMSG_TYPE_ARRAY },
+	[SET_PINS_TIMEOUT] = { .name = "timeout_ms",
+			       .type = BLOBMSG_TYPE_INT32 },
+	[SET_PINS_PRIORITY] = { .name = "priority",
+				.type = BLOBMSG_TYPE_STRING }
+};
+
+// Elements of the set_pins "pins" array. "device" defaults to the
+// top-level "device" argument.
+enum { PIN_DEVICE_ID, PIN_PIN, PIN_STATE, __PIN_MAX };
+
+static const struct blobmsg_policy pin_state_policy[] = {
+	[PIN_DEVICE_ID] = { .name = "device", .type = BLOBMSG_TYPE_STRING },
+	[PIN_PIN] = { .name = "pin", .type = BLOBMSG_TYPE_INT32 },
+	[PIN_STATE] = { .name = "state", .type = BLOBMSG_TYPE_BOOL }
+};
+
+enum { STATS_DEVICE_ID, STATS_RESET, __STATS_MAX };
+
+static const struct blobmsg_policy stats_policy[] = {
+	[STATS_DEVICE_ID] = { .name = "device", .type = BLOBMSG_TYPE_STRING },
+	[STATS_RESET] = { .name = "reset", .type = BLOBMSG_TYPE_BOOL }
+};
+
+enum { PULSE_DEVICE_ID, PULSE_PIN, PULSE_DURATION, PULSE_STATE, __PULSE_MAX };
+
+static const struct blobmsg_policy pulse_policy[] = {
+	[PULSE_DEVICE_ID] = { .name = "device", .type = BLOBMSG_TYPE_STRING },
+	[PULSE_PIN] = { .name = "pin", .type = BLOBMSG_TYPE_INT32 },
+	[PULSE_DURATION] = { .name = "duration_ms",
+			     .type = BLOBMSG_TYPE_INT32 },
+	[PULSE_STATE] = { .name = "state", .type = BLOBMSG_TYPE_BOOL }
+};
+
+enum {
+	SCHEDULE_DEVICE_ID,
+	SCHEDULE_PIN,
+	SCHEDULE_STATE,
+	SCHEDULE_AT,
+	SCHEDULE_AFTER,
+	__SCHEDULE_MAX
+};
+
+static const struct blobmsg_policy schedule_policy[] = {
+	[SCHEDULE_DEVICE_ID] = { .name = "device",
+				 .type = BLOBMSG_TYPE_STRING },
+	[SCHEDULE_PIN] = { .name = "pin", .type = BLOBMSG_TYPE_INT32 },
+	[SCHEDULE_STATE] = { .name = "state", .type = BLOBMSG_TYPE_BOOL },
+	// Milliseconds since the epoch do not fit into INT32, but JSON
+	// numbers are converted to the smallest type that fits.
+	[SCHEDULE_AT] = { .name = "at", .type = BLOBMSG_TYPE_UNSPEC },
+	[SCHEDULE_AFTER] = { .name = "after", .type = BLOBMSG_TYPE_INT32 }
+};
+
+enum { CANCEL_ID, __CANCEL_MAX };
+
+static const struct blobmsg_policy cancel_policy[] = {
+	[CANCEL_ID] = { .name = "id", .type = BLOBMSG_TYPE_INT32 }
+};
+
+enum {
+	STREAM_DEVICE_ID,
+	STREAM_PIN,
+	STREAM_STATE,
+	STREAM_PRIORITY,
+	__STREAM_MAX
+};
+
+static const struct blobmsg_policy stream_policy[] = {
+	[STREAM_DEVICE_ID] = { .name = "device", .type = BLOBMSG_TYPE_STRING },
+	[STREAM_PIN] = { .name = "pin", .type = BLOBMSG_TYPE_INT32 },
+	[STREAM_STATE] = { .name = "state", .type = BLOBMSG_TYPE_BOOL },
+	[STREAM_PRIORITY] = { .name = "priority", .type = BLOBMSG_TYPE_STRING }
+};
+
+enum {
+	GROUP_NAME,
+	GROUP_PIN,
+	GROUP_STATE,
+	GROUP_TIMEOUT,
+	GROUP_PRIORITY,
+	__GROUP_MAX
+};
+
+static const struct blobmsg_policy group_policy[] = {
+	[GROUP_NAME] = { .name = "group", .type = BLOBMSG_TYPE_STRING },
+	[GROUP_PIN] = { .name = "pin", .type = BLOBMSG_TYPE_INT32 },
+	[GROUP_STATE] = { .name = "state", .type = BLOBMSG_TYPE_BOOL },
+	[GROUP_TIMEOUT] = { .name = "timeout_ms", .type = BLOBMSG_TYPE_INT32 },
+	[GROUP_PRIORITY] = { .name = "priority", .type = BLOBMSG_TYPE_STRING }
 };
 
 static const struct ubus_method devctl_methods[] = {
 	UBUS_METHOD_NOARG(LIST_DEVICES_METHOD_NAME, list_devices),
 	UBUS_METHOD(TURN_ON_PIN_METHOD_NAME, control_pin, command_policy),
-	UBUS_METHOD(TURN_OFF_PIN_METHOD_NAME, control_pin, command_policy)
+	UBUS_METHOD(TURN_OFF_PIN_METHOD_NAME, control_pin, command_policy),
+	UBUS_METHOD(SET_PINS_METHOD_NAME, set_pins, set_pins_policy),
+	UBUS_METHOD(GET_PIN_STATE_METHOD_NAME, get_pin_state, command_policy),
+	UBUS_METHOD(GET_ALL_PINS_METHOD_NAME, get_all_pins, device_policy),
+	UBUS_METHOD(STATS_METHOD_NAME, get_stats, stats_policy),
+	UBUS_METHOD(PULSE_PIN_METHOD_NAME, pulse_pin, pulse_policy),
+	UBUS_METHOD(SCHEDULE_PIN_METHOD_NAME, schedule_pin, schedule_policy),
+	UBUS_METHOD_NOARG(LIST_SCHEDULED_METHOD_NAME, list_scheduled),
+	UBUS_METHOD(CANCEL_SCHEDULED_METHOD_NAME, cancel_scheduled,
+		    cancel_policy),
+	UBUS_METHOD(STREAM_PIN_METHOD_NAME, stream_pin, stream_policy),
+	UBUS_METHOD(STREAM_STATUS_METHOD_NAME, stream_status, device_policy),
+	UBUS_METHOD(GROUP_SET_PIN_METHOD_NAME, group_set_pin, group_policy),
+	UBUS_METHOD(BROADCAST_METHOD_NAME, group_set_pin, group_policy),
+	UBUS_METHOD(DEVICE_HEALTH_METHOD_NAME, device_health, device_policy),
+	UBUS_METHOD_NOARG(RELOAD_METHOD_NAME, reload)
 };
 
 static struct ubus_object_type devctl_object_type =
 	UBUS_OBJECT_TYPE("devctl", devctl_methods);
 
+// Shared by all replies, see reply_buf_init().
+static struct blob_buf reply_buf;
+
 static struct ubus_object devctl_object = { .name = "devctl",
 					    .type = &devctl_object_type,
 					    .methods = devctl_methods,
 					    .n_methods = ARRAY_SIZE(
 						    devctl_methods) };
 
+// Pin control request waiting for the device to respond.
+struct pin_request {
+	struct ubus_context *ctx;
+	struct ubus_request_data req;
+	struct serial_req sreq;
+	// Resends the command after a response that could not be parsed.
+	struct uloop_timeout retry;
+	unsigned int attempts;
+	uint32_t pin;
+	// Command was to turn on the pin, otherwise turn it off.
+	bool turn_on;
+	char device[];
+};
+
+struct batch_request;
+
+// Single pin of a set_pins, group_set_pin or broadcast request.
+struct batch_pin {
+	struct batch_request *batch;
+	struct serial_req sreq;
+	struct uloop_timeout retry;
+	unsigned int attempts;
+	// Device file name, or the name given by the client if the device
+	// is not connected. Stored after the pins in the same allocation.
+	char *device;
+	uint32_t pin;
+	bool turn_on;
+	bool connected;
+	struct pin_result result;
+	// Time from sending the batch to completing this pin, including
+	// retries.
+	uint64_t time_us;
+};
+
+// Batch of pin commands waiting for the devices to respond.
+struct batch_request {
+	struct ubus_context *ctx;
+	struct ubus_request_data req;
+	// Number of pins that have not been completed yet.
+	unsigned int num_pending;
+	unsigned int num_pins;
+	// Where the name of the next pin added goes. The names are stored
+	// after the pins.
+	char *names;
+	uint64_t start_us;
+	struct batch_pin pins[];
+};
+
 static void add_ubus_response(struct blob_buf *b,
-			      enum devctl_status_code status, char *message)
+			      enum devctl_status_code status,
+			      const char *message)
 {
 	blobmsg_add_u32(b, "status", (uint32_t)status);
 	blobmsg_add_string(b, "message", message);
 }
 
-// Parses response from device and determines if the command was
-// executed successfully.
-// Example responses:
-//  {"response": 0, "msg": "Pin was turned on"}\r\n
-//  {"response": 0, "msg": "Pin was turned off"}\r\n
-// Parameters:
-//  turn_on - cammand was to turn on a pin, otherwise turn off a pin
-// Return codes:
-//  0 - command executed successfully
-//  1 - command failed, error_buf is populated with error message
-// -1 - failed to parse msg, it is invalid JSON, error_buf contains error
-// -2 - msg does not contain required fields, error_buf contains error
-// -3 - error_buf is too small, its contents are undefined
-static int parse_device_response(const char *msg, bool turn_on, char *error_buf,
-				 size_t error_len)
-{
-	int ret_val = 0;
-	enum json_tokener_error err;
-	struct json_object *json = json_tokener_parse_verbose(msg, &err);
-	if (json == NULL) {
-		if ((size_t)snprintf(error_buf, error_len,
-				     "json-c error code %u",
-				     err) >= error_len) {
-			return -3;
-		}
-		return -1;
-	}
-	struct json_object *status = json_object_object_get(json, "response");
-	if (status == NULL || json_object_get_type(status) != json_type_int) {
-		ret_val = -2;
-		if ((size_t)snprintf(
-			    error_buf, error_len,
-			    "'status' field of type number not found in msg") >=
-		    error_len) {
-			ret_val = -3;
-		}
-		goto cleanup_json;
-	}
-	struct json_object *message_obj = json_object_object_get(json, "msg");
-	if (message_obj == NULL) {
-		ret_val = -2;
-		goto cleanup_json;
-	}
-	const char *message = json_object_get_string(message_obj);
-	if (json_object_get_int64(status) != 0) {
-		// Error.
-		ret_val = 1;
-
-		if (message == NULL) {
-			ret_val = -2;
-		} else if ((size_t)snprintf(error_buf, error_len, "%s",
-					    message) >= error_len) {
-			ret_val = -3;
-		}
-		goto cleanup_json;
-	}
-	// Success, just need to check if the expected action was performed.
-	if (turn_on && strcmp(message, TURN_ON_PIN_SUCCESS_MSG) != 0) {
-		ret_val = 1;
-		if ((size_t)snprintf(error_buf, error_len, "%s", message) >=
-		    error_len) {
-			ret_val = -3;
-		}
-		goto cleanup_json;
-	} else if (!turn_on && strcmp(message, TURN_OFF_PIN_SUCCESS_MSG) != 0) {
-		ret_val = 1;
-		if ((size_t)snprintf(error_buf, error_len, "%s", message) >=
-		    error_len) {
-			ret_val = -3;
-		}
-		goto cleanup_json;
+// Returns the buffer for building replies, emptied. Replies are built
+// and sent one at a time, so a single buffer is shared by all of them.
+// It keeps its memory between replies, so it only grows until it fits
+// the largest reply.
+static struct blob_buf *reply_buf_init(void)
+{
+	blob_buf_init(&reply_buf, 0);
+	return &reply_buf;
+}
+
+// Sends a reply containing only the status and the message.
+static int send_status_reply(struct ubus_context *ctx,
+			     struct ubus_request_data *req,
+			     enum devctl_status_code status,
+			     const char *message)
+{
+	struct blob_buf *b = reply_buf_init();
+	add_ubus_response(b, status, message);
+	int ret = ubus_send_reply(ctx, req, b->head);
+	if (ret != 0) {
+		syslog(LOG_ERR, "Failed to send ubus reply: %s",
+		       ubus_strerror(ret));
 	}
-cleanup_json:
-	json_object_put(json);
-	return ret_val;
+	return ret;
+}
+
+// Reads the optional response timeout argument.
+// Returns false if the value is not valid.
+static bool get_timeout_arg(struct blob_attr *attr, int *timeout_ms)
+{
+	*timeout_ms = 0;
+	if (attr == NULL) {
+		return true;
+	}
+	int32_t value = (int32_t)blobmsg_get_u32(attr);
+	if (value < 0) {
+		syslog(LOG_WARNING, "Invalid timeout: %d", value);
+		return false;
+	}
+	*timeout_ms = value;
+	return true;
+}
+
+// Reads the optional priority class argument.
+// Returns false if the value is not valid.
+static bool get_priority_arg(struct blob_attr *attr,
+			     enum serial_priority *priority)
+{
+	*priority = SERIAL_PRIORITY_NORMAL;
+	if (attr == NULL) {
+		return true;
+	}
+	const char *name = blobmsg_get_string(attr);
+	if (!serial_priority_from_name(name, priority)) {
+		syslog(LOG_WARNING, "Invalid priority: %s", name);
+		return false;
+	}
+	return true;
 }
 
-// Status codes:
-// 0 - success,
-// 1 - error on our side,
-// 2 - device reported error.
+static void pin_request_retry_cb(struct uloop_timeout *t)
+{
+	struct pin_request *preq = container_of(t, struct pin_request, retry);
+	serial_send(preq->device, &preq->sreq);
+}
+
+// Sends the deferred reply once the device has responded.
+static void pin_request_cb(struct serial_req *sreq, int status)
+{
+	struct pin_request *preq =
+		container_of(sreq, struct pin_request, sreq);
+
+	struct pin_result res;
+	get_req_result(&res, sreq, status, preq->turn_on);
+	// Resending a superseded command would undo the later one.
+	if (res.status == DEVCTL_PARSE_FAILURE && !sreq->superseded &&
+	    schedule_retry(sreq, &preq->retry, &preq->attempts)) {
+		return;
+	}
+	record_status(sreq, res.status);
+	if (!sreq->superseded) {
+		update_pin_state(preq->device, preq->pin, preq->turn_on,
+				 &res);
+	}
+
+	struct blob_buf *b = reply_buf_init();
+	add_ubus_response(b, res.status, res.message);
+
+	int ret = ubus_send_reply(preq->ctx, &preq->req, b->head);
+	if (ret != 0) {
+		syslog(LOG_ERR, "Failed to send ubus reply: %s",
+		       ubus_strerror(ret));
+	}
+	ubus_complete_deferred_request(preq->ctx, &preq->req, ret);
+
+	arena_free(preq);
+}
+
+// Turn specified pin from specified device on or off. The reply is
+// deferred until the device responds, so that the event loop is not
+// blocked in the meantime.
 static int control_pin(struct ubus_context *ctx, struct ubus_object *obj,
 		       struct ubus_request_data *req, const char *method,
 		       struct blob_attr *msg)
 {
 	(void)obj;
-	int ret_val = UBUS_STATUS_OK;
 	bool turn_on_pin = false;
 	if (strcmp(method, TURN_ON_PIN_METHOD_NAME) == 0) {
 		turn_on_pin = true;
 	}
-	syslog(LOG_DEBUG, "Received ubus message of type '%s': %s", method,
-	       blobmsg_format_json(msg, true));
+	// Formatting allocates, only do it if the message is logged.
+	if (config.log_level >= LOG_DEBUG) {
+		char *json = blobmsg_format_json(msg, true);
+		syslog(LOG_DEBUG, "Received ubus message of type '%s': %s",
+		       method, json != NULL ? json : "");
+		free(json);
+	}
 	struct blob_attr *tb[__CTL_MAX];
 
 	blobmsg_parse(command_policy, __CTL_MAX, tb, blob_data(msg),
@@ -185,107 +450,501 @@ static int control_pin(struct ubus_context *ctx, struct ubus_object *obj,
 		return UBUS_STATUS_INVALID_ARGUMENT;
 	}
 
-	char *dev_id = blobmsg_get_string(tb[CTL_DEVICE_ID]);
+	int timeout_ms;
+	enum serial_priority priority;
+	if (!get_timeout_arg(tb[CTL_TIMEOUT], &timeout_ms) ||
+	    !get_priority_arg(tb[CTL_PRIORITY], &priority)) {
+		return UBUS_STATUS_INVALID_ARGUMENT;
+	}
+
+	const char *dev_name = blobmsg_get_string(tb[CTL_DEVICE_ID]);
 	uint32_t dev_pin = blobmsg_get_u32(tb[CTL_PIN]);
-	syslog(LOG_DEBUG, "dev_id = %s, dev_pin = %u", dev_id, dev_pin);
+	const char *dev_id = resolve_device(dev_name);
+	syslog(LOG_DEBUG, "dev_id = %s, dev_pin = %u", dev_name, dev_pin);
+	if (dev_id == NULL) {
+		syslog(LOG_WARNING, "Device %s is not connected", dev_name);
+		return send_status_reply(ctx, req, DEVCTL_CONNECT_FAIL,
+					 "Device is not connected");
+	}
 
-	struct blob_buf b = { 0 };
-	blob_buf_init(&b, 0);
+	if (config.skip_redundant && !serial_is_busy(dev_id) &&
+	    serial_get_pin_state(dev_id, dev_pin) ==
+		    (turn_on_pin ? PIN_STATE_ON : PIN_STATE_OFF)) {
+		syslog(LOG_DEBUG, "Pin %u of %s is already in requested state",
+		       dev_pin, dev_id);
+		return send_status_reply(
+			ctx, req, DEVCTL_OK,
+			"Pin is already in the requested state");
+	}
 
-	char msg_buf[MSG_MAXLEN];
-	if (turn_on_pin) {
-		sprintf(msg_buf, "{\"action\":\"on\",\"pin\":%u}", dev_pin);
-	} else {
-		sprintf(msg_buf, "{\"action\":\"off\",\"pin\":%u}", dev_pin);
-	}
-
-	char response_buf[MSG_MAXLEN];
-	int ret = send_msg(dev_id, msg_buf, strlen(msg_buf), response_buf,
-			   sizeof(response_buf));
-	switch (ret) {
-	case 0:
-		syslog(LOG_DEBUG, "Received response '%s'", response_buf);
-		ret = parse_device_response(response_buf, turn_on_pin, msg_buf,
-					    sizeof(msg_buf));
-		switch (ret) {
-		case 0:
-			add_ubus_response(&b, DEVCTL_OK,
-					  "Operation performed successfully");
-			break;
-		case 1:
-			add_ubus_response(&b, DEVCTL_OPERATION_FAILED, msg_buf);
-			break;
-		case -1:
-		case -2:
-			syslog(LOG_ERR,
-			       "Failed to parse response from device. Response: '%s', error: %s",
-			       response_buf, msg_buf);
-			add_ubus_response(
-				&b, DEVCTL_PARSE_FAILURE,
-				"Failed to parse response from device");
-			break;
-		case -3:
-			syslog(LOG_ERR,
-			       "Insufficient error buffer size. Device response: %s",
-			       response_buf);
-			add_ubus_response(&b, DEVCTL_UNKNOWN_ERROR,
-					  "Insufficient buffer size");
-			break;
-		default:
-			syslog(LOG_ERR,
-			       "Unrecognized parse_device_response() return code: %d",
-			       ret);
-			add_ubus_response(&b, DEVCTL_INTERNAL_ERROR,
-					  "Internal error");
+	struct pin_request *preq =
+		arena_alloc(sizeof(*preq) + strlen(dev_id) + 1);
+	if (preq == NULL) {
+		syslog(LOG_ERR, "Failed to allocate memory for request");
+		return UBUS_STATUS_NO_MEMORY;
+	}
+	preq->ctx = ctx;
+	preq->pin = dev_pin;
+	preq->turn_on = turn_on_pin;
+	preq->sreq.cb = pin_request_cb;
+	preq->sreq.timeout_ms = timeout_ms;
+	preq->sreq.priority = priority;
+	preq->retry.cb = pin_request_retry_cb;
+	strcpy(preq->device, dev_id);
+
+	serial_format_pin_command(&preq->sreq, dev_pin, turn_on_pin);
+
+	ubus_defer_request(ctx, req, &preq->req);
+	serial_send(dev_id, &preq->sreq);
+
+	return UBUS_STATUS_OK;
+}
+
+// Sends the aggregated reply once all pins of the batch are completed.
+static void finish_batch(struct batch_request *batch)
+{
+	struct blob_buf *b = reply_buf_init();
+
+	unsigned int num_failed = 0;
+	const struct batch_pin *slowest = NULL;
+	void *array = blobmsg_open_array(b, "pins");
+	for (unsigned int i = 0; i < batch->num_pins; ++i) {
+		struct batch_pin *bp = &batch->pins[i];
+		void *table = blobmsg_open_table(b, NULL);
+		blobmsg_add_string(b, "device", bp->device);
+		blobmsg_add_u32(b, "pin", bp->pin);
+		blobmsg_add_u8(b, "state", bp->turn_on);
+		add_ubus_response(b, bp->result.status, bp->result.message);
+		blobmsg_add_u64(b, "time_us", bp->time_us);
+		if (bp->result.status != DEVCTL_OK) {
+			num_failed += 1;
 		}
-		break;
-	case -1:
-		add_ubus_response(&b, DEVCTL_CONNECT_FAIL,
-				  "Failed to open device file");
-		break;
-	case -2:
-		add_ubus_response(
-			&b, DEVCTL_CONNECT_FAIL,
-			"Failed to lock the device for exclusive access");
-		break;
-	case -3:
-		add_ubus_response(&b, DEVCTL_CONNECT_FAIL,
-				  "Failed to configure serial connection");
-		break;
-	case -4:
-		add_ubus_response(&b, DEVCTL_SEND_FAIL,
-				  "Failed to send message to device");
-		break;
-	case -5:
-		add_ubus_response(&b, DEVCTL_RECV_FAIL,
-				  "Failed to get response from device");
-		break;
-	case -6:
-		add_ubus_response(&b, DEVCTL_INTERNAL_ERROR,
-				  "Device response is too big for the buffer");
-		break;
-	case -7:
-		add_ubus_response(&b, DEVCTL_DISCONNECTED,
-				  "Device was disconnected");
-		break;
-	default:
-		syslog(LOG_ERR, "Unrecognized send_msg() return code: %d", ret);
-		add_ubus_response(&b, DEVCTL_INTERNAL_ERROR, "Internal error");
-	}
-	ret = ubus_send_reply(ctx, req, b.head);
+		if (slowest == NULL || bp->time_us > slowest->time_us) {
+			slowest = bp;
+		}
+		blobmsg_close_table(b, table);
+	}
+	blobmsg_close_array(b, array);
+	void *table = blobmsg_open_table(b, "slowest");
+	blobmsg_add_string(b, "device", slowest->device);
+	blobmsg_add_u64(b, "time_us", slowest->time_us);
+	blobmsg_close_table(b, table);
+	if (num_failed == 0) {
+		add_ubus_response(b, DEVCTL_OK,
+				  "Operation performed successfully");
+	} else {
+		add_ubus_response(b, DEVCTL_OPERATION_FAILED,
+				  "Some of the operations failed");
+	}
+
+	int ret = ubus_send_reply(batch->ctx, &batch->req, b->head);
 	if (ret != 0) {
 		syslog(LOG_ERR, "Failed to send ubus reply: %s",
 		       ubus_strerror(ret));
-		ret_val = ret;
-		goto cleanup;
 	}
-cleanup:
-	blob_buf_free(&b);
+	ubus_complete_deferred_request(batch->ctx, &batch->req, ret);
 
-	return ret_val;
+	arena_free(batch);
 }
 
-// List connected devices.
+static void batch_pin_retry_cb(struct uloop_timeout *t)
+{
+	struct batch_pin *bp = container_of(t, struct batch_pin, retry);
+	serial_send(bp->device, &bp->sreq);
+}
+
+static void batch_pin_cb(struct serial_req *sreq, int status)
+{
+	struct batch_pin *bp = container_of(sreq, struct batch_pin, sreq);
+	struct batch_request *batch = bp->batch;
+	bp->time_us = stats_now_us() - batch->start_us;
+	// The response is only valid during the callback.
+	get_req_result(&bp->result, sreq, status, bp->turn_on);
+	if (bp->result.status == DEVCTL_PARSE_FAILURE && !sreq->superseded &&
+	    schedule_retry(sreq, &bp->retry, &bp->attempts)) {
+		return;
+	}
+	record_status(sreq, bp->result.status);
+	if (!sreq->superseded) {
+		update_pin_state(bp->device, bp->pin, bp->turn_on,
+				 &bp->result);
+	}
+	batch->num_pending -= 1;
+	if (batch->num_pending == 0) {
+		finish_batch(batch);
+	}
+}
+
+// Returns the device file name if the device is connected, otherwise
+// the name given by the client.
+static const char *resolve_batch_device(const char *dev_name,
+					bool *connected)
+{
+	const char *dev_id = resolve_device(dev_name);
+	*connected = dev_id != NULL;
+	return *connected ? dev_id : dev_name;
+}
+
+// Returns the device of a set_pins element, see resolve_batch_device().
+static const char *get_batch_pin_device(struct blob_attr **pin_tb,
+					const char *default_dev,
+					bool *connected)
+{
+	const char *dev_name = default_dev;
+	if (pin_tb[PIN_DEVICE_ID] != NULL) {
+		dev_name = blobmsg_get_string(pin_tb[PIN_DEVICE_ID]);
+	}
+	return resolve_batch_device(dev_name, connected);
+}
+
+// Allocates a batch of num_pins pins with room for names_len bytes of
+// device names. The pins are added by add_batch_pin().
+static struct batch_request *alloc_batch(struct ubus_context *ctx,
+					 unsigned int num_pins,
+					 size_t names_len)
+{
+	struct batch_request *batch =
+		arena_alloc(sizeof(*batch) +
+			    num_pins * sizeof(struct batch_pin) + names_len);
+	if (batch == NULL) {
+		syslog(LOG_ERR, "Failed to allocate memory for request");
+		return NULL;
+	}
+	batch->ctx = ctx;
+	batch->names = (char *)&batch->pins[num_pins];
+	return batch;
+}
+
+// Adds a pin command to the batch. device and connected are as returned
+// by resolve_batch_device().
+static void add_batch_pin(struct batch_request *batch, const char *device,
+			  bool connected, uint32_t pin, bool turn_on,
+			  int timeout_ms, enum serial_priority priority)
+{
+	struct batch_pin *bp = &batch->pins[batch->num_pins++];
+	bp->device = strcpy(batch->names, device);
+	batch->names += strlen(device) + 1;
+	bp->connected = connected;
+	bp->batch = batch;
+	bp->pin = pin;
+	bp->turn_on = turn_on;
+	bp->sreq.cb = batch_pin_cb;
+	bp->sreq.pipeline = true;
+	bp->sreq.timeout_ms = timeout_ms;
+	bp->sreq.priority = priority;
+	bp->retry.cb = batch_pin_retry_cb;
+	serial_format_pin_command(&bp->sreq, pin, turn_on);
+}
+
+// Defers the reply and queues all commands of the batch at once. Every
+// device has its own queue, so the devices work on their commands at the
+// same time and the batch takes about as long as the slowest device.
+static void send_batch(struct ubus_context *ctx,
+		       struct ubus_request_data *req,
+		       struct batch_request *batch)
+{
+	ubus_defer_request(ctx, req, &batch->req);
+	batch->start_us = stats_now_us();
+	// Requests may complete while they are being queued. The extra
+	// count keeps the batch alive until all of them are queued.
+	batch->num_pending = batch->num_pins + 1;
+	for (unsigned int i = 0; i < batch->num_pins; ++i) {
+		struct batch_pin *bp = &batch->pins[i];
+		if (!bp->connected) {
+			set_pin_result(&bp->result, DEVCTL_CONNECT_FAIL,
+				       "Device is not connected");
+			batch->num_pending -= 1;
+			continue;
+		}
+		serial_send(bp->device, &bp->sreq);
+	}
+	batch->num_pending -= 1;
+	if (batch->num_pending == 0) {
+		finish_batch(batch);
+	}
+}
+
+// Set states of multiple pins in one call. Commands to the same device
+// are written back-to-back without waiting for the responses, which are
+// then matched to the commands in order. The reply is deferred until
+// all devices respond.
+static int set_pins(struct ubus_context *ctx, struct ubus_object *obj,
+		    struct ubus_request_data *req, const char *method,
+		    struct blob_attr *msg)
+{
+	(void)obj;
+	syslog(LOG_DEBUG, "Received ubus message of type '%s'", method);
+
+	struct blob_attr *tb[__SET_PINS_MAX];
+	blobmsg_parse(set_pins_policy, __SET_PINS_MAX, tb, blob_data(msg),
+		      blob_len(msg));
+	if (tb[SET_PINS_PINS] == NULL) {
+		syslog(LOG_WARNING, "Failed to parse ubus message");
+		return UBUS_STATUS_INVALID_ARGUMENT;
+	}
+	int timeout_ms;
+	enum serial_priority priority;
+	if (!get_timeout_arg(tb[SET_PINS_TIMEOUT], &timeout_ms) ||
+	    !get_priority_arg(tb[SET_PINS_PRIORITY], &priority)) {
+		return UBUS_STATUS_INVALID_ARGUMENT;
+	}
+	const char *default_dev = NULL;
+	if (tb[SET_PINS_DEVICE_ID] != NULL) {
+		default_dev = blobmsg_get_string(tb[SET_PINS_DEVICE_ID]);
+	}
+
+	// Validate all the elements before sending anything.
+	unsigned int num_pins = 0;
+	size_t names_len = 0;
+	struct blob_attr *cur;
+	size_t rem;
+	blobmsg_for_each_attr(cur, tb[SET_PINS_PINS], rem) {
+		struct blob_attr *pin_tb[__PIN_MAX];
+		if (blobmsg_type(cur) != BLOBMSG_TYPE_TABLE) {
+			return UBUS_STATUS_INVALID_ARGUMENT;
+		}
+		blobmsg_parse(pin_state_policy, __PIN_MAX, pin_tb,
+			      blobmsg_data(cur), blobmsg_data_len(cur));
+		if (pin_tb[PIN_PIN] == NULL || pin_tb[PIN_STATE] == NULL ||
+		    (pin_tb[PIN_DEVICE_ID] == NULL && default_dev == NULL)) {
+			syslog(LOG_WARNING, "Failed to parse ubus message");
+			return UBUS_STATUS_INVALID_ARGUMENT;
+		}
+		bool connected;
+		names_len += strlen(get_batch_pin_device(pin_tb, default_dev,
+							 &connected)) +
+			     1;
+		num_pins += 1;
+	}
+	if (num_pins == 0 || num_pins > MAX_BATCH_PINS) {
+		syslog(LOG_WARNING, "Invalid number of pins: %u", num_pins);
+		return UBUS_STATUS_INVALID_ARGUMENT;
+	}
+
+	struct batch_request *batch = alloc_batch(ctx, num_pins, names_len);
+	if (batch == NULL) {
+		return UBUS_STATUS_NO_MEMORY;
+	}
+	blobmsg_for_each_attr(cur, tb[SET_PINS_PINS], rem) {
+		struct blob_attr *pin_tb[__PIN_MAX];
+		blobmsg_parse(pin_state_policy, __PIN_MAX, pin_tb,
+			      blobmsg_data(cur), blobmsg_data_len(cur));
+		bool connected;
+		const char *device = get_batch_pin_device(pin_tb, default_dev,
+							  &connected);
+		add_batch_pin(batch, device, connected,
+			      blobmsg_get_u32(pin_tb[PIN_PIN]),
+			      blobmsg_get_bool(pin_tb[PIN_STATE]), timeout_ms,
+			      priority);
+	}
+	send_batch(ctx, req, batch);
+
+	return UBUS_STATUS_OK;
+}
+
+// Set a pin on every device of a group (group_set_pin) or on every
+// device in the registry (broadcast). The commands are sent to all the
+// devices at once, the reply is deferred until all of them respond.
+static int group_set_pin(struct ubus_context *ctx, struct ubus_object *obj,
+			 struct ubus_request_data *req, const char *method,
+			 struct blob_attr *msg)
+{
+	(void)obj;
+	syslog(LOG_DEBUG, "Received ubus message of type '%s'", method);
+
+	bool broadcast = strcmp(method, BROADCAST_METHOD_NAME) == 0;
+	struct blob_attr *tb[__GROUP_MAX];
+	blobmsg_parse(group_policy, __GROUP_MAX, tb, blob_data(msg),
+		      blob_len(msg));
+	if ((!broadcast && tb[GROUP_NAME] == NULL) || tb[GROUP_PIN] == NULL ||
+	    tb[GROUP_STATE] == NULL) {
+		syslog(LOG_WARNING, "Failed to parse ubus message");
+		return UBUS_STATUS_INVALID_ARGUMENT;
+	}
+	int timeout_ms;
+	enum serial_priority priority;
+	if (!get_timeout_arg(tb[GROUP_TIMEOUT], &timeout_ms) ||
+	    !get_priority_arg(tb[GROUP_PRIORITY], &priority)) {
+		return UBUS_STATUS_INVALID_ARGUMENT;
+	}
+	uint32_t pin = blobmsg_get_u32(tb[GROUP_PIN]);
+	bool turn_on = blobmsg_get_bool(tb[GROUP_STATE]);
+
+	unsigned int num_pins = 0;
+	size_t names_len = 0;
+	const struct device_group *group = NULL;
+	const struct device *dev;
+	bool connected;
+	if (broadcast) {
+		refresh_devices();
+		avl_for_each_element(&devices, dev, avl) {
+			names_len += strlen(dev->name) + 1;
+			num_pins += 1;
+		}
+		if (num_pins == 0) {
+			return send_status_reply(ctx, req, DEVCTL_CONNECT_FAIL,
+						 "No devices are connected");
+		}
+	} else {
+		const char *name = blobmsg_get_string(tb[GROUP_NAME]);
+		group = find_device_group(name);
+		if (group == NULL) {
+			syslog(LOG_WARNING, "Unknown group %s", name);
+			return send_status_reply(ctx, req,
+						 DEVCTL_OPERATION_FAILED,
+						 "No such group");
+		}
+		for (unsigned int i = 0; i < group->num_devices; ++i) {
+			const char *device = resolve_batch_device(
+				group->devices[i], &connected);
+			names_len += strlen(device) + 1;
+		}
+		num_pins = group->num_devices;
+	}
+
+	struct batch_request *batch = alloc_batch(ctx, num_pins, names_len);
+	if (batch == NULL) {
+		return UBUS_STATUS_NO_MEMORY;
+	}
+	if (broadcast) {
+		avl_for_each_element(&devices, dev, avl) {
+			add_batch_pin(batch, dev->name, true, pin, turn_on,
+				      timeout_ms, priority);
+		}
+	} else {
+		for (unsigned int i = 0; i < group->num_devices; ++i) {
+			const char *device = resolve_batch_device(
+				group->devices[i], &connected);
+			add_batch_pin(batch, device, connected, pin, turn_on,
+				      timeout_ms, priority);
+		}
+	}
+	send_batch(ctx, req, batch);
+
+	return UBUS_STATUS_OK;
+}
+
+// Resolves the device name for methods that only report cached data.
+// Names of devices that are not connected are used as is, nothing is
+// cached under them, so these methods report nothing for them.
+static const char *resolve_cached_device(const char *name)
+{
+	const char *dev_id = resolve_device(name);
+	return dev_id != NULL ? dev_id : name;
+}
+
+// Adds the cached state of the pin to the reply, or the state from
+// before the restart as last_state if the device did not confirm it yet.
+static void add_pin_state(struct blob_buf *b, const char *dev_id,
+			  uint32_t pin)
+{
+	enum pin_state state = serial_get_pin_state(dev_id, pin);
+	blobmsg_add_u32(b, "pin", pin);
+	blobmsg_add_u8(b, "known", state != PIN_STATE_UNKNOWN);
+	if (state != PIN_STATE_UNKNOWN) {
+		blobmsg_add_u8(b, "state", state == PIN_STATE_ON);
+		return;
+	}
+	state = serial_get_last_pin_state(dev_id, pin);
+	if (state != PIN_STATE_UNKNOWN) {
+		blobmsg_add_u8(b, "last_state", state == PIN_STATE_ON);
+	}
+}
+
+// Get cached state of a pin. The device is not contacted.
+static int get_pin_state(struct ubus_context *ctx, struct ubus_object *obj,
+			 struct ubus_request_data *req, const char *method,
+			 struct blob_attr *msg)
+{
+	(void)obj;
+	syslog(LOG_DEBUG, "Received ubus message of type '%s'", method);
+
+	struct blob_attr *tb[__CTL_MAX];
+	blobmsg_parse(command_policy, __CTL_MAX, tb, blob_data(msg),
+		      blob_len(msg));
+	if (tb[CTL_DEVICE_ID] == NULL || tb[CTL_PIN] == NULL) {
+		syslog(LOG_WARNING, "Failed to parse ubus message");
+		return UBUS_STATUS_INVALID_ARGUMENT;
+	}
+	const char *dev_name = blobmsg_get_string(tb[CTL_DEVICE_ID]);
+	const char *dev_id = resolve_cached_device(dev_name);
+
+	struct blob_buf *b = reply_buf_init();
+	blobmsg_add_string(b, "device", dev_name);
+	add_pin_state(b, dev_id, blobmsg_get_u32(tb[CTL_PIN]));
+	int ret = ubus_send_reply(ctx, req, b->head);
+	if (ret != UBUS_STATUS_OK) {
+		syslog(LOG_ERR, "Failed to send ubus reply: %s",
+		       ubus_strerror(ret));
+	}
+	return ret;
+}
+
+// Get cached states of all pins of a device. Only pins with known or
+// last known state are reported. The device is not contacted.
+static int get_all_pins(struct ubus_context *ctx, struct ubus_object *obj,
+			struct ubus_request_data *req, const char *method,
+			struct blob_attr *msg)
+{
+	(void)obj;
+	syslog(LOG_DEBUG, "Received ubus message of type '%s'", method);
+
+	struct blob_attr *tb[__DEV_MAX];
+	blobmsg_parse(device_policy, __DEV_MAX, tb, blob_data(msg),
+		      blob_len(msg));
+	if (tb[DEV_DEVICE_ID] == NULL) {
+		syslog(LOG_WARNING, "Failed to parse ubus message");
+		return UBUS_STATUS_INVALID_ARGUMENT;
+	}
+	const char *dev_name = blobmsg_get_string(tb[DEV_DEVICE_ID]);
+	const char *dev_id = resolve_cached_device(dev_name);
+
+	struct blob_buf *b = reply_buf_init();
+	blobmsg_add_string(b, "device", dev_name);
+	void *array = blobmsg_open_array(b, "pins");
+	for (uint32_t pin = 0; pin < MAX_CACHED_PINS; ++pin) {
+		if (serial_get_last_pin_state(dev_id, pin) ==
+		    PIN_STATE_UNKNOWN) {
+			continue;
+		}
+		void *table = blobmsg_open_table(b, NULL);
+		add_pin_state(b, dev_id, pin);
+		blobmsg_close_table(b, table);
+	}
+	blobmsg_close_array(b, array);
+	int ret = ubus_send_reply(ctx, req, b->head);
+	if (ret != UBUS_STATUS_OK) {
+		syslog(LOG_ERR, "Failed to send ubus reply: %s",
+		       ubus_strerror(ret));
+	}
+	return ret;
+}
+
+// Adds the identity of the device to the reply. Unknown fields are
+// omitted.
+static void add_device_details(struct blob_buf *b, const struct device *dev)
+{
+	void *table = blobmsg_open_table(b, NULL);
+	blobmsg_add_string(b, "device", dev->name);
+	if (dev->id != NULL) {
+		blobmsg_add_string(b, "id", dev->id);
+	}
+	const struct device_config *cfg = find_config_for_device(dev->name);
+	if (cfg != NULL && cfg->alias != NULL) {
+		blobmsg_add_string(b, "alias", cfg->alias);
+	}
+	if (dev->description != NULL) {
+		blobmsg_add_string(b, "description", dev->description);
+	}
+	if (dev->usb_bus != -1) {
+		blobmsg_add_u32(b, "usb_bus", (uint32_t)dev->usb_bus);
+		blobmsg_add_u32(b, "usb_address", (uint32_t)dev->usb_address);
+	}
+	blobmsg_close_table(b, table);
+}
+
+// List connected devices. Served from the device registry, which is
+// kept up to date by hotplug events.
 static int list_devices(struct ubus_context *ctx, struct ubus_object *obj,
 			struct ubus_request_data *req, const char *method,
 			struct blob_attr *msg)
@@ -296,39 +955,519 @@ static int list_devices(struct ubus_context *ctx, struct ubus_object *obj,
 	int ret_val = UBUS_STATUS_OK;
 
 	syslog(LOG_DEBUG, "Received ubus message of type '%s'", method);
-	char *devices[MAX_DEVS];
-	unsigned int num_devs;
-	if (!get_devices(devices, &num_devs, MAX_DEVS)) {
-		ret_val = UBUS_STATUS_UNKNOWN_ERROR;
-		goto cleanup_devs;
-	}
+	refresh_devices();
 
-	struct blob_buf b = {};
-	blob_buf_init(&b, 0);
+	struct blob_buf *b = reply_buf_init();
 
-	blobmsg_add_u32(&b, "count", num_devs);
-	void *array = blobmsg_open_array(&b, "devices");
-	for (unsigned int i = 0; i < num_devs; ++i) {
-		blobmsg_add_string(&b, NULL, devices[i]);
+	blobmsg_add_u32(b, "count", devices.count);
+	void *array = blobmsg_open_array(b, "devices");
+	struct device *dev;
+	avl_for_each_element(&devices, dev, avl) {
+		blobmsg_add_string(b, NULL, dev->name);
 	}
-	blobmsg_close_array(&b, array);
-	int ret = ubus_send_reply(ctx, req, b.head);
+	blobmsg_close_array(b, array);
+	// Kept separate from "devices" for compatibility with clients that
+	// expect an array of names.
+	array = blobmsg_open_array(b, "details");
+	avl_for_each_element(&devices, dev, avl) {
+		add_device_details(b, dev);
+	}
+	blobmsg_close_array(b, array);
+	int ret = ubus_send_reply(ctx, req, b->head);
 	if (ret != UBUS_STATUS_OK) {
 		syslog(LOG_ERR, "Failed to send ubus reply: %s",
 		       ubus_strerror(ret));
 		ret_val = ret;
-		goto cleanup_blob;
 	}
 
-cleanup_blob:
-	blob_buf_free(&b);
-cleanup_devs:
-	for (unsigned int i = 0; i < num_devs; ++i) {
-		free(devices[i]);
-	}
 	return ret_val;
 }
 
+static const char *const phase_names[__PHASE_MAX] = {
+	[PHASE_OPEN] = "open",
+	[PHASE_WRITE] = "write",
+	[PHASE_WAIT] = "wait",
+};
+
+struct stats_reply {
+	struct blob_buf *b;
+	bool reset;
+};
+
+static void add_latency_hist(struct blob_buf *b, const char *name,
+			     const struct latency_hist *hist)
+{
+	void *table = blobmsg_open_table(b, name);
+	blobmsg_add_u32(b, "count", hist->count);
+	blobmsg_add_u64(b, "total_us", hist->total_us);
+	blobmsg_add_u32(b, "max_us", hist->max_us);
+	void *array = blobmsg_open_array(b, "buckets");
+	for (unsigned int i = 0; i < LATENCY_BUCKETS; ++i) {
+		blobmsg_add_u32(b, NULL, hist->buckets[i]);
+	}
+	blobmsg_close_array(b, array);
+	blobmsg_close_table(b, table);
+}
+
+// Adds the statistics of the device to the reply and resets them if
+// requested.
+static void add_device_stats(const char *device, struct device_stats *stats,
+			     void *priv)
+{
+	struct stats_reply *reply = priv;
+	struct blob_buf *b = reply->b;
+
+	void *table = blobmsg_open_table(b, NULL);
+	blobmsg_add_string(b, "device", device);
+	blobmsg_add_u32(b, "requests", stats->requests);
+	blobmsg_add_u32(b, "merged", stats->merged);
+	blobmsg_add_u32(b, "superseded", stats->superseded);
+	blobmsg_add_u32(b, "retries", stats->retries);
+	blobmsg_add_u32(b, "breaker_trips", stats->breaker_trips);
+	blobmsg_add_u64(b, "bytes_written", stats->bytes_written);
+	blobmsg_add_u64(b, "bytes_read", stats->bytes_read);
+	void *array = blobmsg_open_array(b, "status");
+	for (unsigned int i = 0; i < STATS_NUM_STATUSES; ++i) {
+		blobmsg_add_u32(b, NULL, stats->statuses[i]);
+	}
+	blobmsg_close_array(b, array);
+	void *errors = blobmsg_open_table(b, "send_errors");
+	for (unsigned int i = 0; i < STATS_NUM_SEND_ERRORS; ++i) {
+		blobmsg_add_u32(b, stats_send_error_name(-(int)i - 1),
+				stats->send_errors[i]);
+	}
+	blobmsg_close_table(b, errors);
+	void *latency = blobmsg_open_table(b, "latency");
+	for (unsigned int i = 0; i < __PHASE_MAX; ++i) {
+		add_latency_hist(b, phase_names[i], &stats->latency[i]);
+	}
+	blobmsg_close_table(b, latency);
+	void *priorities = blobmsg_open_table(b, "priorities");
+	for (unsigned int i = 0; i < STATS_NUM_PRIORITIES; ++i) {
+		void *class = blobmsg_open_table(
+			b, serial_priority_name((enum serial_priority)i));
+		blobmsg_add_u32(b, "queued", stats->queued[i]);
+		add_latency_hist(b, "wait", &stats->queue_wait[i]);
+		blobmsg_close_table(b, class);
+	}
+	blobmsg_close_table(b, priorities);
+	blobmsg_close_table(b, table);
+
+	if (reply->reset) {
+		stats_reset(stats);
+	}
+}
+
+// Adds the memory kept for handling requests to the reply.
+static void add_memory_stats(struct blob_buf *b)
+{
+	struct arena_stats stats;
+	arena_get_stats(&stats);
+	void *table = blobmsg_open_table(b, "memory");
+	blobmsg_add_u64(b, "requests_in_use", stats.in_use);
+	blobmsg_add_u64(b, "requests_cached", stats.cached);
+	blobmsg_add_u64(b, "requests_peak", stats.peak);
+	blobmsg_add_u64(b, "heap_allocs", stats.heap_allocs);
+	blobmsg_add_u32(b, "reply_buffer", (uint32_t)reply_buf.buflen);
+	blobmsg_close_table(b, table);
+}
+
+// Get statistics of all devices that requests were sent to, or of a
+// single device. With "reset" the counters are zeroed after they are
+// reported.
+static int get_stats(struct ubus_context *ctx, struct ubus_object *obj,
+		     struct ubus_request_data *req, const char *method,
+		     struct blob_attr *msg)
+{
+	(void)obj;
+	syslog(LOG_DEBUG, "Received ubus message of type '%s'", method);
+
+	struct blob_attr *tb[__STATS_MAX];
+	blobmsg_parse(stats_policy, __STATS_MAX, tb, blob_data(msg),
+		      blob_len(msg));
+
+	struct blob_buf *b = reply_buf_init();
+	struct stats_reply reply = {
+		.b = b,
+		.reset = tb[STATS_RESET] != NULL &&
+			 blobmsg_get_bool(tb[STATS_RESET]),
+	};
+	void *array = blobmsg_open_array(b, "devices");
+	if (tb[STATS_DEVICE_ID] != NULL) {
+		const char *dev_id = resolve_cached_device(
+			blobmsg_get_string(tb[STATS_DEVICE_ID]));
+		struct device_stats *stats = serial_get_stats(dev_id);
+		if (stats == NULL) {
+			return UBUS_STATUS_NOT_FOUND;
+		}
+		add_device_stats(dev_id, stats, &reply);
+	} else {
+		serial_foreach_stats(add_device_stats, &reply);
+	}
+	blobmsg_close_array(b, array);
+	add_memory_stats(b);
+
+	int ret = ubus_send_reply(ctx, req, b->head);
+	if (ret != UBUS_STATUS_OK) {
+		syslog(LOG_ERR, "Failed to send ubus reply: %s",
+		       ubus_strerror(ret));
+	}
+	return ret;
+}
+
+// Schedules the pin change and replies with its id.
+static int reply_scheduled(struct ubus_context *ctx,
+			   struct ubus_request_data *req, const char *device,
+			   uint32_t pin, bool state, int delay_ms,
+			   uint32_t pulse_ms)
+{
+	uint32_t id;
+	if (!schedule_add(device, pin, state, delay_ms, pulse_ms, &id)) {
+		return send_status_reply(ctx, req, DEVCTL_INTERNAL_ERROR,
+					 "Failed to schedule the action");
+	}
+	struct blob_buf *b = reply_buf_init();
+	add_ubus_response(b, DEVCTL_OK, "Action scheduled");
+	blobmsg_add_u32(b, "id", id);
+	int ret = ubus_send_reply(ctx, req, b->head);
+	if (ret != UBUS_STATUS_OK) {
+		syslog(LOG_ERR, "Failed to send ubus reply: %s",
+		       ubus_strerror(ret));
+	}
+	return ret;
+}
+
+// Turn a pin on (or off) and back after a given time. The timing is
+// done by the event loop, so it does not depend on the client. The
+// reply is sent right away, the result can be followed with pin.changed
+// events.
+static int pulse_pin(struct ubus_context *ctx, struct ubus_object *obj,
+		     struct ubus_request_data *req, const char *method,
+		     struct blob_attr *msg)
+{
+	(void)obj;
+	syslog(LOG_DEBUG, "Received ubus message of type '%s'", method);
+
+	struct blob_attr *tb[__PULSE_MAX];
+	blobmsg_parse(pulse_policy, __PULSE_MAX, tb, blob_data(msg),
+		      blob_len(msg));
+	if (tb[PULSE_DEVICE_ID] == NULL || tb[PULSE_PIN] == NULL ||
+	    tb[PULSE_DURATION] == NULL) {
+		syslog(LOG_WARNING, "Failed to parse ubus message");
+		return UBUS_STATUS_INVALID_ARGUMENT;
+	}
+	int duration_ms;
+	if (!get_timeout_arg(tb[PULSE_DURATION], &duration_ms) ||
+	    duration_ms == 0) {
+		return UBUS_STATUS_INVALID_ARGUMENT;
+	}
+	const char *dev_name = blobmsg_get_string(tb[PULSE_DEVICE_ID]);
+	if (resolve_device(dev_name) == NULL) {
+		syslog(LOG_WARNING, "Device %s is not connected", dev_name);
+		return send_status_reply(ctx, req, DEVCTL_CONNECT_FAIL,
+					 "Device is not connected");
+	}
+	bool state = tb[PULSE_STATE] == NULL ||
+		     blobmsg_get_bool(tb[PULSE_STATE]);
+	return reply_scheduled(ctx, req, dev_name,
+			       blobmsg_get_u32(tb[PULSE_PIN]), state, 0,
+			       (uint32_t)duration_ms);
+}
+
+// Converts the time of a scheduled action to the delay until then.
+// Times in the past mean now.
+// Returns false if the time is not valid or too far away.
+static bool get_delay_until(struct blob_attr *attr, int *delay_ms)
+{
+	int64_t at_ms;
+	if (blobmsg_type(attr) == BLOBMSG_TYPE_INT64) {
+		at_ms = (int64_t)blobmsg_get_u64(attr);
+	} else if (blobmsg_type(attr) == BLOBMSG_TYPE_INT32) {
+		at_ms = (int32_t)blobmsg_get_u32(attr);
+	} else {
+		return false;
+	}
+	struct timespec ts;
+	clock_gettime(CLOCK_REALTIME, &ts);
+	int64_t now_ms = (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+	if (at_ms - now_ms > INT_MAX) {
+		return false;
+	}
+	*delay_ms = at_ms > now_ms ? (int)(at_ms - now_ms) : 0;
+	return true;
+}
+
+// Set a pin at a given time (milliseconds since the epoch) or after a
+// delay. The reply is sent right away.
+static int schedule_pin(struct ubus_context *ctx, struct ubus_object *obj,
+			struct ubus_request_data *req, const char *method,
+			struct blob_attr *msg)
+{
+	(void)obj;
+	syslog(LOG_DEBUG, "Received ubus message of type '%s'", method);
+
+	struct blob_attr *tb[__SCHEDULE_MAX];
+	blobmsg_parse(schedule_policy, __SCHEDULE_MAX, tb, blob_data(msg),
+		      blob_len(msg));
+	if (tb[SCHEDULE_DEVICE_ID] == NULL || tb[SCHEDULE_PIN] == NULL ||
+	    tb[SCHEDULE_STATE] == NULL ||
+	    (tb[SCHEDULE_AT] == NULL) == (tb[SCHEDULE_AFTER] == NULL)) {
+		syslog(LOG_WARNING, "Failed to parse ubus message");
+		return UBUS_STATUS_INVALID_ARGUMENT;
+	}
+	int delay_ms;
+	if (tb[SCHEDULE_AT] != NULL ?
+		    !get_delay_until(tb[SCHEDULE_AT], &delay_ms) :
+		    !get_timeout_arg(tb[SCHEDULE_AFTER], &delay_ms)) {
+		syslog(LOG_WARNING, "Invalid time of the action");
+		return UBUS_STATUS_INVALID_ARGUMENT;
+	}
+	// The device does not have to be connected yet.
+	return reply_scheduled(ctx, req,
+			       blobmsg_get_string(tb[SCHEDULE_DEVICE_ID]),
+			       blobmsg_get_u32(tb[SCHEDULE_PIN]),
+			       blobmsg_get_bool(tb[SCHEDULE_STATE]), delay_ms,
+			       0);
+}
+
+static void add_scheduled_action(const struct scheduled_action_info *info,
+				 void *priv)
+{
+	struct blob_buf *b = priv;
+	void *table = blobmsg_open_table(b, NULL);
+	blobmsg_add_u32(b, "id", info->id);
+	blobmsg_add_string(b, "device", info->device);
+	blobmsg_add_u32(b, "pin", info->pin);
+	blobmsg_add_u8(b, "state", info->state);
+	blobmsg_add_u64(b, "due_in_ms", (uint64_t)info->due_in_ms);
+	if (info->pulse_ms != 0) {
+		blobmsg_add_u32(b, "pulse_ms", info->pulse_ms);
+	}
+	blobmsg_add_u32(b, "attempts", info->attempts);
+	blobmsg_close_table(b, table);
+}
+
+// List pin changes that have not been executed yet.
+static int list_scheduled(struct ubus_context *ctx, struct ubus_object *obj,
+			  struct ubus_request_data *req, const char *method,
+			  struct blob_attr *msg)
+{
+	(void)obj;
+	(void)msg;
+	syslog(LOG_DEBUG, "Received ubus message of type '%s'", method);
+
+	struct blob_buf *b = reply_buf_init();
+	void *array = blobmsg_open_array(b, "actions");
+	schedule_foreach(add_scheduled_action, b);
+	blobmsg_close_array(b, array);
+	int ret = ubus_send_reply(ctx, req, b->head);
+	if (ret != UBUS_STATUS_OK) {
+		syslog(LOG_ERR, "Failed to send ubus reply: %s",
+		       ubus_strerror(ret));
+	}
+	return ret;
+}
+
+// Cancel a scheduled pin change.
+static int cancel_scheduled(struct ubus_context *ctx,
+			    struct ubus_object *obj,
+			    struct ubus_request_data *req, const char *method,
+			    struct blob_attr *msg)
+{
+	(void)obj;
+	syslog(LOG_DEBUG, "Received ubus message of type '%s'", method);
+
+	struct blob_attr *tb[__CANCEL_MAX];
+	blobmsg_parse(cancel_policy, __CANCEL_MAX, tb, blob_data(msg),
+		      blob_len(msg));
+	if (tb[CANCEL_ID] == NULL) {
+		syslog(LOG_WARNING, "Failed to parse ubus message");
+		return UBUS_STATUS_INVALID_ARGUMENT;
+	}
+	if (!schedule_cancel(blobmsg_get_u32(tb[CANCEL_ID]))) {
+		return send_status_reply(ctx, req, DEVCTL_OPERATION_FAILED,
+					 "No such action");
+	}
+	return send_status_reply(ctx, req, DEVCTL_OK, "Action cancelled");
+}
+
+// Queue a pin command without waiting for the device. The reply is sent
+// right away with the sequence number of the command, errors are reported
+// later with stream.error events and by stream_status.
+static int stream_pin(struct ubus_context *ctx, struct ubus_object *obj,
+		      struct ubus_request_data *req, const char *method,
+		      struct blob_attr *msg)
+{
+	(void)obj;
+	syslog(LOG_DEBUG, "Received ubus message of type '%s'", method);
+
+	struct blob_attr *tb[__STREAM_MAX];
+	blobmsg_parse(stream_policy, __STREAM_MAX, tb, blob_data(msg),
+		      blob_len(msg));
+	if (tb[STREAM_DEVICE_ID] == NULL || tb[STREAM_PIN] == NULL ||
+	    tb[STREAM_STATE] == NULL) {
+		syslog(LOG_WARNING, "Failed to parse ubus message");
+		return UBUS_STATUS_INVALID_ARGUMENT;
+	}
+	enum serial_priority priority;
+	if (!get_priority_arg(tb[STREAM_PRIORITY], &priority)) {
+		return UBUS_STATUS_INVALID_ARGUMENT;
+	}
+	const char *dev_name = blobmsg_get_string(tb[STREAM_DEVICE_ID]);
+	const char *dev_id = resolve_device(dev_name);
+	if (dev_id == NULL) {
+		syslog(LOG_WARNING, "Device %s is not connected", dev_name);
+		return send_status_reply(ctx, req, DEVCTL_CONNECT_FAIL,
+					 "Device is not connected");
+	}
+
+	uint32_t seq;
+	int ret = stream_send(dev_id, blobmsg_get_u32(tb[STREAM_PIN]),
+			      blobmsg_get_bool(tb[STREAM_STATE]), priority,
+			      &seq);
+	if (ret == -1) {
+		return send_status_reply(ctx, req, DEVCTL_SEND_FAIL,
+					 "Too many stream commands in flight");
+	} else if (ret != 0) {
+		return UBUS_STATUS_NO_MEMORY;
+	}
+	struct blob_buf *b = reply_buf_init();
+	add_ubus_response(b, DEVCTL_OK, "Command queued");
+	blobmsg_add_u32(b, "seq", seq);
+	ret = ubus_send_reply(ctx, req, b->head);
+	if (ret != UBUS_STATUS_OK) {
+		syslog(LOG_ERR, "Failed to send ubus reply: %s",
+		       ubus_strerror(ret));
+	}
+	return ret;
+}
+
+static void add_stream_error(const struct stream_error *err, void *priv)
+{
+	struct blob_buf *b = priv;
+	void *table = blobmsg_open_table(b, NULL);
+	blobmsg_add_u32(b, "seq", err->seq);
+	blobmsg_add_u32(b, "pin", err->pin);
+	blobmsg_add_u8(b, "state", err->state);
+	blobmsg_add_string(b, "error", err->error);
+	blobmsg_close_table(b, table);
+}
+
+// Report how far the stream of a device is acknowledged and its recent
+// errors.
+static int stream_status(struct ubus_context *ctx, struct ubus_object *obj,
+			 struct ubus_request_data *req, const char *method,
+			 struct blob_attr *msg)
+{
+	(void)obj;
+	syslog(LOG_DEBUG, "Received ubus message of type '%s'", method);
+
+	struct blob_attr *tb[__DEV_MAX];
+	blobmsg_parse(device_policy, __DEV_MAX, tb, blob_data(msg),
+		      blob_len(msg));
+	if (tb[DEV_DEVICE_ID] == NULL) {
+		syslog(LOG_WARNING, "Failed to parse ubus message");
+		return UBUS_STATUS_INVALID_ARGUMENT;
+	}
+	const char *dev_id =
+		resolve_cached_device(blobmsg_get_string(tb[DEV_DEVICE_ID]));
+	struct stream_info info;
+	if (!stream_get_info(dev_id, &info)) {
+		return send_status_reply(ctx, req, DEVCTL_OPERATION_FAILED,
+					 "Nothing was streamed to the device");
+	}
+	struct blob_buf *b = reply_buf_init();
+	blobmsg_add_string(b, "device", dev_id);
+	blobmsg_add_u32(b, "last_seq", info.last_seq);
+	blobmsg_add_u32(b, "reconciled_seq", info.reconciled_seq);
+	blobmsg_add_u32(b, "in_flight", info.in_flight);
+	blobmsg_add_u32(b, "acked", info.acked);
+	blobmsg_add_u32(b, "failed", info.failed);
+	blobmsg_add_u32(b, "dropped", info.dropped);
+	void *array = blobmsg_open_array(b, "errors");
+	stream_foreach_error(dev_id, add_stream_error, b);
+	blobmsg_close_array(b, array);
+	int ret = ubus_send_reply(ctx, req, b->head);
+	if (ret != UBUS_STATUS_OK) {
+		syslog(LOG_ERR, "Failed to send ubus reply: %s",
+		       ubus_strerror(ret));
+	}
+	return ret;
+}
+
+static void add_device_health(const char *device,
+			      const struct serial_health *health, void *priv)
+{
+	struct blob_buf *b = priv;
+	void *table = blobmsg_open_table(b, NULL);
+	blobmsg_add_string(b, "device", device);
+	blobmsg_add_string(b, "health", serial_health_name(health->state));
+	if (health->srtt_us != 0) {
+		blobmsg_add_u32(b, "rtt_us", health->srtt_us);
+		blobmsg_add_u32(b, "rttvar_us", health->rttvar_us);
+		blobmsg_add_u32(b, "last_rtt_us", health->last_rtt_us);
+	}
+	blobmsg_add_u32(b, "misses", health->misses);
+	blobmsg_add_u64(b, "probes", health->probes);
+	if (health->idle_ms >= 0) {
+		blobmsg_add_u64(b, "idle_ms", (uint64_t)health->idle_ms);
+	}
+	blobmsg_close_table(b, table);
+}
+
+// Get the health of a single device, or of all devices that requests
+// were sent to. Served from the estimates kept by the serial module, the
+// devices are not contacted.
+static int device_health(struct ubus_context *ctx, struct ubus_object *obj,
+			 struct ubus_request_data *req, const char *method,
+			 struct blob_attr *msg)
+{
+	(void)obj;
+	syslog(LOG_DEBUG, "Received ubus message of type '%s'", method);
+
+	struct blob_attr *tb[__DEV_MAX];
+	blobmsg_parse(device_policy, __DEV_MAX, tb, blob_data(msg),
+		      blob_len(msg));
+
+	struct blob_buf *b = reply_buf_init();
+	void *array = blobmsg_open_array(b, "devices");
+	if (tb[DEV_DEVICE_ID] != NULL) {
+		const char *dev_id = resolve_cached_device(
+			blobmsg_get_string(tb[DEV_DEVICE_ID]));
+		struct serial_health health;
+		if (!serial_get_health(dev_id, &health)) {
+			return UBUS_STATUS_NOT_FOUND;
+		}
+		add_device_health(dev_id, &health, b);
+	} else {
+		serial_foreach_health(add_device_health, b);
+	}
+	blobmsg_close_array(b, array);
+
+	int ret = ubus_send_reply(ctx, req, b->head);
+	if (ret != UBUS_STATUS_OK) {
+		syslog(LOG_ERR, "Failed to send ubus reply: %s",
+		       ubus_strerror(ret));
+	}
+	return ret;
+}
+
+static int reload(struct ubus_context *ctx, struct ubus_object *obj,
+		  struct ubus_request_data *req, const char *method,
+		  struct blob_attr *msg)
+{
+	(void)obj;
+	(void)msg;
+	syslog(LOG_DEBUG, "Received ubus message of type '%s'", method);
+
+	if (!load_config(true)) {
+		return send_status_reply(ctx, req, DEVCTL_OPERATION_FAILED,
+					 "Invalid configuration, see the log");
+	}
+	return send_status_reply(ctx, req, DEVCTL_OK,
+				 "Configuration reloaded");
+}
+
 bool init_ubus(struct ubus_context **ubus_ctx)
 {
 	uloop_init();
@@ -345,7 +1484,17 @@ bool init_ubus(struct ubus_context **ubus_ctx)
 	if (ret != 0) {
 		syslog(LOG_ERR, "Error adding ubus object: %s",
 		       ubus_strerror(ret));
+	} else {
+		events_init(*ubus_ctx, &devctl_object);
 	}
 
 	return true;
 }
+
+void free_ubus(struct ubus_context *ubus_ctx)
+{
+	ubus_free(ubus_ctx);
+	blob_buf_free(&reply_buf);
+	arena_release();
+}
+
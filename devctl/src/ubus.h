@@ -10,4 +10,10 @@
  */
 bool init_ubus(struct ubus_context **ubus_ctx);
 
+/*
+ * Disconnects from ubus and frees the memory kept for handling requests.
+ * Requests must no longer be in progress.
+ */
+void free_ubus(struct ubus_context *ubus_ctx);
+
 #endif
@@ -0,0 +1,229 @@
+// Checks the results of pin commands that are coalesced while the device
+// is busy. A pseudo terminal plays the device and answers every command
+// like the firmware does.
+//
+// Usage: coalesce-test, exits with status 0 if all checks pass.
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <termios.h>
+#include <unistd.h>
+
+#include <libubox/uloop.h>
+
+#include "args.h"
+#include "devices.h"
+#include "events.h"
+#include "record.h"
+#include "result.h"
+#include "serial.h"
+
+// Gives up if the commands are not completed by then.
+#define TEST_TIMEOUT_MS 2000
+#define MAX_REQS 8
+
+// The parts of devctl that serial.c and result.c depend on, not used by
+// the test.
+struct devctl_config config;
+struct avl_tree devices;
+
+const struct device_config *find_config_for_device(const char *path)
+{
+	(void)path;
+	return NULL;
+}
+
+void event_pin_changed(const char *device, uint32_t pin, bool on)
+{
+	(void)device;
+	(void)pin;
+	(void)on;
+}
+
+void event_device_failing(const char *device, int status)
+{
+	(void)device;
+	(void)status;
+}
+
+void event_device_recovered(const char *device)
+{
+	(void)device;
+}
+
+void event_device_health(const char *device, const char *health,
+			 uint32_t rtt_us)
+{
+	(void)device;
+	(void)health;
+	(void)rtt_us;
+}
+
+void record_frame(enum record_type type, const char *device,
+		  const void *data, size_t len)
+{
+	(void)type;
+	(void)device;
+	(void)data;
+	(void)len;
+}
+
+struct test_req {
+	struct serial_req sreq;
+	const char *name;
+	bool turn_on;
+	bool done;
+	struct pin_result res;
+};
+
+static struct test_req reqs[MAX_REQS];
+static size_t num_reqs;
+static unsigned int num_done;
+static unsigned int commands_received;
+static struct uloop_fd board = { .fd = -1 };
+// Command being received from devctl.
+static char line[256];
+static size_t line_len;
+
+static void req_cb(struct serial_req *sreq, int status)
+{
+	struct test_req *req = container_of(sreq, struct test_req, sreq);
+	get_req_result(&req->res, sreq, status, req->turn_on);
+	req->done = true;
+	if (++num_done == num_reqs) {
+		uloop_end();
+	}
+}
+
+static void send_pin(const char *device, const char *name, uint32_t pin,
+		     bool turn_on)
+{
+	struct test_req *req = &reqs[num_reqs++];
+	req->name = name;
+	req->turn_on = turn_on;
+	req->sreq.cb = req_cb;
+	serial_format_pin_command(&req->sreq, pin, turn_on);
+	serial_send(device, &req->sreq);
+}
+
+// Answers every received command like the firmware.
+static void board_cb(struct uloop_fd *u, unsigned int events)
+{
+	(void)events;
+	char buf[256];
+	ssize_t len = read(u->fd, buf, sizeof(buf));
+	for (ssize_t i = 0; i < len; ++i) {
+		// Commands are single JSON objects without a terminator.
+		if (line_len < sizeof(line) - 1) {
+			line[line_len++] = buf[i];
+		}
+		if (buf[i] != '}') {
+			continue;
+		}
+		line[line_len] = '\0';
+		line_len = 0;
+		commands_received += 1;
+		const char *msg = strstr(line, "\"on\"") != NULL ?
+					  "Pin was turned on" :
+					  "Pin was turned off";
+		dprintf(u->fd, "{\"response\": 0, \"msg\": \"%s\"}\r\n",
+			msg);
+	}
+}
+
+static void timeout_cb(struct uloop_timeout *t)
+{
+	(void)t;
+	fprintf(stderr, "Timed out waiting for the commands\n");
+	uloop_end();
+}
+
+// Opens a pseudo terminal for the board and returns the name of the
+// device side, NULL on failure.
+static const char *open_board(void)
+{
+	board.fd = posix_openpt(O_RDWR | O_NOCTTY);
+	if (board.fd == -1 || grantpt(board.fd) != 0 ||
+	    unlockpt(board.fd) != 0) {
+		perror("Failed to open pseudo terminal");
+		return NULL;
+	}
+	struct termios tio;
+	tcgetattr(board.fd, &tio);
+	cfmakeraw(&tio);
+	tcsetattr(board.fd, TCSANOW, &tio);
+	board.cb = board_cb;
+	uloop_fd_add(&board, ULOOP_READ);
+	return ptsname(board.fd);
+}
+
+static bool check(bool ok, const char *what)
+{
+	if (!ok) {
+		fprintf(stderr, "FAIL: %s\n", what);
+	}
+	return ok;
+}
+
+int main(void)
+{
+	uloop_init();
+	const char *device = open_board();
+	if (device == NULL) {
+		return EXIT_FAILURE;
+	}
+
+	// Keeps the device busy, so that the commands below are queued.
+	send_pin(device, "busy", 5, true);
+	// Superseded twice, the pin ends up in the state it asked for.
+	send_pin(device, "on 1", 1, true);
+	send_pin(device, "off 1", 1, false);
+	send_pin(device, "on 1 again", 1, true);
+	// Merged, then superseded together.
+	send_pin(device, "on 2", 2, true);
+	send_pin(device, "on 2 merged", 2, true);
+	send_pin(device, "off 2", 2, false);
+
+	struct uloop_timeout timeout = { .cb = timeout_cb };
+	uloop_timeout_set(&timeout, TEST_TIMEOUT_MS);
+	uloop_run();
+
+	bool ok = true;
+	for (size_t i = 0; i < num_reqs; ++i) {
+		if (!reqs[i].done) {
+			fprintf(stderr, "FAIL: %s was not completed\n",
+				reqs[i].name);
+			ok = false;
+		} else if (reqs[i].res.status != DEVCTL_OK) {
+			fprintf(stderr, "FAIL: %s got status %d: %s\n",
+				reqs[i].name, reqs[i].res.status,
+				reqs[i].res.message);
+			ok = false;
+		}
+	}
+	ok &= check(reqs[1].sreq.superseded && reqs[2].sreq.superseded &&
+			    !reqs[3].sreq.superseded,
+		    "on 1 and off 1 are superseded");
+	ok &= check(reqs[4].sreq.superseded && reqs[5].sreq.superseded &&
+			    !reqs[6].sreq.superseded,
+		    "on 2 and its follower are superseded");
+	ok &= check(commands_received == 3, "three commands were sent");
+	const struct device_stats *stats = serial_get_stats(device);
+	ok &= check(stats != NULL && stats->superseded == 4,
+		    "every superseded command is counted once");
+
+	close_serial_devs();
+	uloop_done();
+	close(board.fd);
+	if (!ok) {
+		return EXIT_FAILURE;
+	}
+	printf("All checks passed\n");
+	return EXIT_SUCCESS;
+}
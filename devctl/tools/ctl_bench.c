@@ -0,0 +1,440 @@
+// Load generator for the control socket of devctl (option ctl_socket).
+// Keeps a fixed number of pin commands pipelined on a single connection
+// and reports throughput and latency percentiles, for comparison with
+// loadgen, which goes through ubus.
+//
+// Usage: see usage() or run ctl-bench -h.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <errno.h>
+#include <limits.h>
+#include <time.h>
+
+#include <poll.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "ctl_proto.h"
+
+#define MAX_DEVICES 256
+#define DEFAULT_CONCURRENCY 32
+#define DEFAULT_DURATION_S 10
+#define DEFAULT_PINS 17
+// Replies with a devctl status code above this are counted together.
+#define MAX_STATUS 15
+#define RX_BUFSIZE 65536
+#define TX_BUFSIZE (CTL_MAX_IN_FLIGHT * (2 + CTL_REQ_SIZE + CTL_NAME_MAXLEN))
+
+// Request slot, one request is in flight per slot at a time. The slot
+// index is the tag of the request.
+struct slot {
+	uint64_t start_us;
+	bool busy;
+};
+
+static struct settings {
+	const char *devices[MAX_DEVICES];
+	unsigned int num_devices;
+	unsigned int concurrency;
+	unsigned int duration_s;
+	// Stop after this many requests if not 0.
+	unsigned long max_requests;
+	unsigned int num_pins;
+	enum ctl_op op;
+	unsigned int priority;
+	const char *socket_path;
+} settings = {
+	.concurrency = DEFAULT_CONCURRENCY,
+	.duration_s = DEFAULT_DURATION_S,
+	.num_pins = DEFAULT_PINS,
+	.op = CTL_OP_SET_PIN,
+	// SERIAL_PRIORITY_NORMAL
+	.priority = 1,
+};
+
+static struct slot slots[CTL_MAX_IN_FLIGHT];
+static uint32_t *latencies;
+static size_t num_latencies;
+static unsigned long statuses[MAX_STATUS + 1];
+static unsigned long num_started;
+static unsigned int next_device;
+static uint64_t rng_state;
+static unsigned char tx[TX_BUFSIZE];
+static size_t tx_len;
+static unsigned char rx[RX_BUFSIZE];
+static size_t rx_len;
+
+static uint64_t now_us(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + (uint64_t)ts.tv_nsec / 1000;
+}
+
+// xorshift64*
+static uint64_t rng_next(void)
+{
+	rng_state ^= rng_state >> 12;
+	rng_state ^= rng_state << 25;
+	rng_state ^= rng_state >> 27;
+	return rng_state * 2685821657736338717ULL;
+}
+
+static void put_le(unsigned char *p, uint32_t val, size_t len)
+{
+	for (size_t i = 0; i < len; ++i) {
+		p[i] = (unsigned char)(val >> (8 * i));
+	}
+}
+
+static uint32_t get_le(const unsigned char *p, size_t len)
+{
+	uint32_t val = 0;
+	for (size_t i = 0; i < len; ++i) {
+		val |= (uint32_t)p[i] << (8 * i);
+	}
+	return val;
+}
+
+// Appends a request to tx for the slot.
+static void start_request(uint32_t tag)
+{
+	const char *device = "";
+	if (settings.op != CTL_OP_PING) {
+		device = settings.devices[next_device];
+		next_device = (next_device + 1) % settings.num_devices;
+	}
+	size_t name_len = strlen(device);
+	unsigned char *p = tx + tx_len;
+	put_le(p, (uint32_t)(CTL_REQ_SIZE + name_len), 2);
+	p[2] = (unsigned char)settings.op;
+	p[3] = rng_next() & 1 ? CTL_FLAG_ON : 0;
+	put_le(p + 4, (uint32_t)(rng_next() % settings.num_pins), 2);
+	put_le(p + 6, tag, 4);
+	p[10] = (unsigned char)settings.priority;
+	p[11] = (unsigned char)name_len;
+	put_le(p + 12, 0, 2);
+	memcpy(p + 14, device, name_len);
+	tx_len += 2 + CTL_REQ_SIZE + name_len;
+
+	slots[tag].busy = true;
+	slots[tag].start_us = now_us();
+	num_started += 1;
+}
+
+static bool record_latency(uint32_t latency)
+{
+	static size_t capacity;
+	if (num_latencies == capacity) {
+		size_t new_capacity = capacity != 0 ? capacity * 2 : 65536;
+		uint32_t *p = realloc(latencies, new_capacity * sizeof(*p));
+		if (p == NULL) {
+			fprintf(stderr, "Out of memory\n");
+			return false;
+		}
+		latencies = p;
+		capacity = new_capacity;
+	}
+	latencies[num_latencies++] = latency;
+	return true;
+}
+
+// Handles the complete replies in rx.
+// Returns the number of requests completed, -1 on error.
+static int handle_replies(void)
+{
+	int completed = 0;
+	size_t pos = 0;
+	while (rx_len - pos >= 2 + CTL_REPLY_SIZE) {
+		size_t len = get_le(rx + pos, 2);
+		if (len != CTL_REPLY_SIZE) {
+			fprintf(stderr, "Unexpected reply length %zu\n", len);
+			return -1;
+		}
+		const unsigned char *body = rx + pos + 2;
+		uint32_t tag = get_le(body + 4, 4);
+		if (tag >= settings.concurrency || !slots[tag].busy) {
+			fprintf(stderr, "Reply with unexpected tag %u\n", tag);
+			return -1;
+		}
+		slots[tag].busy = false;
+		unsigned int status = body[1];
+		statuses[status < MAX_STATUS ? status : MAX_STATUS] += 1;
+		uint64_t latency = now_us() - slots[tag].start_us;
+		if (!record_latency((uint32_t)latency)) {
+			return -1;
+		}
+		completed += 1;
+		pos += 2 + CTL_REPLY_SIZE;
+	}
+	rx_len -= pos;
+	memmove(rx, rx + pos, rx_len);
+	return completed;
+}
+
+static int compare_u32(const void *a, const void *b)
+{
+	uint32_t x = *(const uint32_t *)a;
+	uint32_t y = *(const uint32_t *)b;
+	return (x > y) - (x < y);
+}
+
+static double percentile(double fraction)
+{
+	size_t i = (size_t)((double)num_latencies * fraction);
+	if (i >= num_latencies) {
+		i = num_latencies - 1;
+	}
+	return (double)latencies[i] / 1000;
+}
+
+static void print_results(double elapsed_s)
+{
+	if (num_latencies == 0) {
+		printf("No replies\n");
+		return;
+	}
+	qsort(latencies, num_latencies, sizeof(*latencies), compare_u32);
+	unsigned long failed = 0;
+	for (int s = 1; s <= MAX_STATUS; ++s) {
+		failed += statuses[s];
+	}
+	printf("%8s %8s %9s %9s %9s %9s\n", "requests", "failed", "p50 ms",
+	       "p99 ms", "p999 ms", "max ms");
+	printf("%8zu %8lu %9.2f %9.2f %9.2f %9.2f\n", num_latencies, failed,
+	       percentile(0.5), percentile(0.99), percentile(0.999),
+	       (double)latencies[num_latencies - 1] / 1000);
+	for (int s = 1; s <= MAX_STATUS; ++s) {
+		if (statuses[s] != 0) {
+			printf("status %d%s: %lu\n", s, s == MAX_STATUS ? "+" : "",
+			       statuses[s]);
+		}
+	}
+	printf("devices: %u, concurrency: %u, elapsed: %.2f s, throughput: %.1f req/s\n",
+	       settings.num_devices, settings.concurrency, elapsed_s,
+	       elapsed_s > 0 ? (double)num_latencies / elapsed_s : 0);
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr,
+		"Usage: %s -S <socket> [options]\n"
+		"  -S <socket>   control socket of devctl (option ctl_socket)\n"
+		"  -d <device>   device to send commands to, can be repeated;\n"
+		"                required unless -o ping is given\n"
+		"  -c <count>    requests in flight (default %d, max %d)\n"
+		"  -t <seconds>  duration (default %d)\n"
+		"  -n <count>    stop after this many requests\n"
+		"  -p <count>    pins to use per device (default %d)\n"
+		"  -o <op>       set (default), get or ping\n"
+		"  -P <class>    priority of pin commands: high, normal or low\n",
+		prog, DEFAULT_CONCURRENCY, CTL_MAX_IN_FLIGHT,
+		DEFAULT_DURATION_S, DEFAULT_PINS);
+}
+
+static bool parse_uint(const char *str, unsigned long max,
+		       unsigned long *result)
+{
+	char *end;
+	errno = 0;
+	unsigned long val = strtoul(str, &end, 10);
+	if (errno != 0 || end == str || *end != '\0' || val > max) {
+		return false;
+	}
+	*result = val;
+	return true;
+}
+
+static bool parse_name(const char *str, const char *const *names,
+		       unsigned int num_names, unsigned int *result)
+{
+	for (unsigned int i = 0; i < num_names; ++i) {
+		if (strcmp(str, names[i]) == 0) {
+			*result = i;
+			return true;
+		}
+	}
+	return false;
+}
+
+static bool parse_args(int argc, char *argv[])
+{
+	static const char *const op_names[] = { "ping", "set", "get" };
+	static const char *const priority_names[] = { "high", "normal",
+						      "low" };
+	unsigned long val;
+	unsigned int index = 0;
+	int opt;
+	while ((opt = getopt(argc, argv, "S:d:c:t:n:p:o:P:h")) != -1) {
+		bool ok = true;
+		switch (opt) {
+		case 'S':
+			settings.socket_path = optarg;
+			break;
+		case 'd':
+			ok = settings.num_devices < MAX_DEVICES &&
+			     strlen(optarg) <= CTL_NAME_MAXLEN;
+			if (ok) {
+				settings.devices[settings.num_devices++] =
+					optarg;
+			}
+			break;
+		case 'c':
+			ok = parse_uint(optarg, CTL_MAX_IN_FLIGHT, &val) &&
+			     val > 0;
+			settings.concurrency = (unsigned int)val;
+			break;
+		case 't':
+			ok = parse_uint(optarg, INT_MAX / 1000, &val);
+			settings.duration_s = (unsigned int)val;
+			break;
+		case 'n':
+			ok = parse_uint(optarg, ULONG_MAX, &val);
+			settings.max_requests = val;
+			break;
+		case 'p':
+			ok = parse_uint(optarg, 65536, &val) && val > 0;
+			settings.num_pins = (unsigned int)val;
+			break;
+		case 'o':
+			ok = parse_name(optarg, op_names, 3, &index);
+			settings.op = (enum ctl_op)index;
+			break;
+		case 'P':
+			ok = parse_name(optarg, priority_names, 3,
+					&settings.priority);
+			break;
+		default:
+			return false;
+		}
+		if (!ok) {
+			fprintf(stderr, "Invalid value for -%c: %s\n", opt,
+				optarg);
+			return false;
+		}
+	}
+	return optind == argc && settings.socket_path != NULL &&
+	       (settings.num_devices > 0 || settings.op == CTL_OP_PING);
+}
+
+static int connect_socket(const char *path)
+{
+	struct sockaddr_un addr = { .sun_family = AF_UNIX };
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		fprintf(stderr, "Socket path is too long\n");
+		return -1;
+	}
+	strcpy(addr.sun_path, path);
+	int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0);
+	if (fd == -1) {
+		perror("socket");
+		return -1;
+	}
+	if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+		perror(path);
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+static bool may_start(uint64_t end_us)
+{
+	return (settings.max_requests == 0 ||
+		num_started < settings.max_requests) &&
+	       (settings.duration_s == 0 || now_us() < end_us);
+}
+
+// Sends requests and handles replies until the duration or the request
+// count is reached and all replies are in.
+// Returns false on error.
+static bool run(int fd, uint64_t end_us)
+{
+	unsigned int in_flight = 0;
+	for (uint32_t i = 0; i < settings.concurrency && may_start(end_us);
+	     ++i) {
+		start_request(i);
+		in_flight += 1;
+	}
+	while (in_flight > 0 || tx_len > 0) {
+		struct pollfd pfd = { .fd = fd, .events = POLLIN };
+		if (tx_len > 0) {
+			pfd.events |= POLLOUT;
+		}
+		if (poll(&pfd, 1, -1) == -1) {
+			if (errno == EINTR) {
+				continue;
+			}
+			perror("poll");
+			return false;
+		}
+		if (pfd.revents & POLLOUT) {
+			ssize_t len = send(fd, tx, tx_len, MSG_NOSIGNAL);
+			if (len == -1 && errno != EAGAIN) {
+				perror("send");
+				return false;
+			}
+			if (len > 0) {
+				tx_len -= (size_t)len;
+				memmove(tx, tx + len, tx_len);
+			}
+		}
+		if (!(pfd.revents & (POLLIN | POLLHUP | POLLERR))) {
+			continue;
+		}
+		ssize_t len = read(fd, rx + rx_len, RX_BUFSIZE - rx_len);
+		if (len == 0) {
+			fprintf(stderr, "devctl closed the connection\n");
+			return false;
+		}
+		if (len == -1) {
+			if (errno == EAGAIN || errno == EINTR) {
+				continue;
+			}
+			perror("read");
+			return false;
+		}
+		rx_len += (size_t)len;
+		int completed = handle_replies();
+		if (completed == -1) {
+			return false;
+		}
+		in_flight -= (unsigned int)completed;
+		// Refill the free slots, each reply frees one.
+		for (uint32_t i = 0; i < settings.concurrency &&
+				     in_flight < settings.concurrency &&
+				     may_start(end_us);
+		     ++i) {
+			if (!slots[i].busy) {
+				start_request(i);
+				in_flight += 1;
+			}
+		}
+	}
+	return true;
+}
+
+int main(int argc, char *argv[])
+{
+	if (!parse_args(argc, argv)) {
+		usage(argv[0]);
+		return EXIT_FAILURE;
+	}
+	rng_state = now_us() | 1;
+
+	int fd = connect_socket(settings.socket_path);
+	if (fd == -1) {
+		return EXIT_FAILURE;
+	}
+	uint64_t start = now_us();
+	bool ok = run(fd, start + (uint64_t)settings.duration_s * 1000000);
+	print_results((double)(now_us() - start) / 1e6);
+	close(fd);
+	free(latencies);
+	return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,728 @@
+// Emulates NodeMCU boards running the esp_control_over_serial firmware on
+// pseudo-terminals, so that devctl can be exercised without hardware.
+//
+// Every simulated board gets a pseudo-terminal and a symlink
+// <dir>/ttySIM<n> pointing to its slave side. Add the symlinks to the devctl
+// configuration as static devices. After a simulated disconnect the board
+// comes back on a new pseudo-terminal and the symlink is updated, like a
+// board that was unplugged and plugged in again.
+//
+// With -r the boards replay a recording made by devctl (option
+// record_file) instead: there is a board for every recorded device, and
+// a command gets the response the device sent to the same command in the
+// recording, after the recorded latency or right away with -F. Repeated
+// commands get the recorded responses in order. Commands the device did
+// not answer in the recording are not answered either, commands that were
+// not recorded are answered like without -r.
+//
+// Usage: see usage() or run esp-sim -h.
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <ctype.h>
+#include <errno.h>
+#include <limits.h>
+#include <signal.h>
+#include <time.h>
+
+#include <fcntl.h>
+#include <poll.h>
+#include <termios.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "recording.h"
+
+#define MAX_BOARDS 256
+// Longest command accepted, longer commands are rejected.
+#define CMD_MAXLEN 128
+#define RESP_MAXLEN 128
+// Responses waiting to be sent per board.
+#define MAX_QUEUED 64
+#define DEFAULT_PINS 17
+#define DEFAULT_DIR "/tmp/esp-sim"
+#define DEFAULT_RECONNECT_MS 1000
+
+#define TURN_ON_PIN_SUCCESS_MSG "Pin was turned on"
+#define TURN_OFF_PIN_SUCCESS_MSG "Pin was turned off"
+
+struct response {
+	// When the response is written, CLOCK_MONOTONIC microseconds.
+	uint64_t due_us;
+	size_t len;
+	char msg[RESP_MAXLEN];
+};
+
+struct board {
+	// Master side of the pseudo-terminal, -1 while disconnected.
+	int master;
+	// The simulator keeps the slave side open as well. Otherwise the
+	// master gets a hangup every time devctl closes the connection.
+	int slave;
+	char link[PATH_MAX];
+	// Command being received.
+	char cmd[CMD_MAXLEN];
+	size_t cmd_len;
+	// Brace nesting depth of the command being received.
+	unsigned int depth;
+	// Command is too long, skip it.
+	bool discarding;
+	// Ring buffer of queued responses.
+	struct response queue[MAX_QUEUED];
+	size_t queue_head;
+	size_t queue_len;
+	// The firmware handles commands one by one. A command is not
+	// handled before the response to the previous one was sent.
+	uint64_t busy_until_us;
+	// When to reconnect after a disconnect.
+	uint64_t reconnect_us;
+	uint32_t pins_on;
+	// Recorded device replayed by the board, NULL if not replaying.
+	const struct rec_device *replay;
+	// Exchange after the last one replayed.
+	size_t replay_pos;
+};
+
+static struct settings {
+	unsigned int num_boards;
+	const char *dir;
+	unsigned int num_pins;
+	double latency_ms;
+	double jitter_ms;
+	// Probabilities per command, 0 - 1.
+	double drop;
+	double garble;
+	double disconnect;
+	unsigned int reconnect_ms;
+	uint64_t seed;
+	bool verbose;
+	// Recording to replay, NULL if not replaying.
+	const char *replay;
+	// Replay responses without the recorded latency.
+	bool fast;
+} settings = {
+	.num_boards = 1,
+	.dir = DEFAULT_DIR,
+	.num_pins = DEFAULT_PINS,
+	.reconnect_ms = DEFAULT_RECONNECT_MS,
+};
+
+static struct {
+	unsigned long commands;
+	unsigned long responses;
+	unsigned long dropped;
+	unsigned long garbled;
+	unsigned long disconnects;
+	// Responses lost because the pseudo-terminal buffer was full.
+	unsigned long overruns;
+	unsigned long bytes_in;
+	unsigned long bytes_out;
+	// Replayed commands that were not in the recording.
+	unsigned long unmatched;
+} stats;
+
+static struct board boards[MAX_BOARDS];
+static struct recording recording;
+static uint64_t rng_state;
+static volatile sig_atomic_t stop;
+static volatile sig_atomic_t print_stats_pending;
+
+static uint64_t now_us(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + (uint64_t)ts.tv_nsec / 1000;
+}
+
+// xorshift64*, good enough for fault injection and reproducible with
+// the same seed.
+static uint64_t rng_next(void)
+{
+	rng_state ^= rng_state >> 12;
+	rng_state ^= rng_state << 25;
+	rng_state ^= rng_state >> 27;
+	return rng_state * 2685821657736338717ULL;
+}
+
+// Returns a random number in [0, 1).
+static double rng_unit(void)
+{
+	return (double)(rng_next() >> 11) / (double)(1ULL << 53);
+}
+
+static bool chance(double probability)
+{
+	return probability > 0 && rng_unit() < probability;
+}
+
+static void print_stats(void)
+{
+	fprintf(stderr,
+		"commands: %lu, responses: %lu, dropped: %lu, garbled: %lu, "
+		"disconnects: %lu, overruns: %lu, bytes in: %lu, bytes out: %lu",
+		stats.commands, stats.responses, stats.dropped, stats.garbled,
+		stats.disconnects, stats.overruns, stats.bytes_in,
+		stats.bytes_out);
+	if (settings.replay != NULL) {
+		fprintf(stderr, ", not recorded: %lu", stats.unmatched);
+	}
+	fprintf(stderr, "\n");
+}
+
+static void reset_board_input(struct board *b)
+{
+	b->cmd_len = 0;
+	b->depth = 0;
+	b->discarding = false;
+}
+
+// Creates the pseudo-terminal and points the symlink to it.
+// Returns true on success.
+static bool connect_board(struct board *b)
+{
+	int master = posix_openpt(O_RDWR | O_NOCTTY | O_NONBLOCK | O_CLOEXEC);
+	if (master == -1) {
+		perror("posix_openpt");
+		return false;
+	}
+	char name[PATH_MAX];
+	if (grantpt(master) != 0 || unlockpt(master) != 0 ||
+	    ptsname_r(master, name, sizeof(name)) != 0) {
+		perror("Failed to set up pseudo-terminal");
+		close(master);
+		return false;
+	}
+	int slave = open(name, O_RDWR | O_NOCTTY | O_CLOEXEC);
+	if (slave == -1) {
+		perror(name);
+		close(master);
+		return false;
+	}
+	// Until devctl configures the port, the slave side would echo the
+	// responses back to the simulator.
+	struct termios tty;
+	if (tcgetattr(slave, &tty) == 0) {
+		cfmakeraw(&tty);
+		tcsetattr(slave, TCSANOW, &tty);
+	}
+	if (unlink(b->link) != 0 && errno != ENOENT) {
+		perror(b->link);
+	}
+	if (symlink(name, b->link) != 0) {
+		perror(b->link);
+		close(slave);
+		close(master);
+		return false;
+	}
+
+	b->master = master;
+	b->slave = slave;
+	b->reconnect_us = 0;
+	b->busy_until_us = 0;
+	b->queue_len = 0;
+	b->pins_on = 0;
+	reset_board_input(b);
+	printf("%s -> %s\n", b->link, name);
+	fflush(stdout);
+	return true;
+}
+
+static void disconnect_board(struct board *b, uint64_t now)
+{
+	close(b->master);
+	close(b->slave);
+	b->master = -1;
+	b->slave = -1;
+	unlink(b->link);
+	b->reconnect_us = now + (uint64_t)settings.reconnect_ms * 1000;
+	stats.disconnects += 1;
+	if (settings.verbose) {
+		fprintf(stderr, "%s: disconnected\n", b->link);
+	}
+}
+
+// Returns the value of "key" in the command, NULL if not found.
+static const char *find_value(const char *cmd, const char *key)
+{
+	char quoted[32];
+	snprintf(quoted, sizeof(quoted), "\"%s\"", key);
+	const char *p = strstr(cmd, quoted);
+	if (p == NULL) {
+		return NULL;
+	}
+	p += strlen(quoted);
+	while (isspace((unsigned char)*p)) {
+		++p;
+	}
+	if (*p != ':') {
+		return NULL;
+	}
+	++p;
+	while (isspace((unsigned char)*p)) {
+		++p;
+	}
+	return p;
+}
+
+// Executes the command and prepares the firmware response.
+static void execute_command(struct board *b, const char *cmd,
+			    struct response *resp)
+{
+	int status = 1;
+	const char *message = "Unknown action";
+	const char *action = find_value(cmd, "action");
+	const char *pin_str = find_value(cmd, "pin");
+	bool turn_on = action != NULL && strncmp(action, "\"on\"", 4) == 0;
+	bool turn_off = action != NULL && strncmp(action, "\"off\"", 5) == 0;
+	if (action == NULL) {
+		message = "Failed to parse command";
+	} else if (turn_on || turn_off) {
+		char *end = NULL;
+		long pin = pin_str != NULL ? strtol(pin_str, &end, 10) : -1;
+		if (pin_str == NULL || end == pin_str || pin < 0 ||
+		    pin >= (long)settings.num_pins) {
+			message = "Invalid pin";
+		} else if (turn_on) {
+			b->pins_on |= 1U << pin;
+			status = 0;
+			message = TURN_ON_PIN_SUCCESS_MSG;
+		} else {
+			b->pins_on &= ~(1U << pin);
+			status = 0;
+			message = TURN_OFF_PIN_SUCCESS_MSG;
+		}
+	}
+	int len = snprintf(resp->msg, sizeof(resp->msg),
+			   "{\"response\": %d, \"msg\": \"%s\"}\r\n", status,
+			   message);
+	resp->len = (size_t)len;
+}
+
+// Looks up the recorded exchange of the command, starting after the
+// exchange replayed last. Returns NULL if the command was not recorded.
+static const struct rec_exchange *find_exchange(struct board *b,
+						const char *cmd, size_t len)
+{
+	const struct rec_device *dev = b->replay;
+	for (size_t n = 0; n < dev->num_exchanges; ++n) {
+		size_t i = (b->replay_pos + n) % dev->num_exchanges;
+		const struct rec_exchange *ex = &dev->exchanges[i];
+		if (ex->cmd_len == len && memcmp(ex->cmd, cmd, len) == 0) {
+			b->replay_pos = i + 1;
+			return ex;
+		}
+	}
+	return NULL;
+}
+
+// Replaces a few bytes of the response with random ones. The line
+// terminator is kept, so the response still arrives as a single line.
+static void garble_response(struct response *resp)
+{
+	size_t body_len = resp->len - 2;
+	unsigned int n = 1 + (unsigned int)(rng_next() % 3);
+	for (unsigned int i = 0; i < n; ++i) {
+		size_t pos = (size_t)(rng_next() % body_len);
+		char c;
+		do {
+			c = (char)(rng_next() % 255 + 1);
+		} while (c == '\r' || c == '\n');
+		resp->msg[pos] = c;
+	}
+}
+
+static void handle_command(struct board *b, uint64_t now)
+{
+	b->cmd[b->cmd_len] = '\0';
+	stats.commands += 1;
+	if (settings.verbose) {
+		fprintf(stderr, "%s: < %s\n", b->link, b->cmd);
+	}
+	if (chance(settings.disconnect)) {
+		disconnect_board(b, now);
+		return;
+	}
+
+	struct response resp;
+	const struct rec_exchange *ex = NULL;
+	if (b->discarding) {
+		resp.len = (size_t)snprintf(
+			resp.msg, sizeof(resp.msg),
+			"{\"response\": 1, \"msg\": \"Command too long\"}\r\n");
+	} else if (b->replay != NULL &&
+		   (ex = find_exchange(b, b->cmd, b->cmd_len)) != NULL) {
+		if (ex->outcome != REC_RESPONDED) {
+			stats.dropped += 1;
+			return;
+		}
+		resp.len = (size_t)snprintf(resp.msg, sizeof(resp.msg),
+					    "%.*s\r\n", (int)ex->resp_len,
+					    ex->resp);
+		if (resp.len >= sizeof(resp.msg)) {
+			// Cut, but still a single line.
+			resp.len = sizeof(resp.msg) - 1;
+			memcpy(resp.msg + resp.len - 2, "\r\n", 2);
+		}
+	} else {
+		if (b->replay != NULL) {
+			stats.unmatched += 1;
+		}
+		execute_command(b, b->cmd, &resp);
+	}
+	if (ex != NULL) {
+		// The recorded latency already includes the time the device
+		// was busy with earlier commands, only the order is kept.
+		uint64_t due = now + (settings.fast ? 0 : ex->latency_us);
+		resp.due_us = due > b->busy_until_us ? due : b->busy_until_us;
+	} else {
+		double delay_ms = settings.latency_ms +
+				  (rng_unit() * 2 - 1) * settings.jitter_ms;
+		if (delay_ms < 0) {
+			delay_ms = 0;
+		}
+		uint64_t start =
+			b->busy_until_us > now ? b->busy_until_us : now;
+		resp.due_us = start + (uint64_t)(delay_ms * 1000);
+	}
+	b->busy_until_us = resp.due_us;
+
+	if (chance(settings.drop)) {
+		// The command was executed, only the response is lost.
+		stats.dropped += 1;
+		return;
+	}
+	if (chance(settings.garble)) {
+		garble_response(&resp);
+		stats.garbled += 1;
+	}
+	if (b->queue_len == MAX_QUEUED) {
+		stats.overruns += 1;
+		return;
+	}
+	size_t tail = (b->queue_head + b->queue_len) % MAX_QUEUED;
+	b->queue[tail] = resp;
+	b->queue_len += 1;
+}
+
+// Splits the input into commands. The firmware does not expect commands to
+// be terminated, a command ends with the closing brace of the JSON object.
+// Anything outside of braces is ignored.
+static void handle_input(struct board *b, const char *buf, size_t len,
+			 uint64_t now)
+{
+	for (size_t i = 0; i < len && b->master != -1; ++i) {
+		char c = buf[i];
+		if (b->depth == 0 && c != '{') {
+			continue;
+		}
+		if (c == '{') {
+			b->depth += 1;
+		} else if (c == '}') {
+			b->depth -= 1;
+		}
+		if (b->cmd_len < CMD_MAXLEN - 1) {
+			b->cmd[b->cmd_len++] = c;
+		} else {
+			b->discarding = true;
+		}
+		if (b->depth == 0) {
+			handle_command(b, now);
+			reset_board_input(b);
+		}
+	}
+}
+
+static void read_board(struct board *b, uint64_t now)
+{
+	char buf[512];
+	for (;;) {
+		ssize_t len = read(b->master, buf, sizeof(buf));
+		if (len > 0) {
+			stats.bytes_in += (unsigned long)len;
+			handle_input(b, buf, (size_t)len, now);
+			if (b->master == -1) {
+				return;
+			}
+			continue;
+		}
+		if (len == -1 && errno != EAGAIN && errno != EINTR) {
+			perror(b->link);
+		}
+		return;
+	}
+}
+
+// Writes the responses that are due. Returns the time the next response
+// is due, UINT64_MAX if none are queued.
+static uint64_t write_responses(struct board *b, uint64_t now)
+{
+	while (b->queue_len > 0) {
+		struct response *resp = &b->queue[b->queue_head];
+		if (resp->due_us > now) {
+			return resp->due_us;
+		}
+		ssize_t len = write(b->master, resp->msg, resp->len);
+		if (len == (ssize_t)resp->len) {
+			stats.responses += 1;
+			stats.bytes_out += (unsigned long)len;
+			if (settings.verbose) {
+				fprintf(stderr, "%s: > %.*s\n", b->link,
+					(int)resp->len - 2, resp->msg);
+			}
+		} else {
+			// Nobody reads the responses, the buffer is full.
+			stats.overruns += 1;
+		}
+		b->queue_head = (b->queue_head + 1) % MAX_QUEUED;
+		b->queue_len -= 1;
+	}
+	return UINT64_MAX;
+}
+
+static void run(void)
+{
+	struct pollfd fds[MAX_BOARDS];
+	struct board *fd_boards[MAX_BOARDS];
+	while (!stop) {
+		if (print_stats_pending) {
+			print_stats_pending = 0;
+			print_stats();
+		}
+		uint64_t now = now_us();
+		uint64_t next = UINT64_MAX;
+		nfds_t nfds = 0;
+		for (unsigned int i = 0; i < settings.num_boards; ++i) {
+			struct board *b = &boards[i];
+			if (b->master == -1 && b->reconnect_us <= now &&
+			    !connect_board(b)) {
+				// Try again later.
+				b->reconnect_us =
+					now + (uint64_t)settings.reconnect_ms *
+						      1000;
+			}
+			if (b->master == -1) {
+				if (b->reconnect_us < next) {
+					next = b->reconnect_us;
+				}
+				continue;
+			}
+			uint64_t due = write_responses(b, now);
+			if (due < next) {
+				next = due;
+			}
+			fds[nfds].fd = b->master;
+			fds[nfds].events = POLLIN;
+			fd_boards[nfds] = b;
+			nfds += 1;
+		}
+
+		int timeout = -1;
+		if (next != UINT64_MAX) {
+			// Round up, waking up early would just spin.
+			uint64_t wait_ms = (next - now + 999) / 1000;
+			timeout = wait_ms > INT_MAX ? INT_MAX : (int)wait_ms;
+		}
+		int ret = poll(fds, nfds, timeout);
+		if (ret == -1) {
+			if (errno != EINTR) {
+				perror("poll");
+				return;
+			}
+			continue;
+		}
+		now = now_us();
+		for (nfds_t i = 0; i < nfds; ++i) {
+			if (fds[i].revents != 0) {
+				read_board(fd_boards[i], now);
+			}
+		}
+	}
+}
+
+static void signal_handler(int sig)
+{
+	if (sig == SIGUSR1) {
+		print_stats_pending = 1;
+	} else {
+		stop = 1;
+	}
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr,
+		"Usage: %s [options]\n"
+		"  -n <count>    number of boards (default 1, max %d)\n"
+		"  -d <dir>      directory for the ttySIM<n> symlinks (default %s)\n"
+		"  -p <count>    number of pins per board (default %d, max 32)\n"
+		"  -l <ms>       response latency (default 0)\n"
+		"  -j <ms>       latency jitter, uniform +-ms (default 0)\n"
+		"  -D <percent>  responses dropped\n"
+		"  -G <percent>  responses garbled\n"
+		"  -X <percent>  commands that cause a disconnect\n"
+		"  -R <ms>       time until a disconnected board is back (default %d)\n"
+		"  -s <seed>     random seed\n"
+		"  -r <file>     replay a devctl recording, one board per device\n"
+		"  -F            replay without the recorded latency\n"
+		"  -v            print commands and responses\n"
+		"Statistics are printed on exit and on SIGUSR1.\n",
+		prog, MAX_BOARDS, DEFAULT_DIR, DEFAULT_PINS,
+		DEFAULT_RECONNECT_MS);
+}
+
+static bool parse_uint(const char *str, unsigned int max, unsigned int *result)
+{
+	char *end;
+	errno = 0;
+	unsigned long val = strtoul(str, &end, 10);
+	if (errno != 0 || end == str || *end != '\0' || val > max) {
+		return false;
+	}
+	*result = (unsigned int)val;
+	return true;
+}
+
+static bool parse_double(const char *str, double max, double *result)
+{
+	char *end;
+	errno = 0;
+	double val = strtod(str, &end);
+	if (errno != 0 || end == str || *end != '\0' || val < 0 || val > max) {
+		return false;
+	}
+	*result = val;
+	return true;
+}
+
+static bool parse_args(int argc, char *argv[])
+{
+	double percent;
+	int opt;
+	while ((opt = getopt(argc, argv, "n:d:p:l:j:D:G:X:R:s:r:Fvh")) != -1) {
+		bool ok = true;
+		switch (opt) {
+		case 'n':
+			ok = parse_uint(optarg, MAX_BOARDS,
+					&settings.num_boards) &&
+			     settings.num_boards > 0;
+			break;
+		case 'd':
+			settings.dir = optarg;
+			break;
+		case 'p':
+			ok = parse_uint(optarg, 32, &settings.num_pins);
+			break;
+		case 'l':
+			ok = parse_double(optarg, 1e6, &settings.latency_ms);
+			break;
+		case 'j':
+			ok = parse_double(optarg, 1e6, &settings.jitter_ms);
+			break;
+		case 'D':
+			ok = parse_double(optarg, 100, &percent);
+			settings.drop = percent / 100;
+			break;
+		case 'G':
+			ok = parse_double(optarg, 100, &percent);
+			settings.garble = percent / 100;
+			break;
+		case 'X':
+			ok = parse_double(optarg, 100, &percent);
+			settings.disconnect = percent / 100;
+			break;
+		case 'R':
+			ok = parse_uint(optarg, UINT_MAX / 1000,
+					&settings.reconnect_ms);
+			break;
+		case 's':
+			settings.seed = strtoull(optarg, NULL, 10);
+			break;
+		case 'r':
+			settings.replay = optarg;
+			break;
+		case 'F':
+			settings.fast = true;
+			break;
+		case 'v':
+			settings.verbose = true;
+			break;
+		default:
+			return false;
+		}
+		if (!ok) {
+			fprintf(stderr, "Invalid value for -%c: %s\n", opt,
+				optarg);
+			return false;
+		}
+	}
+	return optind == argc;
+}
+
+int main(int argc, char *argv[])
+{
+	if (!parse_args(argc, argv)) {
+		usage(argv[0]);
+		return EXIT_FAILURE;
+	}
+	rng_state = settings.seed != 0 ? settings.seed : now_us() | 1;
+	if (settings.replay != NULL) {
+		if (!recording_load(settings.replay, &recording)) {
+			recording_free(&recording);
+			return EXIT_FAILURE;
+		}
+		if (recording.num_devices == 0 ||
+		    recording.num_devices > MAX_BOARDS) {
+			fprintf(stderr, "Recording has %u devices\n",
+				recording.num_devices);
+			recording_free(&recording);
+			return EXIT_FAILURE;
+		}
+		settings.num_boards = recording.num_devices;
+	}
+
+	if (mkdir(settings.dir, 0755) != 0 && errno != EEXIST) {
+		perror(settings.dir);
+		return EXIT_FAILURE;
+	}
+	for (unsigned int i = 0; i < settings.num_boards; ++i) {
+		struct board *b = &boards[i];
+		b->master = -1;
+		b->slave = -1;
+		if ((size_t)snprintf(b->link, sizeof(b->link), "%s/ttySIM%u",
+				     settings.dir, i) >= sizeof(b->link)) {
+			fprintf(stderr, "Directory name is too long\n");
+			return EXIT_FAILURE;
+		}
+		if (settings.replay != NULL) {
+			b->replay = &recording.devices[i];
+			printf("%s replays %s\n", b->link, b->replay->name);
+		}
+		if (!connect_board(b)) {
+			return EXIT_FAILURE;
+		}
+	}
+
+	struct sigaction sa = { .sa_handler = signal_handler };
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+	sigaction(SIGUSR1, &sa, NULL);
+	signal(SIGPIPE, SIG_IGN);
+
+	run();
+
+	for (unsigned int i = 0; i < settings.num_boards; ++i) {
+		if (boards[i].master != -1) {
+			close(boards[i].master);
+			close(boards[i].slave);
+			unlink(boards[i].link);
+		}
+	}
+	print_stats();
+	recording_free(&recording);
+	return EXIT_SUCCESS;
+}
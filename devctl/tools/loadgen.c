@@ -0,0 +1,479 @@
+// Load generator for devctl. Keeps a fixed number of ubus requests in flight
+// against one or more devices and reports throughput and latency
+// percentiles. Meant to be used with esp-sim, but works with real boards
+// too.
+//
+// Usage: see usage() or run loadgen -h.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <errno.h>
+#include <limits.h>
+#include <time.h>
+
+#include <unistd.h>
+
+#include <libubus.h>
+#include <libubox/blobmsg.h>
+#include <libubox/uloop.h>
+
+#define MAX_DEVICES 256
+#define MAX_CONCURRENCY 1024
+#define DEFAULT_CONCURRENCY 8
+#define DEFAULT_DURATION_S 10
+#define DEFAULT_PINS 17
+#define LOOKUP_TIMEOUT_MS 3000
+// Replies with a devctl status code above this are counted together.
+#define MAX_STATUS 15
+
+enum op { OP_TURN_ON, OP_TURN_OFF, OP_LIST_DEVICES, __OP_MAX };
+
+static const char *const op_methods[__OP_MAX] = {
+	[OP_TURN_ON] = "turn_on_pin",
+	[OP_TURN_OFF] = "turn_off_pin",
+	[OP_LIST_DEVICES] = "list_devices",
+};
+
+// Request slot, one request is in flight per slot at a time.
+struct slot {
+	struct ubus_request req;
+	// Starts the next request. Not started directly from the completion
+	// callback, libubus still uses the request after it returns.
+	struct uloop_timeout next;
+	enum op op;
+	uint64_t start_us;
+	// devctl status code from the reply, 0 if the reply has none.
+	unsigned int status;
+};
+
+// Results of one kind of request.
+struct op_results {
+	// Latencies in microseconds, sorted before printing.
+	uint32_t *latencies;
+	size_t count;
+	size_t capacity;
+	unsigned long statuses[MAX_STATUS + 1];
+	// Requests that failed on the ubus level, e.g. timed out.
+	unsigned long ubus_errors;
+};
+
+static struct settings {
+	const char *devices[MAX_DEVICES];
+	unsigned int num_devices;
+	unsigned int concurrency;
+	unsigned int duration_s;
+	// Stop after this many requests if not 0.
+	unsigned long max_requests;
+	unsigned int num_pins;
+	// Relative weights of the request kinds.
+	unsigned int weights[__OP_MAX];
+	// Priority class of pin commands, devctl default if NULL.
+	const char *priority;
+	const char *ubus_socket;
+} settings = {
+	.concurrency = DEFAULT_CONCURRENCY,
+	.duration_s = DEFAULT_DURATION_S,
+	.num_pins = DEFAULT_PINS,
+	.weights = { 45, 45, 10 },
+};
+
+static struct ubus_context *ctx;
+static uint32_t devctl_id;
+static struct slot slots[MAX_CONCURRENCY];
+static struct op_results results[__OP_MAX];
+static struct uloop_timeout stop_timer;
+static bool running = true;
+static unsigned long num_started;
+static unsigned int num_in_flight;
+static unsigned int next_device;
+static uint64_t rng_state;
+// Devices discovered with list_devices, when none were given.
+static char *discovered[MAX_DEVICES];
+
+static uint64_t now_us(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + (uint64_t)ts.tv_nsec / 1000;
+}
+
+// xorshift64*
+static uint64_t rng_next(void)
+{
+	rng_state ^= rng_state >> 12;
+	rng_state ^= rng_state << 25;
+	rng_state ^= rng_state >> 27;
+	return rng_state * 2685821657736338717ULL;
+}
+
+static enum op pick_op(void)
+{
+	unsigned int total = 0;
+	for (int i = 0; i < __OP_MAX; ++i) {
+		total += settings.weights[i];
+	}
+	unsigned int r = (unsigned int)(rng_next() % total);
+	for (int i = 0; i < __OP_MAX; ++i) {
+		if (r < settings.weights[i]) {
+			return (enum op)i;
+		}
+		r -= settings.weights[i];
+	}
+	return OP_LIST_DEVICES;
+}
+
+static bool record_latency(struct op_results *res, uint32_t latency)
+{
+	if (res->count == res->capacity) {
+		size_t capacity = res->capacity != 0 ? res->capacity * 2 : 4096;
+		uint32_t *latencies =
+			realloc(res->latencies, capacity * sizeof(*latencies));
+		if (latencies == NULL) {
+			fprintf(stderr, "Out of memory\n");
+			return false;
+		}
+		res->latencies = latencies;
+		res->capacity = capacity;
+	}
+	res->latencies[res->count++] = latency;
+	return true;
+}
+
+static void reply_cb(struct ubus_request *req, int type, struct blob_attr *msg)
+{
+	(void)type;
+	struct slot *slot = container_of(req, struct slot, req);
+	enum { REPLY_STATUS, __REPLY_MAX };
+	static const struct blobmsg_policy reply_policy[] = {
+		[REPLY_STATUS] = { .name = "status",
+				   .type = BLOBMSG_TYPE_INT32 },
+	};
+	struct blob_attr *tb[__REPLY_MAX];
+	blobmsg_parse(reply_policy, __REPLY_MAX, tb, blob_data(msg),
+		      blob_len(msg));
+	if (tb[REPLY_STATUS] != NULL) {
+		slot->status = blobmsg_get_u32(tb[REPLY_STATUS]);
+	}
+}
+
+static void complete_cb(struct ubus_request *req, int ret)
+{
+	struct slot *slot = container_of(req, struct slot, req);
+	uint64_t latency = now_us() - slot->start_us;
+	struct op_results *res = &results[slot->op];
+	num_in_flight -= 1;
+	if (!record_latency(res, latency > UINT32_MAX ? UINT32_MAX :
+							(uint32_t)latency)) {
+		running = false;
+	}
+	if (ret != UBUS_STATUS_OK) {
+		res->ubus_errors += 1;
+	} else {
+		res->statuses[slot->status > MAX_STATUS ? MAX_STATUS :
+							  slot->status] += 1;
+	}
+	if (running) {
+		uloop_timeout_set(&slot->next, 0);
+	} else if (num_in_flight == 0) {
+		uloop_end();
+	}
+}
+
+static void start_request(struct uloop_timeout *t)
+{
+	struct slot *slot = container_of(t, struct slot, next);
+	if (!running || (settings.max_requests != 0 &&
+			 num_started >= settings.max_requests)) {
+		running = false;
+		if (num_in_flight == 0) {
+			uloop_end();
+		}
+		return;
+	}
+
+	struct blob_buf b = {};
+	blob_buf_init(&b, 0);
+	slot->op = pick_op();
+	if (slot->op != OP_LIST_DEVICES) {
+		blobmsg_add_string(&b, "device",
+				   settings.devices[next_device]);
+		next_device = (next_device + 1) % settings.num_devices;
+		blobmsg_add_u32(&b, "pin",
+				(uint32_t)(rng_next() % settings.num_pins));
+		if (settings.priority != NULL) {
+			blobmsg_add_string(&b, "priority", settings.priority);
+		}
+	}
+	slot->status = 0;
+	slot->start_us = now_us();
+	int ret = ubus_invoke_async(ctx, devctl_id, op_methods[slot->op],
+				    b.head, &slot->req);
+	blob_buf_free(&b);
+	if (ret != UBUS_STATUS_OK) {
+		fprintf(stderr, "Failed to send request: %s\n",
+			ubus_strerror(ret));
+		running = false;
+		if (num_in_flight == 0) {
+			uloop_end();
+		}
+		return;
+	}
+	slot->req.data_cb = reply_cb;
+	slot->req.complete_cb = complete_cb;
+	ubus_complete_request_async(ctx, &slot->req);
+	num_started += 1;
+	num_in_flight += 1;
+}
+
+static void stop_timer_cb(struct uloop_timeout *t)
+{
+	(void)t;
+	running = false;
+	if (num_in_flight == 0) {
+		uloop_end();
+	}
+}
+
+static void list_devices_cb(struct ubus_request *req, int type,
+			    struct blob_attr *msg)
+{
+	(void)req;
+	(void)type;
+	enum { LIST_DEVICES, __LIST_MAX };
+	static const struct blobmsg_policy list_policy[] = {
+		[LIST_DEVICES] = { .name = "devices",
+				   .type = BLOBMSG_TYPE_ARRAY },
+	};
+	struct blob_attr *tb[__LIST_MAX];
+	blobmsg_parse(list_policy, __LIST_MAX, tb, blob_data(msg),
+		      blob_len(msg));
+	struct blob_attr *cur;
+	unsigned int rem;
+	blobmsg_for_each_attr(cur, tb[LIST_DEVICES], rem)
+	{
+		if (settings.num_devices == MAX_DEVICES ||
+		    blobmsg_type(cur) != BLOBMSG_TYPE_STRING) {
+			continue;
+		}
+		char *name = strdup(blobmsg_get_string(cur));
+		if (name == NULL) {
+			continue;
+		}
+		discovered[settings.num_devices] = name;
+		settings.devices[settings.num_devices++] = name;
+	}
+}
+
+static int compare_u32(const void *a, const void *b)
+{
+	uint32_t x = *(const uint32_t *)a;
+	uint32_t y = *(const uint32_t *)b;
+	return (x > y) - (x < y);
+}
+
+// Returns the latency below which the given fraction of requests
+// completed, in milliseconds.
+static double percentile(const struct op_results *res, double fraction)
+{
+	size_t i = (size_t)((double)res->count * fraction);
+	if (i >= res->count) {
+		i = res->count - 1;
+	}
+	return (double)res->latencies[i] / 1000;
+}
+
+static void print_results(double elapsed_s)
+{
+	unsigned long total = 0;
+	printf("%-14s %8s %8s %8s %9s %9s %9s %9s\n", "method", "requests",
+	       "failed", "ubus err", "p50 ms", "p99 ms", "p999 ms", "max ms");
+	for (int i = 0; i < __OP_MAX; ++i) {
+		struct op_results *res = &results[i];
+		if (res->count == 0) {
+			continue;
+		}
+		qsort(res->latencies, res->count, sizeof(*res->latencies),
+		      compare_u32);
+		unsigned long failed = 0;
+		for (int s = 1; s <= MAX_STATUS; ++s) {
+			failed += res->statuses[s];
+		}
+		printf("%-14s %8zu %8lu %8lu %9.2f %9.2f %9.2f %9.2f\n",
+		       op_methods[i], res->count, failed, res->ubus_errors,
+		       percentile(res, 0.5), percentile(res, 0.99),
+		       percentile(res, 0.999),
+		       (double)res->latencies[res->count - 1] / 1000);
+		total += res->count;
+	}
+	for (int i = 0; i < __OP_MAX; ++i) {
+		for (int s = 1; s <= MAX_STATUS; ++s) {
+			if (results[i].statuses[s] != 0) {
+				printf("%s status %d%s: %lu\n", op_methods[i],
+				       s, s == MAX_STATUS ? "+" : "",
+				       results[i].statuses[s]);
+			}
+		}
+	}
+	printf("devices: %u, concurrency: %u, elapsed: %.2f s, throughput: %.1f req/s\n",
+	       settings.num_devices, settings.concurrency, elapsed_s,
+	       elapsed_s > 0 ? (double)total / elapsed_s : 0);
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr,
+		"Usage: %s [options]\n"
+		"  -d <device>   device to send commands to, can be repeated;\n"
+		"                all devices from list_devices by default\n"
+		"  -c <count>    requests in flight (default %d, max %d)\n"
+		"  -t <seconds>  duration (default %d)\n"
+		"  -n <count>    stop after this many requests\n"
+		"  -p <count>    pins to use per device (default %d)\n"
+		"  -m <on:off:list>  weights of turn_on_pin, turn_off_pin and\n"
+		"                list_devices requests (default 45:45:10)\n"
+		"  -P <class>    priority of pin commands: high, normal or low\n"
+		"  -s <socket>   ubus socket\n",
+		prog, DEFAULT_CONCURRENCY, MAX_CONCURRENCY, DEFAULT_DURATION_S,
+		DEFAULT_PINS);
+}
+
+static bool parse_uint(const char *str, unsigned long max,
+		       unsigned long *result)
+{
+	char *end;
+	errno = 0;
+	unsigned long val = strtoul(str, &end, 10);
+	if (errno != 0 || end == str || *end != '\0' || val > max) {
+		return false;
+	}
+	*result = val;
+	return true;
+}
+
+static bool parse_weights(const char *str)
+{
+	unsigned int on, off, list;
+	char end;
+	if (sscanf(str, "%u:%u:%u%c", &on, &off, &list, &end) != 3 ||
+	    on + off + list == 0) {
+		return false;
+	}
+	settings.weights[OP_TURN_ON] = on;
+	settings.weights[OP_TURN_OFF] = off;
+	settings.weights[OP_LIST_DEVICES] = list;
+	return true;
+}
+
+static bool parse_args(int argc, char *argv[])
+{
+	unsigned long val;
+	int opt;
+	while ((opt = getopt(argc, argv, "d:c:t:n:p:m:P:s:h")) != -1) {
+		bool ok = true;
+		switch (opt) {
+		case 'd':
+			ok = settings.num_devices < MAX_DEVICES;
+			if (ok) {
+				settings.devices[settings.num_devices++] =
+					optarg;
+			}
+			break;
+		case 'c':
+			ok = parse_uint(optarg, MAX_CONCURRENCY, &val) &&
+			     val > 0;
+			settings.concurrency = (unsigned int)val;
+			break;
+		case 't':
+			ok = parse_uint(optarg, INT_MAX / 1000, &val);
+			settings.duration_s = (unsigned int)val;
+			break;
+		case 'n':
+			ok = parse_uint(optarg, ULONG_MAX, &val);
+			settings.max_requests = val;
+			break;
+		case 'p':
+			ok = parse_uint(optarg, 1024, &val) && val > 0;
+			settings.num_pins = (unsigned int)val;
+			break;
+		case 'm':
+			ok = parse_weights(optarg);
+			break;
+		case 'P':
+			settings.priority = optarg;
+			break;
+		case 's':
+			settings.ubus_socket = optarg;
+			break;
+		default:
+			return false;
+		}
+		if (!ok) {
+			fprintf(stderr, "Invalid value for -%c: %s\n", opt,
+				optarg);
+			return false;
+		}
+	}
+	return optind == argc;
+}
+
+int main(int argc, char *argv[])
+{
+	if (!parse_args(argc, argv)) {
+		usage(argv[0]);
+		return EXIT_FAILURE;
+	}
+	rng_state = now_us() | 1;
+
+	int ret_val = EXIT_FAILURE;
+	uloop_init();
+	ctx = ubus_connect(settings.ubus_socket);
+	if (ctx == NULL) {
+		fprintf(stderr, "Failed to connect to ubus\n");
+		goto cleanup_uloop;
+	}
+	ubus_add_uloop(ctx);
+	int ret = ubus_lookup_id(ctx, "devctl", &devctl_id);
+	if (ret != UBUS_STATUS_OK) {
+		fprintf(stderr, "devctl object not found: %s\n",
+			ubus_strerror(ret));
+		goto cleanup_ubus;
+	}
+	if (settings.num_devices == 0) {
+		ret = ubus_invoke(ctx, devctl_id, op_methods[OP_LIST_DEVICES],
+				  NULL, list_devices_cb, NULL,
+				  LOOKUP_TIMEOUT_MS);
+		if (ret != UBUS_STATUS_OK || settings.num_devices == 0) {
+			fprintf(stderr, "No devices to send commands to\n");
+			goto cleanup_ubus;
+		}
+	}
+
+	for (unsigned int i = 0; i < settings.concurrency; ++i) {
+		slots[i].next.cb = start_request;
+		uloop_timeout_set(&slots[i].next, 0);
+	}
+	if (settings.duration_s != 0) {
+		stop_timer.cb = stop_timer_cb;
+		uloop_timeout_set(&stop_timer,
+				  (int)settings.duration_s * 1000);
+	}
+	uint64_t start = now_us();
+	uloop_run();
+	print_results((double)(now_us() - start) / 1e6);
+	ret_val = EXIT_SUCCESS;
+
+cleanup_ubus:
+	ubus_free(ctx);
+cleanup_uloop:
+	uloop_done();
+	for (unsigned int i = 0; i < MAX_DEVICES; ++i) {
+		free(discovered[i]);
+	}
+	for (int i = 0; i < __OP_MAX; ++i) {
+		free(results[i].latencies);
+	}
+	return ret_val;
+}
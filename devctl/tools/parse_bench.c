@@ -0,0 +1,134 @@
+// Compares parse_device_response() with the json-c based
+// parse_device_response_json() on a corpus of device responses: checks
+// that both return the same results and measures the time per call.
+//
+// Usage: parse-bench [iterations]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <time.h>
+
+#include "response.h"
+
+#define ERROR_BUFSIZE 50
+
+struct sample {
+	const char *msg;
+	bool turn_on;
+};
+
+static const struct sample corpus[] = {
+	// Responses of the documented shape.
+	{ "{\"response\": 0, \"msg\": \"Pin was turned on\"}", true },
+	{ "{\"response\": 0, \"msg\": \"Pin was turned off\"}", false },
+	{ "{\"response\":0,\"msg\":\"Pin was turned on\"}", true },
+	{ "  {\"msg\": \"Pin was turned off\", \"response\": 0}  ", false },
+	{ "{\"response\": 0, \"msg\": \"Pin was turned off\"}", true },
+	{ "{\"response\": 1, \"msg\": \"Invalid pin\"}", true },
+	{ "{\"response\": -1, \"msg\": \"Unknown action\"}", false },
+	{ "{\"response\": 2, \"msg\": \"\"}", true },
+	{ "{\"response\": 1, \"msg\": \"This error message is too long to fit into the error buffer\"}",
+	  true },
+	// Shapes handled by json-c.
+	{ "{\"response\": 0, \"msg\": \"Pin was turned \\u006fn\"}", true },
+	{ "{\"response\": 1, \"msg\": \"Quoted \\\"pin\\\"\"}", true },
+	{ "{\"response\": 0, \"msg\": \"Pin was turned on\", \"pin\": 4}",
+	  true },
+	{ "{\"response\": 1.0, \"msg\": \"Pin was turned on\"}", true },
+	{ "{\"response\": \"0\", \"msg\": \"Pin was turned on\"}", true },
+	{ "{\"response\": 0}", true },
+	{ "{\"msg\": \"Pin was turned on\"}", true },
+	{ "{\"response\": 12345678901, \"msg\": \"Overflow\"}", true },
+	{ "{\"response\": 007, \"msg\": \"Leading zeros\"}", true },
+	{ "{\"response\": 0, \"msg\": 5}", true },
+	{ "[0, \"Pin was turned on\"]", true },
+	{ "{\"response\": 0, \"msg\": \"Pin was turned on\"", true },
+	{ "\x11\x83garbage{\"response\": 0}", true },
+	{ "", true },
+};
+
+typedef int (*parse_fn)(const struct sample *s, char *error_buf,
+			size_t error_len);
+
+static int parse_fast(const struct sample *s, char *error_buf,
+		      size_t error_len)
+{
+	return parse_device_response(s->msg, strlen(s->msg), s->turn_on,
+				     error_buf, error_len);
+}
+
+static int parse_json(const struct sample *s, char *error_buf,
+		      size_t error_len)
+{
+	return parse_device_response_json(s->msg, s->turn_on, error_buf,
+					  error_len);
+}
+
+// Returns the number of samples the parsers disagree on.
+static unsigned int check_corpus(void)
+{
+	unsigned int mismatches = 0;
+	for (size_t i = 0; i < sizeof(corpus) / sizeof(corpus[0]); ++i) {
+		char fast_buf[ERROR_BUFSIZE] = "";
+		char json_buf[ERROR_BUFSIZE] = "";
+		int fast = parse_fast(&corpus[i], fast_buf, sizeof(fast_buf));
+		int json = parse_json(&corpus[i], json_buf, sizeof(json_buf));
+		// Error buffer contents are only defined for these codes.
+		bool same_buf = fast != 1 || strcmp(fast_buf, json_buf) == 0;
+		if (fast != json || !same_buf) {
+			printf("MISMATCH %s: fast %d '%s', json-c %d '%s'\n",
+			       corpus[i].msg, fast, fast_buf, json, json_buf);
+			mismatches += 1;
+		}
+	}
+	return mismatches;
+}
+
+static double now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (double)ts.tv_sec * 1e9 + (double)ts.tv_nsec;
+}
+
+// Returns average time per call in nanoseconds.
+static double bench(parse_fn fn, const struct sample *s, long iterations)
+{
+	char error_buf[ERROR_BUFSIZE];
+	volatile int sink = 0;
+	double start = now_ns();
+	for (long i = 0; i < iterations; ++i) {
+		sink += fn(s, error_buf, sizeof(error_buf));
+	}
+	(void)sink;
+	return (now_ns() - start) / (double)iterations;
+}
+
+int main(int argc, char *argv[])
+{
+	long iterations = 200000;
+	if (argc > 1) {
+		iterations = strtol(argv[1], NULL, 10);
+		if (iterations <= 0) {
+			fprintf(stderr, "Usage: %s [iterations]\n", argv[0]);
+			return EXIT_FAILURE;
+		}
+	}
+
+	unsigned int mismatches = check_corpus();
+	printf("corpus: %zu samples, %u mismatches\n",
+	       sizeof(corpus) / sizeof(corpus[0]), mismatches);
+
+	// Typical responses: success and device error.
+	const struct sample *typical[] = { &corpus[0], &corpus[5] };
+	printf("%-48s %12s %12s\n", "response", "fast ns/op", "json-c ns/op");
+	for (size_t i = 0; i < sizeof(typical) / sizeof(typical[0]); ++i) {
+		double fast = bench(parse_fast, typical[i], iterations);
+		double json = bench(parse_json, typical[i], iterations);
+		printf("%-48s %12.1f %12.1f\n", typical[i]->msg, fast, json);
+	}
+
+	return mismatches == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,313 @@
+// Summarizes a serial traffic recording made by devctl (option
+// record_file): command rate, response latency distribution and the mix
+// of errors, per device and in total.
+//
+// Usage: rec-stat <recording>
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <ctype.h>
+
+#include "recording.h"
+
+// Distinct responses counted per summary, the rest are counted as other.
+#define MAX_KINDS 16
+#define KIND_MAXLEN 48
+// Histogram buckets of powers of two milliseconds, the last one counts
+// everything longer.
+#define HIST_BUCKETS 14
+
+// A kind of response: the status code and message sent by the firmware.
+struct kind {
+	int status;
+	char msg[KIND_MAXLEN];
+	unsigned long count;
+};
+
+struct summary {
+	unsigned long commands;
+	unsigned long outcomes[REC_UNANSWERED + 1];
+	unsigned long unexpected;
+	unsigned long opens;
+	// Latencies of the answered commands.
+	uint64_t *latencies;
+	size_t num_latencies;
+	// Transmit times, for the peak rate.
+	uint64_t *tx_times;
+	size_t num_tx_times;
+	uint64_t first_us;
+	uint64_t last_us;
+	struct kind kinds[MAX_KINDS];
+	size_t num_kinds;
+	unsigned long other_kinds;
+	unsigned long unparsable;
+};
+
+static const char *const outcome_names[] = {
+	[REC_RESPONDED] = "responded",
+	[REC_TIMEOUT] = "timeout",
+	[REC_CLOSED] = "disconnected",
+	[REC_TOO_LONG] = "too long",
+	[REC_UNANSWERED] = "unanswered at end",
+};
+
+// Returns the position after "key": in the response, NULL if not found.
+static const char *find_value(const char *resp, size_t len, const char *key)
+{
+	size_t key_len = strlen(key);
+	const char *end = resp + len;
+	const char *p = memmem(resp, len, key, key_len);
+	if (p == NULL) {
+		return NULL;
+	}
+	p += key_len;
+	while (p < end && isspace((unsigned char)*p)) {
+		++p;
+	}
+	if (p == end || *p != ':') {
+		return NULL;
+	}
+	++p;
+	while (p < end && isspace((unsigned char)*p)) {
+		++p;
+	}
+	return p;
+}
+
+// Counts the response by status and message. Good enough for the flat
+// objects sent by the firmware, not a JSON parser.
+static void count_kind(struct summary *s, const char *resp, size_t len)
+{
+	const char *end = resp + len;
+	const char *p = find_value(resp, len, "\"response\"");
+	if (p == NULL || p == end ||
+	    !(isdigit((unsigned char)*p) || *p == '-')) {
+		s->unparsable += 1;
+		return;
+	}
+	int status = atoi(p);
+	char msg[KIND_MAXLEN] = "";
+	p = find_value(resp, len, "\"msg\"");
+	if (p != NULL && p < end && *p == '"') {
+		++p;
+		size_t n = 0;
+		while (p + n < end && p[n] != '"' && n < sizeof(msg) - 1) {
+			msg[n] = p[n];
+			++n;
+		}
+		msg[n] = '\0';
+	}
+	for (size_t i = 0; i < s->num_kinds; ++i) {
+		if (s->kinds[i].status == status &&
+		    strcmp(s->kinds[i].msg, msg) == 0) {
+			s->kinds[i].count += 1;
+			return;
+		}
+	}
+	if (s->num_kinds == MAX_KINDS) {
+		s->other_kinds += 1;
+		return;
+	}
+	struct kind *k = &s->kinds[s->num_kinds++];
+	k->status = status;
+	memcpy(k->msg, msg, sizeof(msg));
+	k->count = 1;
+}
+
+static bool add_device(struct summary *s, const struct rec_device *dev)
+{
+	size_t n = dev->num_exchanges;
+	uint64_t *latencies = realloc(
+		s->latencies, (s->num_latencies + n) * sizeof(*latencies));
+	if (latencies != NULL) {
+		s->latencies = latencies;
+	}
+	uint64_t *tx_times = realloc(
+		s->tx_times, (s->num_tx_times + n) * sizeof(*tx_times));
+	if (tx_times != NULL) {
+		s->tx_times = tx_times;
+	}
+	if (n > 0 && (latencies == NULL || tx_times == NULL)) {
+		fprintf(stderr, "Out of memory\n");
+		return false;
+	}
+	for (size_t i = 0; i < n; ++i) {
+		const struct rec_exchange *ex = &dev->exchanges[i];
+		if (s->commands == 0 || ex->tx_us < s->first_us) {
+			s->first_us = ex->tx_us;
+		}
+		if (ex->tx_us > s->last_us) {
+			s->last_us = ex->tx_us;
+		}
+		s->commands += 1;
+		s->outcomes[ex->outcome] += 1;
+		s->tx_times[s->num_tx_times++] = ex->tx_us;
+		if (ex->outcome == REC_RESPONDED) {
+			s->latencies[s->num_latencies++] = ex->latency_us;
+			count_kind(s, ex->resp, ex->resp_len);
+		}
+	}
+	s->unexpected += dev->unexpected;
+	s->opens += dev->opens;
+	return true;
+}
+
+static int compare_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a;
+	uint64_t y = *(const uint64_t *)b;
+	return x < y ? -1 : x > y;
+}
+
+static int compare_kinds(const void *a, const void *b)
+{
+	const struct kind *x = a;
+	const struct kind *y = b;
+	return x->count > y->count ? -1 : x->count < y->count;
+}
+
+// Returns the percentile of the sorted values.
+static double percentile_ms(const uint64_t *sorted, size_t n, double p)
+{
+	size_t i = (size_t)(p * (double)(n - 1) + 0.5);
+	return (double)sorted[i] / 1000;
+}
+
+// Returns the highest number of commands sent within one second.
+static unsigned long peak_rate(const uint64_t *sorted, size_t n)
+{
+	size_t peak = 0;
+	size_t first = 0;
+	for (size_t i = 0; i < n; ++i) {
+		while (sorted[i] - sorted[first] >= 1000000) {
+			++first;
+		}
+		if (i - first + 1 > peak) {
+			peak = i - first + 1;
+		}
+	}
+	return (unsigned long)peak;
+}
+
+static void print_latency(struct summary *s)
+{
+	size_t n = s->num_latencies;
+	if (n == 0) {
+		return;
+	}
+	qsort(s->latencies, n, sizeof(uint64_t), compare_u64);
+	uint64_t total = 0;
+	unsigned long hist[HIST_BUCKETS] = { 0 };
+	for (size_t i = 0; i < n; ++i) {
+		total += s->latencies[i];
+		uint64_t ms = s->latencies[i] / 1000;
+		unsigned int bucket =
+			ms != 0 ? 64 - (unsigned int)__builtin_clzll(ms) : 0;
+		hist[bucket < HIST_BUCKETS ? bucket : HIST_BUCKETS - 1] += 1;
+	}
+	printf("  latency ms: avg %.2f, p50 %.2f, p90 %.2f, p99 %.2f, "
+	       "p99.9 %.2f, max %.2f\n",
+	       (double)total / (double)n / 1000,
+	       percentile_ms(s->latencies, n, 0.5),
+	       percentile_ms(s->latencies, n, 0.9),
+	       percentile_ms(s->latencies, n, 0.99),
+	       percentile_ms(s->latencies, n, 0.999),
+	       (double)s->latencies[n - 1] / 1000);
+	for (unsigned int i = 0; i < HIST_BUCKETS; ++i) {
+		if (hist[i] == 0) {
+			continue;
+		}
+		char range[32];
+		if (i == 0) {
+			snprintf(range, sizeof(range), "< 1");
+		} else if (i == HIST_BUCKETS - 1) {
+			snprintf(range, sizeof(range), ">= %u", 1U << (i - 1));
+		} else {
+			snprintf(range, sizeof(range), "%u - %u", 1U << (i - 1),
+				 1U << i);
+		}
+		printf("    %12s ms: %8lu  %5.1f%%\n", range, hist[i],
+		       100.0 * (double)hist[i] / (double)n);
+	}
+}
+
+static void print_summary(const char *title, struct summary *s)
+{
+	printf("%s\n", title);
+	double span_s = (double)(s->last_us - s->first_us) / 1e6;
+	qsort(s->tx_times, s->num_tx_times, sizeof(uint64_t), compare_u64);
+	printf("  commands: %lu, %.1f/s, peak %lu/s\n", s->commands,
+	       span_s > 0 ? (double)s->commands / span_s : 0,
+	       peak_rate(s->tx_times, s->num_tx_times));
+	printf("  outcomes:");
+	for (size_t i = 0; i <= REC_UNANSWERED; ++i) {
+		printf("%s %s %lu", i == 0 ? "" : ",", outcome_names[i],
+		       s->outcomes[i]);
+	}
+	printf("\n  unexpected lines: %lu, connections opened: %lu\n",
+	       s->unexpected, s->opens);
+	print_latency(s);
+	if (s->num_kinds == 0 && s->unparsable == 0) {
+		return;
+	}
+	printf("  responses:\n");
+	qsort(s->kinds, s->num_kinds, sizeof(s->kinds[0]), compare_kinds);
+	for (size_t i = 0; i < s->num_kinds; ++i) {
+		printf("    %8lu  %d \"%s\"\n", s->kinds[i].count,
+		       s->kinds[i].status, s->kinds[i].msg);
+	}
+	if (s->other_kinds > 0) {
+		printf("    %8lu  other\n", s->other_kinds);
+	}
+	if (s->unparsable > 0) {
+		printf("    %8lu  unparsable\n", s->unparsable);
+	}
+}
+
+static void free_summary(struct summary *s)
+{
+	free(s->latencies);
+	free(s->tx_times);
+}
+
+int main(int argc, char *argv[])
+{
+	if (argc != 2 || argv[1][0] == '-') {
+		fprintf(stderr, "Usage: %s <recording>\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+	struct recording rec;
+	if (!recording_load(argv[1], &rec)) {
+		recording_free(&rec);
+		return EXIT_FAILURE;
+	}
+	printf("%s: %.1f s, %u devices%s\n\n", argv[1],
+	       (double)rec.duration_us / 1e6, rec.num_devices,
+	       rec.truncated ? ", last record truncated" : "");
+
+	int ret = EXIT_SUCCESS;
+	struct summary total = { 0 };
+	for (unsigned int i = 0; i < rec.num_devices; ++i) {
+		struct summary s = { 0 };
+		if (!add_device(&s, &rec.devices[i]) ||
+		    !add_device(&total, &rec.devices[i])) {
+			free_summary(&s);
+			ret = EXIT_FAILURE;
+			break;
+		}
+		print_summary(rec.devices[i].name, &s);
+		printf("\n");
+		free_summary(&s);
+	}
+	if (ret == EXIT_SUCCESS && rec.num_devices > 1) {
+		print_summary("all devices", &total);
+	}
+	free_summary(&total);
+	recording_free(&rec);
+	return ret;
+}
@@ -0,0 +1,214 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "recording.h"
+
+static uint64_t read_le(const unsigned char *p, size_t len)
+{
+	uint64_t val = 0;
+	for (size_t i = 0; i < len; ++i) {
+		val |= (uint64_t)p[i] << (8 * i);
+	}
+	return val;
+}
+
+static bool read_file(const char *path, struct recording *rec)
+{
+	FILE *f = fopen(path, "rb");
+	if (f == NULL) {
+		perror(path);
+		return false;
+	}
+	size_t capacity = 0;
+	for (;;) {
+		if (rec->size == capacity) {
+			capacity = capacity != 0 ? capacity * 2 : 65536;
+			unsigned char *data = realloc(rec->data, capacity);
+			if (data == NULL) {
+				fprintf(stderr, "Out of memory\n");
+				fclose(f);
+				return false;
+			}
+			rec->data = data;
+		}
+		size_t len = fread(rec->data + rec->size, 1,
+				   capacity - rec->size, f);
+		rec->size += len;
+		if (len == 0) {
+			break;
+		}
+	}
+	bool ok = !ferror(f);
+	if (!ok) {
+		perror(path);
+	}
+	fclose(f);
+	return ok;
+}
+
+// Ends the exchanges waiting for a response with the outcome.
+static void end_unanswered(struct rec_device *dev, enum rec_outcome outcome,
+			   uint64_t now_us)
+{
+	for (size_t i = dev->first_unanswered; i < dev->num_exchanges; ++i) {
+		dev->exchanges[i].outcome = outcome;
+		dev->exchanges[i].latency_us = now_us - dev->exchanges[i].tx_us;
+	}
+	dev->first_unanswered = dev->num_exchanges;
+}
+
+static bool add_exchange(struct rec_device *dev, uint64_t now_us,
+			 const unsigned char *data, size_t len)
+{
+	if (dev->num_exchanges == dev->capacity) {
+		size_t capacity = dev->capacity != 0 ? dev->capacity * 2 : 256;
+		struct rec_exchange *exchanges = realloc(
+			dev->exchanges, capacity * sizeof(*exchanges));
+		if (exchanges == NULL) {
+			fprintf(stderr, "Out of memory\n");
+			return false;
+		}
+		dev->exchanges = exchanges;
+		dev->capacity = capacity;
+	}
+	dev->exchanges[dev->num_exchanges++] = (struct rec_exchange){
+		.tx_us = now_us,
+		.outcome = REC_UNANSWERED,
+		.cmd = (const char *)data,
+		.cmd_len = len,
+	};
+	return true;
+}
+
+// Ends the first exchange waiting for a response with the outcome.
+static void end_first(struct rec_device *dev, enum rec_outcome outcome,
+		      uint64_t now_us)
+{
+	if (dev->first_unanswered == dev->num_exchanges) {
+		return;
+	}
+	struct rec_exchange *ex = &dev->exchanges[dev->first_unanswered++];
+	ex->outcome = outcome;
+	ex->latency_us = now_us - ex->tx_us;
+}
+
+// Matches a received line to the first exchange waiting for a response,
+// like devctl does.
+static void add_response(struct rec_device *dev, uint64_t now_us,
+			 const unsigned char *data, size_t len)
+{
+	if (dev->first_unanswered == dev->num_exchanges) {
+		dev->unexpected += 1;
+		return;
+	}
+	struct rec_exchange *ex = &dev->exchanges[dev->first_unanswered++];
+	ex->outcome = REC_RESPONDED;
+	ex->latency_us = now_us - ex->tx_us;
+	ex->resp = (const char *)data;
+	ex->resp_len = len;
+}
+
+bool recording_load(const char *path, struct recording *rec)
+{
+	memset(rec, 0, sizeof(*rec));
+	if (!read_file(path, rec)) {
+		return false;
+	}
+	if (rec->size < RECORD_MAGIC_LEN ||
+	    memcmp(rec->data, RECORD_MAGIC, RECORD_MAGIC_LEN) != 0) {
+		fprintf(stderr, "%s is not a devctl recording\n", path);
+		return false;
+	}
+
+	size_t pos = RECORD_MAGIC_LEN;
+	bool have_start = false;
+	uint64_t start_us = 0;
+	uint64_t now_us = 0;
+	while (pos < rec->size) {
+		if (rec->size - pos < RECORD_HEADER_SIZE) {
+			rec->truncated = true;
+			break;
+		}
+		const unsigned char *header = rec->data + pos;
+		unsigned int type = header[0];
+		unsigned int index = header[1];
+		size_t len = (size_t)read_le(header + 2, 2);
+		if (rec->size - pos - RECORD_HEADER_SIZE < len) {
+			rec->truncated = true;
+			break;
+		}
+		const unsigned char *data = header + RECORD_HEADER_SIZE;
+		pos += RECORD_HEADER_SIZE + len;
+
+		uint64_t timestamp = read_le(header + 4, 8);
+		if (!have_start) {
+			start_us = timestamp;
+			have_start = true;
+		}
+		// Timestamps are monotonic, this only guards against a
+		// corrupt file.
+		if (timestamp - start_us > now_us) {
+			now_us = timestamp - start_us;
+		}
+
+		if (type == RECORD_DEVICE) {
+			if (index != rec->num_devices) {
+				fprintf(stderr,
+					"%s: unexpected device index %u\n",
+					path, index);
+				return false;
+			}
+			char *name = strndup((const char *)data, len);
+			if (name == NULL) {
+				fprintf(stderr, "Out of memory\n");
+				return false;
+			}
+			rec->devices[rec->num_devices++].name = name;
+			continue;
+		}
+		if (index >= rec->num_devices) {
+			fprintf(stderr, "%s: record of unknown device %u\n",
+				path, index);
+			return false;
+		}
+		struct rec_device *dev = &rec->devices[index];
+		switch (type) {
+		case RECORD_OPEN:
+			dev->opens += 1;
+			break;
+		case RECORD_CLOSE:
+			end_unanswered(dev, REC_CLOSED, now_us);
+			break;
+		case RECORD_TX:
+			if (!add_exchange(dev, now_us, data, len)) {
+				return false;
+			}
+			break;
+		case RECORD_RX:
+			add_response(dev, now_us, data, len);
+			break;
+		case RECORD_TIMEOUT:
+			end_unanswered(dev, REC_TIMEOUT, now_us);
+			break;
+		case RECORD_TOO_LONG:
+			end_first(dev, REC_TOO_LONG, now_us);
+			break;
+		default:
+			// Added by a newer devctl, not needed for pairing.
+			break;
+		}
+	}
+	rec->duration_us = now_us;
+	return true;
+}
+
+void recording_free(struct recording *rec)
+{
+	for (unsigned int i = 0; i < rec->num_devices; ++i) {
+		free(rec->devices[i].name);
+		free(rec->devices[i].exchanges);
+	}
+	free(rec->data);
+	memset(rec, 0, sizeof(*rec));
+}
@@ -0,0 +1,73 @@
+// Reads serial traffic recordings made by devctl (see src/record.h) and
+// pairs the messages written to every device with their responses.
+
+#ifndef RECORDING_H
+#define RECORDING_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "record.h"
+
+enum rec_outcome {
+	REC_RESPONDED,
+	// The device did not respond in time.
+	REC_TIMEOUT,
+	// The connection was closed before the response arrived, e.g. the
+	// device was disconnected.
+	REC_CLOSED,
+	// The response was too long and was discarded.
+	REC_TOO_LONG,
+	// The recording ended before the response arrived.
+	REC_UNANSWERED,
+};
+
+// A message written to a device and what came back.
+struct rec_exchange {
+	// When the message was written, microseconds since the start of the
+	// recording.
+	uint64_t tx_us;
+	// Time from writing the message to receiving the response.
+	uint64_t latency_us;
+	enum rec_outcome outcome;
+	// Message and response, not null-terminated. Point into the loaded
+	// file. resp is NULL unless outcome is REC_RESPONDED.
+	const char *cmd;
+	size_t cmd_len;
+	const char *resp;
+	size_t resp_len;
+};
+
+struct rec_device {
+	// Device file name, null-terminated.
+	char *name;
+	// In the order the messages were written.
+	struct rec_exchange *exchanges;
+	size_t num_exchanges;
+	size_t capacity;
+	// First exchange still waiting for its response while loading.
+	size_t first_unanswered;
+	// Lines received while no message was waiting for a response.
+	unsigned long unexpected;
+	unsigned long opens;
+};
+
+struct recording {
+	unsigned char *data;
+	size_t size;
+	struct rec_device devices[RECORD_MAX_DEVICES];
+	unsigned int num_devices;
+	// Time of the last record, microseconds since the first one.
+	uint64_t duration_us;
+	// The file ends with a partial record, e.g. devctl was killed.
+	bool truncated;
+};
+
+// Loads the recording. Prints the reason to stderr on failure.
+// Returns false if the file cannot be read or is not a recording.
+bool recording_load(const char *path, struct recording *rec);
+
+void recording_free(struct recording *rec);
+
+#endif